@@ -0,0 +1,378 @@
+#include "x86.hpp"
+#include <llvm/IR/BasicBlock.h>       // for llvm::BasicBlock
+#include <llvm/IR/CFG.h>              // for llvm::successors
+#include <llvm/IR/Constants.h>        // for llvm::ConstantInt, llvm::ConstantExpr
+#include <llvm/IR/Function.h>         // for llvm::Function
+#include <llvm/IR/InstrTypes.h>       // for llvm::BinaryOperator, llvm::CastInst
+#include <llvm/IR/Instructions.h>     // for llvm::PHINode
+#include <llvm/IR/Value.h>            // for llvm::Value
+#include <llvm/Support/Casting.h>     // for llvm::isa, llvm::cast
+#include <llvm/Support/raw_ostream.h> // for llvm::errs
+#include <algorithm>                  // for std::stable_sort, std::min, std::max
+#include <cmath>                      // for std::pow
+#include <cstdint>                    // for INT64_MAX, INT64_MIN
+#include <map>                        // for std::map
+#include <set>                        // for std::set
+#include <vector>                     // for std::vector
+
+// The slot allocator.
+//
+// Before we generate any code for a function, we decide where every value in it is going to live for its whole life.
+// That way every path through the function agrees on where everything is, no matter what order the blocks get
+// generated in, and phi nodes can get their incoming values from blocks that haven't been generated yet.
+//
+// It's a linear scan: number the instructions in the order they'll be generated, work out the range of numbers that
+// each value is live over, then walk through the ranges in order of where they start, handing out slots and taking
+// them back from ranges that have ended.
+
+namespace {
+
+// The range of positions over which a value is live, including both ends.
+struct live_interval {
+    int64_t start;
+    int64_t end;
+};
+
+} // namespace
+
+// Standard backwards dataflow. Phi nodes are defined at the top of their block, and their incoming values are used at
+// the bottom of the block they come from.
+liveness compute_liveness(llvm::Function const &function) {
+    std::map<llvm::BasicBlock const *, std::set<llvm::Value const *>> defs;
+    std::map<llvm::BasicBlock const *, std::set<llvm::Value const *>> uses;
+    std::map<llvm::BasicBlock const *, std::set<llvm::Value const *>> phi_uses;
+
+    for (llvm::BasicBlock const &block : function) {
+        for (llvm::Instruction const &instruction : block) {
+            if (!llvm::isa<llvm::PHINode>(instruction)) {
+                for (llvm::Value const *operand : instruction.operands()) {
+                    if (needs_slot(*operand) && defs[&block].count(operand) == 0) {
+                        uses[&block].insert(operand);
+                    }
+                }
+            }
+            if (needs_slot(instruction)) {
+                defs[&block].insert(&instruction);
+            }
+        }
+
+        for (llvm::BasicBlock const *successor : llvm::successors(&block)) {
+            for (llvm::PHINode const &phi_node : successor->phis()) {
+                llvm::Value const *incoming_value = phi_node.getIncomingValueForBlock(&block);
+                if (needs_slot(*incoming_value)) {
+                    phi_uses[&block].insert(incoming_value);
+                }
+            }
+        }
+    }
+
+    liveness result;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (auto it = function.getBasicBlockList().rbegin(); it != function.getBasicBlockList().rend(); it++) {
+            llvm::BasicBlock const *block = &*it;
+
+            std::set<llvm::Value const *> out = phi_uses[block];
+            for (llvm::BasicBlock const *successor : llvm::successors(block)) {
+                // Note that phi nodes are never live into their own block, since they count as defined at the top.
+                out.insert(result.live_in[successor].begin(), result.live_in[successor].end());
+            }
+
+            std::set<llvm::Value const *> in = uses[block];
+            for (llvm::Value const *value : out) {
+                if (defs[block].count(value) == 0) {
+                    in.insert(value);
+                }
+            }
+
+            if (in != result.live_in[block] || out != result.live_out[block]) {
+                result.live_in[block] = in;
+                result.live_out[block] = out;
+                changed = true;
+            }
+        }
+    }
+
+    return result;
+}
+
+// Finds the values in @function that are the same constant no matter what: arithmetic and casts on constants, and phi
+// nodes that only ever get one constant (or themselves). Value numbering folds most arithmetic on constants already,
+// but phi nodes can still turn out constant once the passes are done with them. Every use can just have the constant
+// as an immediate, which is free to rematerialize, so these never need a slot or any code. Comparisons and i1s are
+// left out, since those get read out of the flags.
+static std::map<llvm::Value const *, llvm::ConstantInt *> find_rematerializable(llvm::Function const &function) {
+    std::map<llvm::Value const *, llvm::ConstantInt *> constants;
+    auto constant = [&](llvm::Value *value) -> llvm::ConstantInt * {
+        auto it = constants.find(value);
+        return it == constants.end() ? llvm::dyn_cast<llvm::ConstantInt>(value) : it->second;
+    };
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (llvm::BasicBlock const &block : function) {
+            for (llvm::Instruction const &instruction : block) {
+                if (constants.count(&instruction) != 0 || !instruction.getType()->isIntegerTy() || instruction.getType()->isIntegerTy(1)) {
+                    continue;
+                }
+
+                llvm::Constant *folded = nullptr;
+                if (llvm::isa<llvm::PHINode>(instruction)) {
+                    bool same = true;
+                    for (llvm::Value *incoming_value : llvm::cast<llvm::PHINode>(instruction).incoming_values()) {
+                        if (incoming_value == &instruction) {
+                            continue;
+                        }
+                        llvm::ConstantInt *incoming_constant = constant(incoming_value);
+                        same = same && incoming_constant != nullptr && (folded == nullptr || folded == incoming_constant);
+                        folded = incoming_constant;
+                    }
+                    folded = same ? folded : nullptr;
+                }
+                else if (llvm::isa<llvm::BinaryOperator>(instruction) && constant(instruction.getOperand(0)) != nullptr &&
+                         constant(instruction.getOperand(1)) != nullptr) {
+                    // Dividing by zero and the like comes out as poison, which isn't a ConstantInt.
+                    folded = llvm::ConstantExpr::get(instruction.getOpcode(), constant(instruction.getOperand(0)), constant(instruction.getOperand(1)));
+                }
+                else if (llvm::isa<llvm::CastInst>(instruction) && constant(instruction.getOperand(0)) != nullptr) {
+                    folded = llvm::ConstantExpr::getCast(instruction.getOpcode(), constant(instruction.getOperand(0)), instruction.getType());
+                }
+
+                if (folded != nullptr && llvm::isa<llvm::ConstantInt>(folded)) {
+                    constants.insert({&instruction, llvm::cast<llvm::ConstantInt>(folded)});
+                    changed = true;
+                }
+            }
+        }
+    }
+    return constants;
+}
+
+// Makes a brand new stack slot below all the others.
+x86Program::slot x86Program::new_stack_slot(void) {
+    // The prologue makes room for this once we know how deep the stack goes.
+    top_of_stack -= 8;
+    frame->lowest_offset = top_of_stack;
+    slot s{-top_of_stack, new x86Pointer(frame->base, top_of_stack)};
+    all_slots.insert(s.second);
+    return s;
+}
+
+// Takes the best available slot, making a new stack slot if the registers have run out.
+x86Program::slot x86Program::take_slot(void) {
+    if (available_slots.empty()) {
+        available_slots.push(new_stack_slot());
+    }
+    slot s = available_slots.top();
+    available_slots.pop();
+
+    if (s.second->type == x86Source::REG) {
+        frame->used_registers.insert(static_cast<x86Register *>(s.second)->name);
+    }
+
+    return s;
+}
+
+// Like take_slot, but insists on the register named @register_name. The register had better be available.
+// Used for values that arrive in a particular register, like arguments, so they don't have to be copied anywhere.
+x86Program::slot x86Program::take_register_slot(std::string const &register_name) {
+    std::vector<slot> others;
+    slot s{0, nullptr};
+    while (!available_slots.empty()) {
+        slot candidate = available_slots.top();
+        available_slots.pop();
+        if (candidate.second == register_slots[register_name]) {
+            s = candidate;
+        }
+        else {
+            others.push_back(candidate);
+        }
+    }
+    for (slot const &other : others) {
+        available_slots.push(other);
+    }
+
+    if (s.second == nullptr) {
+        llvm::errs() << "ERROR: %" << register_name << " ISN'T AVAILABLE.\n";
+        return take_slot();
+    }
+
+    frame->used_registers.insert(register_name);
+    return s;
+}
+
+// Decides on a slot for every value in @function that needs one, and puts them all in used_slots.
+void x86Program::allocate_slots(llvm::Function const &function) {
+    liveness live = compute_liveness(function);
+    rematerialized = find_rematerializable(function);
+
+    // Every value that needs a slot goes in `values` in the order it's defined, so that ties always get broken the same
+    // way and we generate the same code every time.
+    std::map<llvm::Value const *, live_interval> intervals;
+    std::vector<llvm::Value const *> values;
+    for (llvm::Argument const &arg : function.args()) {
+        if (needs_slot(arg)) {
+            values.push_back(&arg);
+        }
+    }
+    for (llvm::BasicBlock const &block : function) {
+        for (llvm::Instruction const &instruction : block) {
+            if (needs_slot(instruction) && rematerialized.count(&instruction) == 0) {
+                values.push_back(&instruction);
+            }
+        }
+    }
+    for (llvm::Value const *value : values) {
+        intervals.insert({value, {INT64_MAX, INT64_MIN}});
+    }
+
+    auto extend = [&](llvm::Value const *value, int64_t position) {
+        live_interval &interval = intervals[value];
+        interval.start = std::min(interval.start, position);
+        interval.end = std::max(interval.end, position);
+    };
+
+    // Number everything in the order it'll be generated. The arguments all show up at 0, before anything else.
+    for (llvm::Value const *value : values) {
+        if (llvm::isa<llvm::Argument>(value)) {
+            extend(value, 0);
+        }
+    }
+
+    int64_t position = 1;
+    for (llvm::BasicBlock const &block : function) {
+        int64_t block_start = position++;
+        for (llvm::Value const *value : live.live_in[&block]) {
+            extend(value, block_start);
+        }
+
+        for (llvm::Instruction const &instruction : block) {
+            if (llvm::isa<llvm::PHINode>(instruction)) {
+                if (needs_slot(instruction)) {
+                    extend(&instruction, block_start);
+                }
+                continue;
+            }
+
+            int64_t here = position++;
+            for (llvm::Value const *operand : instruction.operands()) {
+                if (needs_slot(*operand)) {
+                    extend(operand, here);
+                }
+            }
+            if (needs_slot(instruction)) {
+                extend(&instruction, here);
+            }
+        }
+
+        int64_t block_end = position++;
+        for (llvm::Value const *value : live.live_out[&block]) {
+            extend(value, block_end);
+        }
+    }
+
+    // How much it would cost to spill each value: a memory access at every place it's defined or used, each one paid
+    // every time its block runs. With a profile, we know how many times that is. Without one, every loop a block is in
+    // is guessed to go around ten times.
+    auto block_weight = [&](llvm::BasicBlock const *block) {
+        auto count = options.block_counts.find(block);
+        if (count != options.block_counts.end()) {
+            return (double)count->second;
+        }
+        return std::pow(10.0, loop_depths[block]);
+    };
+    std::map<llvm::Value const *, double> weights;
+    for (llvm::BasicBlock const &block : function) {
+        double weight = block_weight(&block);
+        for (llvm::Instruction const &instruction : block) {
+            if (needs_slot(instruction)) {
+                weights[&instruction] += weight;
+            }
+            for (unsigned i = 0; i < instruction.getNumOperands(); i++) {
+                llvm::Value const *operand = instruction.getOperand(i);
+                if (!needs_slot(*operand)) {
+                    continue;
+                }
+                // Phi nodes use their incoming values over in the blocks they come from.
+                if (llvm::isa<llvm::PHINode>(instruction)) {
+                    weights[operand] += block_weight(llvm::cast<llvm::PHINode>(instruction).getIncomingBlock(i));
+                }
+                else {
+                    weights[operand] += weight;
+                }
+            }
+        }
+    }
+
+    std::stable_sort(values.begin(), values.end(),
+                     [&](llvm::Value const *a, llvm::Value const *b) { return intervals[a].start < intervals[b].start; });
+
+    // Walk through the intervals in order.
+    // Note that a slot can be reused by a value that's defined by the instruction that last uses the slot's old value,
+    // since every instruction reads all of its operands before it writes its result.
+    std::vector<llvm::Value const *> active;
+    // Where each slot that's been given back stopped being used.
+    std::map<x86Destination *, int64_t> free_since;
+    for (llvm::Value const *value : values) {
+        live_interval const &interval = intervals[value];
+
+        for (auto it = active.begin(); it != active.end();) {
+            if (intervals[*it].end <= interval.start) {
+                available_slots.push(used_slots[*it]);
+                free_since[used_slots[*it].second] = intervals[*it].end;
+                it = active.erase(it);
+            }
+            else {
+                it++;
+            }
+        }
+
+        slot s{0, nullptr};
+        if (llvm::isa<llvm::Argument>(value)) {
+            // Arguments already live somewhere, so they stay there.
+            unsigned arg_no = llvm::cast<llvm::Argument>(value)->getArgNo();
+            if (arg_no < ARGUMENT_REGISTERS.size()) {
+                s = take_register_slot(ARGUMENT_REGISTERS[arg_no]);
+            }
+            else {
+                int64_t offset = 16 + 8 * (arg_no - ARGUMENT_REGISTERS.size());
+                s = {STACK_ARGUMENT_PRIORITY + offset, new x86Pointer(frame->base, offset)};
+                all_slots.insert(s.second);
+            }
+        }
+        else {
+            s = take_slot();
+
+            // Out of registers. If something that has one would be cheaper to spill than this, that gets spilled
+            // instead, and this gets its register. Arguments stay in the registers they arrive in.
+            if (s.second->type != x86Source::REG) {
+                llvm::Value const *victim = nullptr;
+                for (llvm::Value const *other : active) {
+                    if (llvm::isa<llvm::Argument>(other) || used_slots[other].second->type != x86Source::REG || weights[other] >= weights[value]) {
+                        continue;
+                    }
+                    // Out of the cheapest ones, spill the one that's going to hold onto its register the longest.
+                    if (victim == nullptr || weights[other] < weights[victim] ||
+                        (weights[other] == weights[victim] && intervals[other].end > intervals[victim].end)) {
+                        victim = other;
+                    }
+                }
+
+                if (victim != nullptr) {
+                    // The victim lives in its new slot for its whole life, including the part before now, so the slot has
+                    // to have been free that whole time.
+                    if (free_since.count(s.second) != 0 && free_since[s.second] > intervals[victim].start) {
+                        available_slots.push(s);
+                        s = new_stack_slot();
+                    }
+                    std::swap(s, used_slots[victim]);
+                }
+            }
+        }
+
+        used_slots.insert({value, s});
+        active.push_back(value);
+    }
+}
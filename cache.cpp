@@ -0,0 +1,102 @@
+#include "cache.hpp"
+#include "x86.hpp"
+#include <llvm/ADT/SmallString.h>     // for llvm::SmallString
+#include <llvm/ADT/StringExtras.h>    // for llvm::toHex
+#include <llvm/IR/BasicBlock.h>       // for llvm::BasicBlock
+#include <llvm/IR/Instructions.h>     // for llvm::CallInst
+#include <llvm/IR/Module.h>           // for llvm::Module
+#include <llvm/Support/FileSystem.h>  // for llvm::sys::fs::create_directories, llvm::sys::fs::createUniqueFile
+#include <llvm/Support/MemoryBuffer.h> // for llvm::MemoryBuffer
+#include <llvm/Support/Path.h>        // for llvm::sys::path::append
+#include <llvm/Support/SHA1.h>        // for llvm::SHA1
+#include <llvm/Support/raw_ostream.h> // for llvm::raw_string_ostream, llvm::raw_fd_ostream, llvm::errs
+#include <string>                     // for std::string, std::stoull
+#include <utility>                    // for std::pair
+
+// Code from a different build of the code generator might not be what this one would generate, so every build gets
+// its own hashes.
+static char const BUILD_STAMP[] = __DATE__ " " __TIME__;
+
+// Returns where the code filed under @key lives in the cache at @directory.
+static std::string cache_path(std::string const &directory, std::string const &key) {
+    llvm::SmallString<256> path(directory);
+    llvm::sys::path::append(path, key + ".s");
+    return std::string(path);
+}
+
+std::string cache_key(llvm::Function const &function, x86Options const &options, std::map<llvm::Function const *, x86RegisterSet> const &clobbers) {
+    std::string contents;
+    llvm::raw_string_ostream os(contents);
+    os << BUILD_STAMP << "\n" << function.getParent()->getDataLayoutStr() << "\n" << options.vector_bits << "\n";
+    function.print(os);
+    for (llvm::BasicBlock const &block : function) {
+        auto count = options.block_counts.find(&block);
+        if (count != options.block_counts.end()) {
+            os << count->second << "\n";
+        }
+    }
+    // Calls only save what the function being called clobbers.
+    for (llvm::BasicBlock const &block : function) {
+        for (llvm::Instruction const &instruction : block) {
+            llvm::CallInst const *call = llvm::dyn_cast<llvm::CallInst>(&instruction);
+            if (call == nullptr) {
+                continue;
+            }
+            auto clobbered = clobbers.find(call->getCalledFunction());
+            os << (clobbered == clobbers.end() ? ~x86RegisterSet(0) : clobbered->second) << "\n";
+        }
+    }
+
+    llvm::SHA1 hasher;
+    hasher.update(os.str());
+    return llvm::toHex(hasher.final(), true);
+}
+
+// A cache file starts with a line saying how long the instructions are and what they clobber, then has the
+// instructions, then the data.
+bool cache_load(std::string const &directory, std::string const &key, std::string &text, std::string &data, x86RegisterSet &clobbers) {
+    llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer = llvm::MemoryBuffer::getFile(cache_path(directory, key));
+    if (!buffer) {
+        return false;
+    }
+
+    llvm::StringRef contents = (*buffer)->getBuffer();
+    size_t newline = contents.find('\n');
+    std::pair<llvm::StringRef, llvm::StringRef> fields = contents.substr(0, newline).split(' ');
+    uint64_t text_size;
+    if (newline == llvm::StringRef::npos || fields.first.getAsInteger(10, text_size) || fields.second.getAsInteger(10, clobbers) ||
+        newline + 1 + text_size > contents.size()) {
+        llvm::errs() << "ERROR: THE CACHE FILE FOR " << key << " IS BROKEN.\n";
+        return false;
+    }
+
+    text = contents.substr(newline + 1, text_size).str();
+    data = contents.substr(newline + 1 + text_size).str();
+    return true;
+}
+
+// Writes to a file of its own first and then renames it into place, so that nobody ever reads a half-written file,
+// even if several copies of the code generator are filling in the cache at once.
+void cache_store(std::string const &directory, std::string const &key, std::string const &text, std::string const &data,
+                 x86RegisterSet clobbers) {
+    if (llvm::sys::fs::create_directories(directory)) {
+        llvm::errs() << "ERROR: COULDN'T MAKE THE CACHE DIRECTORY " << directory << ".\n";
+        return;
+    }
+
+    int fd;
+    llvm::SmallString<256> temporary_path;
+    if (llvm::sys::fs::createUniqueFile(cache_path(directory, key + "-%%%%%%%%"), fd, temporary_path)) {
+        llvm::errs() << "ERROR: COULDN'T WRITE TO THE CACHE DIRECTORY " << directory << ".\n";
+        return;
+    }
+
+    {
+        llvm::raw_fd_ostream out(fd, true);
+        out << text.size() << " " << clobbers << "\n" << text << data;
+    }
+
+    if (llvm::sys::fs::rename(temporary_path, cache_path(directory, key))) {
+        llvm::sys::fs::remove(temporary_path);
+    }
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "x86.hpp"
+#include <llvm/IR/Function.h> // for llvm::Function
+#include <map>                // for std::map
+#include <string>             // for std::string
+
+// The on-disk cache of generated code, for --cache.
+// Every function's code gets filed under a hash of everything that went into generating it: its IR after all the
+// passes, what the profile said about it, which registers the functions it calls clobber, the data layout, and which
+// build of the code generator made it. If the hash
+// matches next time, the code is the same, so it gets pulled out of the cache instead of being generated again.
+// Labels all start with their function's name, so a function's code can be dropped in anywhere.
+
+// Returns the hash that the code for @function gets filed under when it's generated with @options, and with @clobbers
+// saying what the functions it calls clobber. Those get generated first, unless they call it back.
+std::string cache_key(llvm::Function const &function, x86Options const &options, std::map<llvm::Function const *, x86RegisterSet> const &clobbers);
+
+// Looks for code filed under @key in the cache at @directory. If it's there, puts the instructions in @text, the
+// constant data in @data and what the code clobbers in @clobbers, and returns true.
+bool cache_load(std::string const &directory, std::string const &key, std::string &text, std::string &data, x86RegisterSet &clobbers);
+
+// Files @text, @data and @clobbers under @key in the cache at @directory.
+void cache_store(std::string const &directory, std::string const &key, std::string const &text, std::string const &data,
+                 x86RegisterSet clobbers);
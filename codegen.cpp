@@ -4,46 +4,237 @@
 // 21 May 2022  jpb  Creation.
 // 24 May 2022  bpk  Change everything.
 
+#include "cache.hpp"
+#include "passes.hpp"
 #include "x86.hpp"
+#include <llvm/ADT/SmallString.h>     // for SmallString
+#include <llvm/ADT/StringRef.h>       // for StringRef
 #include <llvm/IR/BasicBlock.h>       // for BasicBlock
 #include <llvm/IR/Function.h>         // for Function
 #include <llvm/IR/Instructions.h>     // for the instruction enums
 #include <llvm/IR/LLVMContext.h>      // for LLVMContext
 #include <llvm/IR/Module.h>           // for Module
-#include <llvm/IRReader/IRReader.h>   // for parseIRFile
+#include <llvm/IRReader/IRReader.h>   // for getLazyIRFileModule
+#include <llvm/Support/Endian.h>      // for support::endian::read64le
+#include <llvm/Support/Error.h>       // for Error, toString
+#include <llvm/Support/MemoryBuffer.h> // for MemoryBuffer
+#include <llvm/Support/Path.h>        // for sys::path::replace_extension
 #include <llvm/Support/SourceMgr.h>   // for SMDiagnostic
 #include <llvm/Support/raw_ostream.h> // for errs, outs, raw_string_ostream
+#include <algorithm>                  // for std::max
+#include <atomic>                     // for std::atomic
+#include <condition_variable>         // for std::condition_variable
+#include <cstdint>                    // for uint64_t
+#include <deque>                      // for std::deque
+#include <functional>                 // for std::function
+#include <iostream>                   // for std::cin
 #include <memory>                     // for std::unique_ptr
+#include <mutex>                      // for std::mutex, std::lock_guard, std::unique_lock
+#include <set>                        // for std::set
 #include <stack>                      // for std::stack
+#include <string>                     // for std::string, std::getline
+#include <system_error>               // for std::error_code
+#include <thread>                     // for std::thread
+#include <vector>                     // for std::vector
 
-int main(int argc, char **argv) {
-    if (argc < 2) {
-        llvm::errs() << "Usage: " << argv[0] << " <IR file>\n";
-        return 1;
+// Everything about how to compile that's the same for every file.
+struct compile_settings {
+    x86Options options;
+    // Where to read a profile from, if there is one.
+    std::string profile_path;
+    bool instrument = false;
+    // Where to keep generated code so it doesn't have to be generated again, if anywhere.
+    std::string cache_directory;
+};
+
+// The files that are waiting to be compiled in batch and server mode. Workers take them out one at a time, in order.
+struct work_queue {
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::deque<std::string> paths;
+    // Whether there's nothing more coming.
+    bool closed = false;
+
+    void push(std::string const &path) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            paths.push_back(path);
+        }
+        ready.notify_one();
+    }
+
+    void close(void) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+        }
+        ready.notify_all();
+    }
+
+    // Waits for a file and puts it in @path. Returns false once there aren't going to be any more.
+    bool pop(std::string &path) {
+        std::unique_lock<std::mutex> lock(mutex);
+        ready.wait(lock, [&] { return !paths.empty() || closed; });
+        if (paths.empty()) {
+            return false;
+        }
+        path = paths.front();
+        paths.pop_front();
+        return true;
+    }
+};
+
+// Reads the counts that a program built with --instrument wrote to the file at @path into @counts. There had better be
+// @expected of them. Returns whether it worked.
+static bool read_profile(std::string const &path, size_t expected, std::vector<uint64_t> &counts) {
+    llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer = llvm::MemoryBuffer::getFile(path);
+    if (!buffer) {
+        llvm::errs() << "ERROR: COULDN'T READ THE PROFILE " << path << ".\n";
+        return false;
+    }
+
+    llvm::StringRef contents = (*buffer)->getBuffer();
+    if (contents.size() < 16 || !contents.startswith("CGPROF01") ||
+        llvm::support::endian::read64le(contents.data() + 8) != expected || contents.size() != 16 + 8 * expected) {
+        llvm::errs() << "ERROR: THE PROFILE " << path << " DOESN'T MATCH THIS PROGRAM.\n";
+        return false;
     }
 
-    // Parse the IR into a module.
+    counts.clear();
+    for (size_t i = 0; i < expected; i++) {
+        counts.push_back(llvm::support::endian::read64le(contents.data() + 16 + 8 * i));
+    }
+    return true;
+}
+
+// Returns the functions that @function calls directly, each once, in the order it first calls them.
+static std::vector<llvm::Function *> called_functions(llvm::Function &function) {
+    std::vector<llvm::Function *> result;
+    std::set<llvm::Function *> seen;
+    for (llvm::BasicBlock &block : function) {
+        for (llvm::Instruction &instruction : block) {
+            llvm::CallInst *call = llvm::dyn_cast<llvm::CallInst>(&instruction);
+            llvm::Function *callee = call == nullptr ? nullptr : call->getCalledFunction();
+            if (callee != nullptr && seen.insert(callee).second) {
+                result.push_back(callee);
+            }
+        }
+    }
+    return result;
+}
+
+// Compiles the IR file at @input_path into assembly, which gets written to @out. The module gets parsed into @context,
+// which can be reused for the next file. Returns whether it worked.
+static bool compile(std::string const &input_path, compile_settings const &settings, llvm::LLVMContext &context, llvm::raw_ostream &out) {
+    // Parse the IR into a module. Bitcode gets read lazily: function bodies only get loaded when they're materialized.
     llvm::SMDiagnostic diag;
-    llvm::LLVMContext context;
-    std::unique_ptr<llvm::Module> module_ptr = llvm::parseIRFile(argv[1], diag, context);
+    std::unique_ptr<llvm::Module> module_ptr = llvm::getLazyIRFileModule(input_path, diag, context);
     if (!module_ptr) {
-        llvm::errs() << "Couldn't parse the IR!\n";
-        return 1;
+        llvm::errs() << "Couldn't parse the IR in " << input_path << "!\n";
+        return false;
     }
 
     llvm::Module &module = *module_ptr;
-    x86Program program(module);
 
-    for (llvm::Function &function : module) {
+    // Profiles cover the whole program, so profiling needs every function up front. Otherwise the functions get
+    // loaded, cleaned up, generated, printed and thrown away one at a time.
+    bool whole_module = settings.instrument || !settings.profile_path.empty();
+
+    x86Options options = settings.options;
+    if (whole_module) {
+        if (llvm::Error error = module.materializeAll()) {
+            llvm::errs() << "Couldn't load the IR in " << input_path << ": " << llvm::toString(std::move(error)) << "\n";
+            return false;
+        }
+
+        // Clean up the IR before making any labels.
+        run_passes(module, options);
+
+        // Profiles are matched up with the IR by the order of the counters, so that order has to be settled before
+        // the profile moves any blocks around or the instrumentation splits any edges.
+        std::vector<profile_counter> counters = list_profile_counters(module);
+        if (!settings.profile_path.empty()) {
+            std::vector<uint64_t> counts;
+            if (read_profile(settings.profile_path, counters.size(), counts)) {
+                apply_profile(module, counters, counts, options);
+            }
+        }
+        if (settings.instrument) {
+            place_profile_counters(counters, options);
+        }
+    }
+
+    x86Program program(module, options);
+    // The header goes out first, so that all that's ever in the program's instructions after this is one function.
+    program.flush(out);
+
+    // Instrumented code numbers its counters across the whole program, so it can't be put together out of pieces.
+    bool use_cache = !settings.cache_directory.empty() && !options.instrument && !options.time_functions;
+
+    // Functions get generated after the functions they call, so that calls to them only have to save what they
+    // actually clobber. Functions that call each other can't both go first, so the call to whichever one is still being
+    // worked on assumes the whole convention.
+    std::set<llvm::Function const *> started;
+    std::function<bool(llvm::Function &)> generate = [&](llvm::Function &function) {
+        started.insert(&function);
+
+        if (!whole_module) {
+            if (llvm::Error error = function.materialize()) {
+                llvm::errs() << "Couldn't load " << function.getName() << " from " << input_path << ": " << llvm::toString(std::move(error))
+                             << "\n";
+                return false;
+            }
+            run_passes(function, options);
+        }
+
+        for (llvm::Function *callee : called_functions(function)) {
+            if (!callee->isDeclaration() && started.count(callee) == 0 && !generate(*callee)) {
+                return false;
+            }
+        }
+
+        // Code that probably won't run goes at the end, out of the way of the code that will.
+        move_cold_blocks(function, options.block_counts, program.cold_blocks);
+        find_back_edges(function, program.back_edges);
+
+        // The slot allocator would rather spill values that aren't used inside loops.
+        compute_loop_depths(function, program.loop_depths);
+        program.find_vector_loops(function);
+
+        // Functions that haven't changed since they were last generated come straight out of the cache.
+        std::string key;
+        size_t first_instruction = program.instructions.size();
+        size_t first_data = program.read_only_data.size();
+        if (use_cache) {
+            key = cache_key(function, options, program.clobbers);
+            std::string text, data;
+            x86RegisterSet clobbers;
+            if (cache_load(settings.cache_directory, key, text, data, clobbers)) {
+                program.insert_generated_function(function, text, data, clobbers);
+                program.flush(out);
+                function.deleteBody();
+                return true;
+            }
+        }
+
+        program.make_labels(function);
+
         for (llvm::BasicBlock &block : function) {
 
             program.handle_block_begin(block);
             for (llvm::BasicBlock::const_iterator it = block.begin(); it != block.end(); it++) {
                 llvm::Instruction const &instruction = llvm::cast<llvm::Instruction>(*it);
 
-                llvm::errs() << "Got an instruction: ";
-                instruction.print(llvm::errs());
-                llvm::errs() << "\n";
+                // Constants get rematerialized wherever they're used, so there's nothing to compute here.
+                if (program.rematerialized.count(&instruction) != 0) {
+                    continue;
+                }
+
+                if (options.trace) {
+                    llvm::errs() << "Got an instruction: ";
+                    instruction.print(llvm::errs());
+                    llvm::errs() << "\n";
+                }
 
                 switch (instruction.getOpcode()) {
                 case llvm::Instruction::Call:
@@ -68,9 +259,29 @@ int main(int argc, char **argv) {
                 case llvm::Instruction::ICmp:
                     program.handle_icmp(it);
                     break;
+                case llvm::Instruction::Select:
+                    program.handle_select(it);
+                    break;
+                case llvm::Instruction::SExt:
+                case llvm::Instruction::ZExt:
+                case llvm::Instruction::Trunc:
+                    program.handle_cast(it);
+                    break;
                 case llvm::Instruction::Br:
                     program.handle_br(it);
                     break;
+                case llvm::Instruction::Switch:
+                    program.handle_switch(it);
+                    break;
+                case llvm::Instruction::Alloca:
+                    program.handle_alloca(it);
+                    break;
+                case llvm::Instruction::Load:
+                    program.handle_load(it);
+                    break;
+                case llvm::Instruction::Store:
+                    program.handle_store(it);
+                    break;
                 case llvm::Instruction::PHI:
                     // Phi nodes get handled by handle_block_begin
                     break;
@@ -78,13 +289,209 @@ int main(int argc, char **argv) {
                     llvm::errs() << "Can't deal with this instruction.\n";
                     break;
                 }
-                // llvm::errs() << "I'm gonna go dust out the slots now\n";
-                program.dust_out_slots(it);
             }
         }
+
+        program.end_function();
+        program.run_machine_passes(function);
+
+        if (!key.empty()) {
+            std::string text, data;
+            llvm::raw_string_ostream text_stream(text), data_stream(data);
+            for (size_t i = first_instruction; i < program.instructions.size(); i++) {
+                program.instructions[i]->print(text_stream);
+            }
+            for (size_t i = first_data; i < program.read_only_data.size(); i++) {
+                program.read_only_data[i]->print(data_stream);
+            }
+            cache_store(settings.cache_directory, key, text_stream.str(), data_stream.str(), program.clobbers[&function]);
+        }
+
+        // Nothing looks at this function again, so there's no reason to hang on to it.
+        program.flush(out);
+        function.deleteBody();
+        return true;
+    };
+
+    for (llvm::Function &function : module) {
+        if (!function.isDeclaration() && started.count(&function) == 0 && !generate(function)) {
+            return false;
+        }
+    }
+
+    program.print(out);
+
+    return true;
+}
+
+// Where the assembly for the IR file at @input_path goes in batch and server mode: right next to it, with a .s on the
+// end instead of whatever it had.
+static std::string output_path(std::string const &input_path) {
+    llvm::SmallString<256> path(input_path);
+    llvm::sys::path::replace_extension(path, "s");
+    return std::string(path);
+}
+
+// Compiles every file that comes out of @queue, @jobs at a time, and calls @report with each one when it's done.
+// Every worker has its own context, which it keeps for every file it compiles. Returns how many files failed.
+static size_t run_workers(work_queue &queue, compile_settings const &settings, unsigned jobs,
+                          std::function<void(std::string const &, std::string const &, bool)> const &report) {
+    std::atomic<size_t> failures{0};
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < jobs; i++) {
+        workers.emplace_back([&] {
+            llvm::LLVMContext context;
+            std::string input_path;
+            while (queue.pop(input_path)) {
+                std::string output = output_path(input_path);
+                std::error_code error;
+                llvm::raw_fd_ostream out(output, error);
+                bool worked = !error && compile(input_path, settings, context, out);
+                if (error) {
+                    llvm::errs() << "ERROR: COULDN'T WRITE " << output << ": " << error.message() << "\n";
+                }
+                if (!worked) {
+                    failures++;
+                }
+                report(input_path, output, worked);
+            }
+        });
+    }
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+    return failures;
+}
+
+int main(int argc, char **argv) {
+    compile_settings settings;
+    std::vector<std::string> input_paths;
+    bool batch = false;
+    bool server = false;
+    bool usage = false;
+    unsigned jobs = std::max(1u, std::thread::hardware_concurrency());
+    for (int i = 1; i < argc; i++) {
+        llvm::StringRef arg(argv[i]);
+        if (arg == "--instrument") {
+            settings.instrument = true;
+        }
+        else if (arg.consume_front("--instrument=")) {
+            settings.instrument = true;
+            settings.options.profile_path = arg.str();
+        }
+        else if (arg == "--time") {
+            settings.options.time_functions = true;
+        }
+        else if (arg.consume_front("--profile=")) {
+            settings.profile_path = arg.str();
+        }
+        else if (arg.consume_front("--target=")) {
+            if (arg == "sse4.1") {
+                settings.options.vector_bits = 128;
+            }
+            else if (arg == "avx2") {
+                settings.options.vector_bits = 256;
+            }
+            else if (arg == "x86-64") {
+                settings.options.vector_bits = 0;
+            }
+            else {
+                usage = true;
+            }
+        }
+        else if (arg.consume_front("--unroll=")) {
+            usage |= arg.getAsInteger(10, settings.options.unroll_factor) || settings.options.unroll_factor == 0;
+        }
+        else if (arg.consume_front("--cache=")) {
+            settings.cache_directory = arg.str();
+        }
+        else if (arg == "--batch") {
+            batch = true;
+        }
+        else if (arg == "--server") {
+            server = true;
+        }
+        else if (arg.consume_front("--jobs=")) {
+            usage |= arg.getAsInteger(10, jobs) || jobs == 0;
+        }
+        else if (!arg.startswith("-")) {
+            input_paths.push_back(arg.str());
+        }
+        else {
+            usage = true;
+        }
+    }
+
+    // Batch mode takes any number of files, server mode reads them from stdin, and otherwise there has to be exactly one.
+    if (batch && server) {
+        usage = true;
+    }
+    else if (server) {
+        usage |= !input_paths.empty();
+    }
+    else if (!batch) {
+        usage |= input_paths.size() != 1;
     }
 
-    program.print(llvm::outs());
+    if (usage) {
+        llvm::errs() << "Usage: " << argv[0] << " [options] <IR file>\n"
+                     << "       " << argv[0] << " [options] --batch <IR files...>\n"
+                     << "       " << argv[0] << " [options] --server\n"
+                     << "  --instrument[=<file>]  count calls and branches, and write the counts to <file> on exit\n"
+                     << "                         (codegen.profile by default)\n"
+                     << "  --profile=<file>       lay out code and pick spills using counts from an instrumented run\n"
+                     << "  --time                 print how many cycles each function took to stderr on exit\n"
+                     << "  --target=<cpu>         x86-64 (the default), or sse4.1 or avx2 to vectorize reduction loops\n"
+                     << "  --unroll=<n>           do n iterations of counted loops per trip (4 by default, 1 for none)\n"
+                     << "  --cache=<dir>          reuse the code for functions that haven't changed since it was put in <dir>\n"
+                     << "  --batch                compile every file given into a .s file next to it\n"
+                     << "  --server               the same, but for every file named on a line of stdin, printing the\n"
+                     << "                         name of each .s file (or ERROR and the IR file) once it's written\n"
+                     << "  --jobs=<n>             how many files --batch and --server compile at once\n";
+        return 1;
+    }
+
+    if (!batch && !server) {
+        llvm::LLVMContext context;
+        return compile(input_paths[0], settings, context, llvm::outs()) ? 0 : 1;
+    }
+
+    settings.options.trace = false;
+    work_queue queue;
+    std::mutex report_mutex;
+    auto report = [&](std::string const &input_path, std::string const &output, bool worked) {
+        if (!server) {
+            return;
+        }
+        // Whoever's on the other end of stdout finds out about each file as soon as it's ready.
+        std::lock_guard<std::mutex> lock(report_mutex);
+        if (worked) {
+            llvm::outs() << output << "\n";
+        }
+        else {
+            llvm::outs() << "ERROR " << input_path << "\n";
+        }
+        llvm::outs().flush();
+    };
+
+    std::thread feeder([&] {
+        if (server) {
+            std::string line;
+            while (std::getline(std::cin, line)) {
+                if (!line.empty()) {
+                    queue.push(line);
+                }
+            }
+        }
+        else {
+            for (std::string const &input_path : input_paths) {
+                queue.push(input_path);
+            }
+        }
+        queue.close();
+    });
 
-    return 0;
+    size_t failures = run_workers(queue, settings, jobs, report);
+    feeder.join();
+    return failures == 0 ? 0 : 1;
 }
@@ -0,0 +1,905 @@
+#include "machine.hpp"
+#include "x86.hpp"
+#include <algorithm> // for std::any_of, std::remove
+#include <cstdint>   // for int64_t
+#include <map>       // for std::map
+#include <set>       // for std::set
+#include <string>    // for std::string
+#include <utility>   // for std::pair
+#include <vector>    // for std::vector
+
+// The machine-level passes.
+//
+// Once a function has been generated, its instructions get cut up into blocks at every label and after every jump, and
+// the blocks get linked up by where the jumps go. Every instruction knows which registers it reads and writes,
+// including the ones it doesn't name, like the %rax and %rdx that idiv uses. That's enough to work out which registers
+// hold something that's going to be read later, and that lets us throw away code that only computes things nobody
+// reads, which code generation produces plenty of since it only ever looks at one IR instruction at a time.
+//
+// Register sets are bitmasks, so liveness is a handful of machine words per block, and every pass is a single walk
+// over the instructions.
+
+namespace {
+
+// The 64-bit registers, in the order they get numbered.
+std::vector<std::string> const REGISTER_NAMES{"rax", "rbx", "rcx", "rdx", "rsi", "rdi", "rbp", "rsp",
+                                              "r8",  "r9",  "r10", "r11", "r12", "r13", "r14", "r15"};
+
+// A name for some piece of a register.
+struct register_piece {
+    int number;
+    unsigned bits;
+};
+
+// Maps every name that any piece of any register goes by to which register it is and how much of it.
+std::map<std::string, register_piece> const &register_pieces(void) {
+    static std::map<std::string, register_piece> const pieces = [] {
+        std::map<std::string, register_piece> result;
+        for (size_t i = 0; i < REGISTER_NAMES.size(); i++) {
+            for (unsigned bits : {64, 32, 16, 8}) {
+                result.insert({sized_register_name(REGISTER_NAMES[i], bits), {(int)i, bits}});
+            }
+        }
+        return result;
+    }();
+    return pieces;
+}
+
+x86RegisterSet registers(std::vector<std::string> const &names) {
+    x86RegisterSet set = 0;
+    for (std::string const &name : names) {
+        set |= register_set(name);
+    }
+    return set;
+}
+
+x86RegisterSet const STACK_POINTER = register_set("rsp");
+x86RegisterSet const FRAME_POINTER = register_set("rbp");
+
+// The registers a function takes its first arguments in, in order, and the ones it's allowed to change.
+std::vector<std::string> const ARGUMENT_REGISTERS{"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
+x86RegisterSet const CLOBBERED_BY_CALLS = registers({"rax", "rcx", "rdx", "rsi", "rdi", "r8", "r9", "r10", "r11"}) | FLAGS_REGISTER;
+
+// What the caller of a function reads after it returns.
+x86RegisterSet const READ_BY_CALLERS = registers({"rax", "rbx", "rbp", "rsp", "r12", "r13", "r14", "r15"});
+
+// Returns which register @operand is, or -1 if it isn't one. The frame register is %rsp in a frameless function.
+int operand_register(x86Source const *operand) {
+    if (operand->type != x86Source::REG) {
+        return -1;
+    }
+    x86FrameRegister const *frame_register = dynamic_cast<x86FrameRegister const *>(operand);
+    if (frame_register != nullptr && frame_register->frame.frameless) {
+        return register_number("rsp");
+    }
+    return register_number(static_cast<x86Register const *>(operand)->name);
+}
+
+// Adds what reading @operand reads to @effects. For memory, that's the register holding the address.
+void read(x86Source const *operand, x86Effects &effects) {
+    if (operand->type == x86Source::REG) {
+        int number = operand_register(operand);
+        effects.uses |= number < 0 ? ALL_REGISTERS : x86RegisterSet(1) << number;
+    }
+    else if (operand->type == x86Source::REG_PTR) {
+        x86Source const *address = static_cast<x86Pointer const *>(operand)->address;
+        read(address, effects);
+        effects.addresses_stack = effects.addresses_stack || operand_register(address) == register_number("rsp");
+    }
+}
+
+// Adds what writing @operand does to @effects. Writing memory means the instruction has to stay.
+void write(x86Destination const *operand, x86Effects &effects) {
+    if (operand->type != x86Source::REG) {
+        read(operand, effects);
+        effects.removable = false;
+        return;
+    }
+
+    int number = operand_register(operand);
+    if (number < 0) {
+        effects.uses = ALL_REGISTERS;
+        effects.removable = false;
+        return;
+    }
+    effects.defs |= x86RegisterSet(1) << number;
+    // Writing a 32-bit register clears the top half, but writing 8 or 16 bits leaves the rest of it alone.
+    if (register_bits(static_cast<x86Register const *>(operand)->name) < 32) {
+        effects.uses |= x86RegisterSet(1) << number;
+    }
+}
+
+bool starts_with(std::string const &s, std::string const &prefix) {
+    return s.compare(0, prefix.size(), prefix) == 0;
+}
+
+// Returns the condition code that's true exactly when @code is false, or "" if we don't know it.
+std::string inverse_condition(std::string const &code) {
+    static std::map<std::string, std::string> const inverses{{"e", "ne"}, {"ne", "e"}, {"z", "nz"},  {"nz", "z"}, {"l", "ge"}, {"ge", "l"},
+                                                             {"g", "le"}, {"le", "g"}, {"b", "ae"}, {"ae", "b"}, {"a", "be"}, {"be", "a"},
+                                                             {"s", "ns"}, {"ns", "s"}, {"c", "nc"}, {"nc", "c"}};
+    auto it = inverses.find(code);
+    return it == inverses.end() ? "" : it->second;
+}
+
+// Returns whether @instruction is a directive that switches sections, which control can't fall through.
+bool switches_section(x86Instruction const *instruction) {
+    x86Directive const *directive = dynamic_cast<x86Directive const *>(instruction);
+    return directive != nullptr && (directive->contents.rfind(".section", 0) == 0 || directive->contents.rfind(".text", 0) == 0);
+}
+
+// Returns whether @instruction ends its block.
+bool ends_block(x86Instruction const *instruction) {
+    if (switches_section(instruction)) {
+        return true;
+    }
+    if (x86LblInstruction const *jump = dynamic_cast<x86LblInstruction const *>(instruction)) {
+        return jump->opcode != "callq";
+    }
+    if (x86NoArgInstruction const *no_arg = dynamic_cast<x86NoArgInstruction const *>(instruction)) {
+        return no_arg->opcode == "retq";
+    }
+    return dynamic_cast<x86TableJump const *>(instruction) != nullptr || dynamic_cast<x86ImmInstruction const *>(instruction) != nullptr;
+}
+
+// Returns the registers @instruction might write. One that doesn't say what it does might write anything.
+x86RegisterSet may_write(x86Instruction const *instruction) {
+    x86Effects effects = instruction->effects();
+    return effects.uses == ALL_REGISTERS ? ALL_REGISTERS : effects.defs;
+}
+
+// Throws away the instructions in @block that are null, after they've been deleted.
+void compact(x86MachineBlock &block) {
+    block.instructions.erase(std::remove(block.instructions.begin(), block.instructions.end(), nullptr), block.instructions.end());
+}
+
+// Returns the immediate dominator of every block in @blocks that @entry can get to, with @entry as its own. This is
+// Cooper, Harvey and Kennedy's "A Simple, Fast Dominance Algorithm": walk the blocks in reverse postorder, and meet the
+// dominators of the predecessors that have one by walking up from both until they meet.
+std::map<x86MachineBlock const *, x86MachineBlock const *> immediate_dominators(x86MachineBlock const *entry) {
+    std::vector<x86MachineBlock const *> postorder;
+    std::map<x86MachineBlock const *, size_t> number;
+    std::vector<std::pair<x86MachineBlock const *, size_t>> stack{{entry, 0}};
+    std::set<x86MachineBlock const *> visited{entry};
+    while (!stack.empty()) {
+        auto &[block, next] = stack.back();
+        if (next < block->successors.size()) {
+            x86MachineBlock const *successor = block->successors[next++];
+            if (visited.insert(successor).second) {
+                stack.push_back({successor, 0});
+            }
+            continue;
+        }
+        number.insert({block, postorder.size()});
+        postorder.push_back(block);
+        stack.pop_back();
+    }
+
+    std::map<x86MachineBlock const *, x86MachineBlock const *> idom{{entry, entry}};
+    auto meet = [&](x86MachineBlock const *a, x86MachineBlock const *b) {
+        while (a != b) {
+            while (number[a] < number[b]) {
+                a = idom[a];
+            }
+            while (number[b] < number[a]) {
+                b = idom[b];
+            }
+        }
+        return a;
+    };
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (auto it = postorder.rbegin(); it != postorder.rend(); it++) {
+            if (*it == entry) {
+                continue;
+            }
+            x86MachineBlock const *dominator = nullptr;
+            for (x86MachineBlock const *predecessor : (*it)->predecessors) {
+                if (idom.count(predecessor) != 0) {
+                    dominator = dominator == nullptr ? predecessor : meet(dominator, predecessor);
+                }
+            }
+            auto found = idom.find(*it);
+            if (found == idom.end() || found->second != dominator) {
+                idom[*it] = dominator;
+                changed = true;
+            }
+        }
+    }
+    return idom;
+}
+
+// Returns the blocks that control can get to from @block by taking at least one jump.
+std::set<x86MachineBlock const *> reachable_from(x86MachineBlock const *block) {
+    std::set<x86MachineBlock const *> reached;
+    std::vector<x86MachineBlock const *> worklist(block->successors.begin(), block->successors.end());
+    while (!worklist.empty()) {
+        x86MachineBlock const *next = worklist.back();
+        worklist.pop_back();
+        if (reached.insert(next).second) {
+            worklist.insert(worklist.end(), next->successors.begin(), next->successors.end());
+        }
+    }
+    return reached;
+}
+
+} // namespace
+
+int register_number(std::string const &name) {
+    auto it = register_pieces().find(name);
+    return it == register_pieces().end() ? -1 : it->second.number;
+}
+
+unsigned register_bits(std::string const &name) {
+    auto it = register_pieces().find(name);
+    return it == register_pieces().end() ? 0 : it->second.bits;
+}
+
+x86RegisterSet register_set(std::string const &name) {
+    int number = register_number(name);
+    return number < 0 ? 0 : x86RegisterSet(1) << number;
+}
+
+x86Effects x86Instruction::effects(void) const {
+    x86Effects effects;
+    effects.uses = ALL_REGISTERS;
+    return effects;
+}
+
+x86Effects x86Label::effects(void) const {
+    return x86Effects();
+}
+
+x86Effects x86Directive::effects(void) const {
+    return x86Effects();
+}
+
+x86Effects x86Comment::effects(void) const {
+    return x86Effects();
+}
+
+x86Effects x86NoArgInstruction::effects(void) const {
+    x86Effects effects;
+    if (opcode == "retq") {
+        effects.uses = READ_BY_CALLERS;
+    }
+    else if (opcode == "leaveq") {
+        effects.uses = FRAME_POINTER;
+        effects.defs = STACK_POINTER | FRAME_POINTER;
+    }
+    else if (opcode == "cqto" || opcode == "cltd") {
+        effects.uses = register_set("rax");
+        effects.defs = register_set("rdx");
+        effects.removable = true;
+    }
+    else if (opcode == "rdtsc") {
+        effects.defs = registers({"rax", "rdx"});
+    }
+    else if (opcode == "syscall") {
+        effects.uses = registers({"rax", "rdi", "rsi", "rdx", "r10", "r8", "r9"});
+        effects.defs = registers({"rax", "rcx", "r11"});
+    }
+    else {
+        return x86Instruction::effects();
+    }
+    return effects;
+}
+
+x86Effects x86SrcInstruction::effects(void) const {
+    x86Effects effects;
+    if (opcode == "pushq") {
+        read(source, effects);
+        effects.uses |= STACK_POINTER;
+        effects.defs = STACK_POINTER;
+    }
+    else if (starts_with(opcode, "idiv") || starts_with(opcode, "div")) {
+        // Divides %rdx:%rax by the operand, and leaves the quotient in %rax and the remainder in %rdx.
+        read(source, effects);
+        effects.uses |= registers({"rax", "rdx"});
+        effects.defs = registers({"rax", "rdx"}) | FLAGS_REGISTER;
+    }
+    else {
+        return x86Instruction::effects();
+    }
+    return effects;
+}
+
+x86Effects x86DstInstruction::effects(void) const {
+    x86Effects effects;
+    effects.removable = true;
+    if (opcode == "popq") {
+        effects.uses = STACK_POINTER;
+        effects.defs = STACK_POINTER;
+        effects.removable = false;
+    }
+    else if (starts_with(opcode, "inc") || starts_with(opcode, "dec") || starts_with(opcode, "neg")) {
+        read(destination, effects);
+        effects.defs = FLAGS_REGISTER;
+    }
+    else if (starts_with(opcode, "set")) {
+        effects.uses = FLAGS_REGISTER;
+    }
+    else {
+        return x86Instruction::effects();
+    }
+    write(destination, effects);
+    return effects;
+}
+
+x86Effects x86LblInstruction::effects(void) const {
+    x86Effects effects;
+    if (opcode == "callq") {
+        effects.uses = STACK_POINTER;
+        for (size_t i = 0; i < register_arguments && i < ARGUMENT_REGISTERS.size(); i++) {
+            effects.uses |= register_set(ARGUMENT_REGISTERS[i]);
+        }
+        effects.defs = CLOBBERED_BY_CALLS & clobbers;
+    }
+    else if (opcode != "jmp") {
+        effects.uses = FLAGS_REGISTER;
+    }
+    return effects;
+}
+
+x86Effects x86TableJump::effects(void) const {
+    x86Effects effects;
+    effects.uses = register_set(index);
+    return effects;
+}
+
+x86Effects x86SrcDstInstruction::effects(void) const {
+    x86Effects effects;
+    effects.removable = true;
+    if (starts_with(opcode, "mov") || starts_with(opcode, "lea")) {
+        read(source, effects);
+    }
+    else if (starts_with(opcode, "cmov")) {
+        read(source, effects);
+        read(destination, effects);
+        effects.uses |= FLAGS_REGISTER;
+    }
+    else if (starts_with(opcode, "cmp") || starts_with(opcode, "test") || starts_with(opcode, "bt")) {
+        read(source, effects);
+        read(destination, effects);
+        effects.defs = FLAGS_REGISTER;
+        return effects;
+    }
+    else if (starts_with(opcode, "add") || starts_with(opcode, "sub") || starts_with(opcode, "imul") || starts_with(opcode, "and") ||
+             starts_with(opcode, "or") || starts_with(opcode, "xor") || starts_with(opcode, "sh") || starts_with(opcode, "sar")) {
+        // Note that xoring or subtracting a register from itself doesn't care what was in it.
+        bool zeroing = (starts_with(opcode, "xor") || starts_with(opcode, "sub")) && source->type == x86Source::REG &&
+                       destination->type == x86Source::REG &&
+                       static_cast<x86Register const *>(source)->name == static_cast<x86Register const *>(destination)->name;
+        if (!zeroing) {
+            read(source, effects);
+            read(destination, effects);
+        }
+        effects.defs = FLAGS_REGISTER;
+    }
+    else {
+        return x86Instruction::effects();
+    }
+    write(destination, effects);
+    return effects;
+}
+
+// Vector registers aren't tracked, so this only counts the general purpose registers it reads and writes.
+x86Effects x86VectorInstruction::effects(void) const {
+    x86Effects effects;
+    for (size_t i = 0; i < operands.size(); i++) {
+        x86Source const *operand = operands[i];
+        if (operand->type == x86Source::REG && register_number(static_cast<x86Register const *>(operand)->name) < 0) {
+            continue;
+        }
+        if (i + 1 == operands.size()) {
+            write(static_cast<x86Destination const *>(operand), effects);
+        }
+        else {
+            read(operand, effects);
+        }
+    }
+    effects.removable = false;
+    return effects;
+}
+
+x86Effects x86Prologue::effects(void) const {
+    // Reads every callee-saved register, to save it.
+    x86Effects effects;
+    effects.uses = READ_BY_CALLERS & ~register_set("rax");
+    effects.defs = STACK_POINTER | (frame.frameless ? 0 : FRAME_POINTER);
+    return effects;
+}
+
+x86Effects x86Epilogue::effects(void) const {
+    x86Effects effects;
+    effects.uses = STACK_POINTER | FRAME_POINTER;
+    effects.defs = STACK_POINTER | (frame.frameless ? 0 : FRAME_POINTER);
+    for (std::string const &register_name : frame.saved_registers()) {
+        effects.defs |= register_set(register_name);
+    }
+    return effects;
+}
+
+std::string x86MachineBlock::label(void) const {
+    if (instructions.empty()) {
+        return "";
+    }
+    x86Label const *first = dynamic_cast<x86Label const *>(instructions.front());
+    return first == nullptr ? "" : first->get_name();
+}
+
+x86Instruction *x86MachineBlock::terminator(void) const {
+    // Alignment takes up space, but it doesn't do anything.
+    for (auto it = instructions.rbegin(); it != instructions.rend(); it++) {
+        if (dynamic_cast<x86Comment const *>(*it) == nullptr && (dynamic_cast<x86Directive const *>(*it) == nullptr || switches_section(*it))) {
+            return *it;
+        }
+    }
+    return nullptr;
+}
+
+// Cuts @instructions up into blocks. The blocks borrow the instructions; they still belong to whoever owns the vector.
+x86MachineFunction::x86MachineFunction(std::vector<x86Instruction *> const &instructions) {
+    bool start_block = true;
+    for (x86Instruction *instruction : instructions) {
+        if (dynamic_cast<x86Label const *>(instruction) != nullptr || start_block) {
+            blocks.emplace_back(new x86MachineBlock());
+        }
+        blocks.back()->instructions.push_back(instruction);
+        start_block = ends_block(instruction);
+    }
+    link_blocks();
+}
+
+// Puts the blocks back together, in order.
+std::vector<x86Instruction *> x86MachineFunction::instructions(void) const {
+    std::vector<x86Instruction *> result;
+    for (auto const &block : blocks) {
+        result.insert(result.end(), block->instructions.begin(), block->instructions.end());
+    }
+    return result;
+}
+
+// Works out where control can go from every block by looking at how it ends.
+void x86MachineFunction::link_blocks(void) {
+    std::map<std::string, x86MachineBlock *> labelled;
+    for (auto const &block : blocks) {
+        block->successors.clear();
+        block->predecessors.clear();
+        block->exit_uses = 0;
+        if (!block->label().empty()) {
+            labelled.insert({block->label(), block.get()});
+        }
+    }
+
+    auto add_edge = [](x86MachineBlock *from, x86MachineBlock *to) {
+        if (std::find(from->successors.begin(), from->successors.end(), to) == from->successors.end()) {
+            from->successors.push_back(to);
+            to->predecessors.push_back(from);
+        }
+    };
+
+    for (size_t i = 0; i < blocks.size(); i++) {
+        x86MachineBlock *block = blocks[i].get();
+        x86MachineBlock *next = i + 1 < blocks.size() ? blocks[i + 1].get() : nullptr;
+        x86Instruction const *last = block->terminator();
+        bool falls_through = true;
+
+        if (x86LblInstruction const *jump = dynamic_cast<x86LblInstruction const *>(last)) {
+            if (jump->opcode != "callq") {
+                auto target = labelled.find(jump->label->get_name());
+                if (target == labelled.end()) {
+                    // Somewhere outside this function. Who knows what it reads.
+                    block->exit_uses = ALL_REGISTERS;
+                }
+                else {
+                    add_edge(block, target->second);
+                }
+                falls_through = jump->opcode != "jmp";
+            }
+        }
+        else if (dynamic_cast<x86TableJump const *>(last) != nullptr) {
+            // The table could send it to any block with a label.
+            for (auto const &[name, target] : labelled) {
+                add_edge(block, target);
+            }
+            falls_through = false;
+        }
+        else if (last != nullptr && ends_block(last)) {
+            falls_through = false;
+        }
+
+        if (falls_through) {
+            if (next != nullptr) {
+                add_edge(block, next);
+            }
+            else {
+                block->exit_uses = ALL_REGISTERS;
+            }
+        }
+    }
+}
+
+// Standard backwards dataflow. Every block gets summed up once as what it reads before writing and what it writes, so
+// going around again only costs a few bitwise operations per block.
+void x86MachineFunction::compute_liveness(void) {
+    std::vector<x86RegisterSet> reads(blocks.size()), writes(blocks.size());
+    for (size_t i = 0; i < blocks.size(); i++) {
+        for (auto it = blocks[i]->instructions.rbegin(); it != blocks[i]->instructions.rend(); it++) {
+            x86Effects effects = (*it)->effects();
+            reads[i] = effects.uses | (reads[i] & ~effects.defs);
+            writes[i] |= effects.defs;
+        }
+        blocks[i]->live_in = 0;
+        blocks[i]->live_out = 0;
+    }
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t i = blocks.size(); i-- > 0;) {
+            x86MachineBlock &block = *blocks[i];
+            x86RegisterSet out = block.exit_uses;
+            for (x86MachineBlock const *successor : block.successors) {
+                out |= successor->live_in;
+            }
+            x86RegisterSet in = reads[i] | (out & ~writes[i]);
+            if (in != block.live_in || out != block.live_out) {
+                block.live_in = in;
+                block.live_out = out;
+                changed = true;
+            }
+        }
+    }
+}
+
+// Returns the registers that are live right after each instruction in @block. Liveness had better be up to date.
+std::vector<x86RegisterSet> x86MachineFunction::live_after(x86MachineBlock const &block) const {
+    std::vector<x86RegisterSet> result(block.instructions.size());
+    x86RegisterSet live = block.live_out;
+    for (size_t i = block.instructions.size(); i-- > 0;) {
+        result[i] = live;
+        x86Effects effects = block.instructions[i]->effects();
+        live = effects.uses | (live & ~effects.defs);
+    }
+    return result;
+}
+
+// Returns the registers that running this function, which is called @name, might change for whoever called it: the
+// ones it writes that the calling convention doesn't make it put back, and the ones the functions it calls change.
+// Calls it makes to itself can't change anything the rest of it doesn't, so they don't add anything, and neither do
+// the pops that put back what got saved around calls.
+x86RegisterSet x86MachineFunction::clobbered(std::string const &name) const {
+    x86RegisterSet result = 0;
+    for (auto const &block : blocks) {
+        for (x86Instruction const *instruction : block->instructions) {
+            x86LblInstruction const *call = dynamic_cast<x86LblInstruction const *>(instruction);
+            x86DstInstruction const *pop = dynamic_cast<x86DstInstruction const *>(instruction);
+            if ((call != nullptr && call->opcode == "callq" && call->label->get_name() == name) || (pop != nullptr && pop->opcode == "popq")) {
+                continue;
+            }
+            result |= may_write(instruction);
+        }
+    }
+    return result & CLOBBERED_BY_CALLS;
+}
+
+// Every call pushes all the caller-saved registers before it and pops them after, whether they're holding anything or
+// not. Pairs whose register isn't read again before it's written go away, and so do pairs whose register nothing in
+// between them writes, which is usually because the function being called doesn't touch it.
+// The pushes and pops get matched up by keeping track of what's on the stack. Pairs with something in between that
+// addresses memory off %rsp stay, since taking them out would move whatever that's looking at.
+bool x86MachineFunction::remove_dead_saves(void) {
+    bool changed = false;
+    for (auto const &block : blocks) {
+        std::vector<x86RegisterSet> live = live_after(*block);
+
+        // What's on the stack: the index of the pushq that put each quadword there, or -1 if it wasn't a register.
+        std::vector<int64_t> stack;
+        // The index of the last instruction that addressed memory off %rsp.
+        int64_t last_stack_access = -1;
+        std::vector<std::pair<size_t, size_t>> pairs;
+
+        for (size_t i = 0; i < block->instructions.size(); i++) {
+            x86Instruction const *instruction = block->instructions[i];
+            x86Effects effects = instruction->effects();
+            if (effects.addresses_stack) {
+                last_stack_access = i;
+            }
+
+            x86SrcInstruction const *push = dynamic_cast<x86SrcInstruction const *>(instruction);
+            x86DstInstruction const *pop = dynamic_cast<x86DstInstruction const *>(instruction);
+            x86SrcDstInstruction const *adjust = dynamic_cast<x86SrcDstInstruction const *>(instruction);
+            if (push != nullptr && push->opcode == "pushq") {
+                stack.push_back(push->source->type == x86Source::REG ? (int64_t)i : -1);
+            }
+            else if (pop != nullptr && pop->opcode == "popq") {
+                if (stack.empty()) {
+                    continue;
+                }
+                int64_t pushed = stack.back();
+                stack.pop_back();
+                if (pushed < 0 || pop->destination->type != x86Source::REG) {
+                    continue;
+                }
+                x86SrcInstruction const *matching = static_cast<x86SrcInstruction const *>(block->instructions[pushed]);
+                int number = operand_register(pop->destination);
+                if (number < 0 || number != operand_register(matching->source) || last_stack_access >= pushed) {
+                    continue;
+                }
+                x86RegisterSet written = 0;
+                for (size_t j = pushed + 1; j < i; j++) {
+                    written |= may_write(block->instructions[j]);
+                }
+                x86RegisterSet saved = x86RegisterSet(1) << number;
+                if ((live[i] & saved) == 0 || (written & saved) == 0) {
+                    pairs.push_back({pushed, i});
+                }
+            }
+            else if (adjust != nullptr && adjust->opcode == "addq" && adjust->source->type == x86Source::IMM &&
+                     operand_register(adjust->destination) == register_number("rsp")) {
+                for (int64_t n = static_cast<x86Immediate const *>(adjust->source)->val; n > 0 && !stack.empty(); n -= 8) {
+                    stack.pop_back();
+                }
+            }
+            else if (effects.defs & STACK_POINTER) {
+                // Anything else that moves %rsp, we lose track.
+                stack.clear();
+            }
+        }
+
+        for (auto const &[pushed, popped] : pairs) {
+            delete block->instructions[pushed];
+            delete block->instructions[popped];
+            block->instructions[pushed] = nullptr;
+            block->instructions[popped] = nullptr;
+            changed = true;
+        }
+        compact(*block);
+    }
+    return changed;
+}
+
+// Throws away every instruction that can go away and writes only registers that aren't live. Liveness had better be up
+// to date. Taking one out can make what it read dead too, so this is worth running until it stops changing things.
+bool x86MachineFunction::remove_dead_code(void) {
+    bool changed = false;
+    for (auto const &block : blocks) {
+        x86RegisterSet live = block->live_out;
+        for (size_t i = block->instructions.size(); i-- > 0;) {
+            x86Effects effects = block->instructions[i]->effects();
+            if (effects.removable && effects.defs != 0 && (effects.defs & live) == 0) {
+                delete block->instructions[i];
+                block->instructions[i] = nullptr;
+                changed = true;
+                continue;
+            }
+            live = effects.uses | (live & ~effects.defs);
+        }
+        compact(*block);
+    }
+    return changed;
+}
+
+// Takes out jumps to the very next instruction, and turns a conditional jump over an unconditional one into the
+// opposite conditional jump, like `jl a; jmp b; a:` into `jge b; a:`. Also takes out 64-bit moves from a register to
+// itself.
+bool x86MachineFunction::remove_useless_jumps(void) {
+    bool changed = false;
+
+    // The label that control reaches next if it falls off the end of block @i without running anything.
+    auto next_label = [&](size_t i) -> std::string {
+        for (size_t j = i + 1; j < blocks.size(); j++) {
+            if (!blocks[j]->label().empty()) {
+                return blocks[j]->label();
+            }
+            if (blocks[j]->terminator() != nullptr) {
+                return "";
+            }
+        }
+        return "";
+    };
+
+    for (size_t i = 0; i < blocks.size(); i++) {
+        x86MachineBlock &block = *blocks[i];
+        for (x86Instruction *&instruction : block.instructions) {
+            x86SrcDstInstruction const *move = dynamic_cast<x86SrcDstInstruction const *>(instruction);
+            if (move != nullptr && move->opcode == "movq" && move->source->type == x86Source::REG && move->destination->type == x86Source::REG &&
+                static_cast<x86Register const *>(move->source)->name == static_cast<x86Register const *>(move->destination)->name) {
+                delete instruction;
+                instruction = nullptr;
+                changed = true;
+            }
+        }
+        compact(block);
+
+        x86LblInstruction *jump = dynamic_cast<x86LblInstruction *>(block.terminator());
+        if (jump == nullptr || jump->opcode == "callq") {
+            continue;
+        }
+
+        // A conditional jump over a block that's nothing but an unconditional jump. Nothing else can get to that block,
+        // since it doesn't have a label.
+        if (jump->opcode != "jmp" && i + 1 < blocks.size() && blocks[i + 1]->label().empty() && next_label(i + 1) == jump->label->get_name()) {
+            x86MachineBlock &over = *blocks[i + 1];
+            x86LblInstruction *other = dynamic_cast<x86LblInstruction *>(over.terminator());
+            std::string inverse = inverse_condition(jump->opcode.substr(1));
+            bool only_jump = true;
+            for (x86Instruction const *instruction : over.instructions) {
+                only_jump = only_jump && (instruction == other || dynamic_cast<x86Comment const *>(instruction) != nullptr);
+            }
+            if (other != nullptr && other->opcode == "jmp" && only_jump && !inverse.empty()) {
+                jump->opcode = "j" + inverse;
+                jump->label = other->label;
+                std::replace(over.instructions.begin(), over.instructions.end(), (x86Instruction *)other, (x86Instruction *)nullptr);
+                delete other;
+                compact(over);
+                changed = true;
+            }
+        }
+
+        if (jump->label->get_name() == next_label(i)) {
+            std::replace(block.instructions.begin(), block.instructions.end(), (x86Instruction *)jump, (x86Instruction *)nullptr);
+            delete jump;
+            compact(block);
+            changed = true;
+        }
+    }
+
+    if (changed) {
+        link_blocks();
+    }
+    return changed;
+}
+
+// Shrink-wrapping. The prologue starts out at the top of the function, but all it does is get the frame and the
+// callee-saved registers ready for the code that uses them, so it can go anywhere that comes before all of that code:
+// the nearest block that dominates every block touching the stack, the frame or a register that gets saved. That
+// block can't be in a loop, and every return it can get to has to be one it dominates, so the returns that restore
+// everything are exactly the ones that came through the prologue. The others, like the base case of a recursive
+// function, lose their epilogues and just return.
+// Returns whether the prologue moved.
+bool x86MachineFunction::shrink_wrap(void) {
+    x86MachineBlock *entry = nullptr;
+    size_t prologue_index = 0;
+    for (auto const &block : blocks) {
+        for (size_t i = 0; i < block->instructions.size() && entry == nullptr; i++) {
+            if (dynamic_cast<x86Prologue const *>(block->instructions[i]) != nullptr) {
+                entry = block.get();
+                prologue_index = i;
+            }
+        }
+    }
+    if (entry == nullptr) {
+        return false;
+    }
+    x86Frame const &frame = static_cast<x86Prologue const *>(entry->instructions[prologue_index])->frame;
+
+    x86RegisterSet frame_registers = STACK_POINTER | FRAME_POINTER;
+    for (std::string const &register_name : frame.saved_registers()) {
+        frame_registers |= register_set(register_name);
+    }
+
+    // Returns and epilogues don't count, since they're what we're moving away from. Anything that doesn't say what it
+    // does counts, since it reads every register.
+    auto needs_frame = [&](x86MachineBlock const &block) {
+        if (block.exit_uses != 0) {
+            return true;
+        }
+        for (x86Instruction const *instruction : block.instructions) {
+            x86NoArgInstruction const *no_arg = dynamic_cast<x86NoArgInstruction const *>(instruction);
+            if (dynamic_cast<x86Prologue const *>(instruction) != nullptr || dynamic_cast<x86Epilogue const *>(instruction) != nullptr ||
+                (no_arg != nullptr && no_arg->opcode == "retq")) {
+                continue;
+            }
+            x86Effects effects = instruction->effects();
+            if (effects.addresses_stack || ((effects.uses | effects.defs) & frame_registers) != 0) {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    std::map<x86MachineBlock const *, x86MachineBlock const *> idom = immediate_dominators(entry);
+    auto dominates = [&](x86MachineBlock const *a, x86MachineBlock const *b) {
+        while (b != a && b != entry) {
+            b = idom.at(b);
+        }
+        return b == a;
+    };
+
+    x86MachineBlock const *save = nullptr;
+    for (auto const &[block, dominator] : idom) {
+        if (!needs_frame(*block)) {
+            continue;
+        }
+        if (save == nullptr) {
+            save = block;
+            continue;
+        }
+        // The nearest common dominator.
+        while (!dominates(save, block)) {
+            save = idom.at(save);
+        }
+    }
+    if (save == nullptr) {
+        return false;
+    }
+
+    auto has_epilogue = [](x86MachineBlock const *block) {
+        return std::any_of(block->instructions.begin(), block->instructions.end(),
+                           [](x86Instruction const *instruction) { return dynamic_cast<x86Epilogue const *>(instruction) != nullptr; });
+    };
+    while (save != entry) {
+        std::set<x86MachineBlock const *> reached = reachable_from(save);
+        bool covers_returns = reached.count(save) == 0;
+        for (x86MachineBlock const *block : reached) {
+            covers_returns = covers_returns && (!has_epilogue(block) || dominates(save, block));
+        }
+        if (covers_returns) {
+            break;
+        }
+        save = idom.at(save);
+    }
+    if (save == entry) {
+        return false;
+    }
+
+    // The comment saying what the prologue is goes along with it.
+    size_t first = prologue_index > 0 && dynamic_cast<x86Comment const *>(entry->instructions[prologue_index - 1]) != nullptr ? prologue_index - 1 : prologue_index;
+    std::vector<x86Instruction *> prologue(entry->instructions.begin() + first, entry->instructions.begin() + prologue_index + 1);
+    entry->instructions.erase(entry->instructions.begin() + first, entry->instructions.begin() + prologue_index + 1);
+    x86MachineBlock *target = const_cast<x86MachineBlock *>(save);
+    target->instructions.insert(target->instructions.begin() + (target->label().empty() ? 0 : 1), prologue.begin(), prologue.end());
+
+    // The returns that didn't come through the prologue have nothing to restore.
+    for (auto const &block : blocks) {
+        if (idom.count(block.get()) == 0 || dominates(save, block.get())) {
+            continue;
+        }
+        for (size_t i = 0; i < block->instructions.size(); i++) {
+            if (dynamic_cast<x86Epilogue const *>(block->instructions[i]) == nullptr) {
+                continue;
+            }
+            delete block->instructions[i];
+            block->instructions[i] = nullptr;
+            if (i > 0 && dynamic_cast<x86Comment const *>(block->instructions[i - 1]) != nullptr) {
+                delete block->instructions[i - 1];
+                block->instructions[i - 1] = nullptr;
+            }
+        }
+        compact(*block);
+    }
+    return true;
+}
+
+// Runs the machine-level passes over the instructions, which had better be exactly one function's worth.
+void x86Program::run_machine_passes(llvm::Function const &ir_function) {
+    x86MachineFunction function(instructions);
+
+    // Calls this function makes to itself change whatever the rest of it changes, and nothing else. Taking code out
+    // only makes that smaller, so it's safe to settle on it before the passes run.
+    std::string name = function_label(ir_function)->get_name();
+    x86RegisterSet clobbered = function.clobbered(name);
+    for (x86Instruction *instruction : instructions) {
+        x86LblInstruction *call = dynamic_cast<x86LblInstruction *>(instruction);
+        if (call != nullptr && call->opcode == "callq" && call->label->get_name() == name) {
+            call->clobbers = clobbered;
+        }
+    }
+
+    // Taking out one call's saves can make the register dead around the call before it, so go until nothing changes.
+    do {
+        function.compute_liveness();
+    } while (function.remove_dead_saves());
+    do {
+        function.compute_liveness();
+    } while (function.remove_dead_code());
+    function.remove_useless_jumps();
+    function.shrink_wrap();
+
+    instructions = function.instructions();
+    clobbers[&ir_function] = function.clobbered(name);
+}
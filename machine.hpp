@@ -0,0 +1,64 @@
+#pragma once
+
+#include "x86.hpp"
+#include <memory> // for std::unique_ptr
+#include <string> // for std::string
+#include <vector> // for std::vector
+
+// The machine-level representation of a function, for passes that work on the x86 we generated instead of the IR.
+// See machine.cpp.
+
+// Returns the number of the register that @name is some piece of, like 0 for "eax", or -1 if it isn't a register.
+int register_number(std::string const &name);
+
+// Returns how many bits of its register @name is, like 32 for "eax".
+unsigned register_bits(std::string const &name);
+
+// Returns the set holding just the register that @name is some piece of.
+x86RegisterSet register_set(std::string const &name);
+
+// The bit for the flags.
+x86RegisterSet const FLAGS_REGISTER = x86RegisterSet(1) << 16;
+
+// Every register and the flags.
+x86RegisterSet const ALL_REGISTERS = (FLAGS_REGISTER << 1) - 1;
+
+// A straight run of instructions that only gets entered at the top and only leaves at the bottom.
+struct x86MachineBlock {
+    // Starting with the label, if the block has one.
+    std::vector<x86Instruction *> instructions;
+
+    // Where control can go from the end of this block, and where it can come from.
+    std::vector<x86MachineBlock *> successors;
+    std::vector<x86MachineBlock *> predecessors;
+
+    // What's read by code that can run after this block but isn't in this function, like the code a jump to some other
+    // function's label goes to. Everything, if there's any of that.
+    x86RegisterSet exit_uses = 0;
+
+    // The registers that hold something that'll get read later, at the top and at the bottom of the block.
+    x86RegisterSet live_in = 0;
+    x86RegisterSet live_out = 0;
+
+    // The name of the block's label, or "" if it doesn't have one.
+    std::string label(void) const;
+
+    // The last instruction that isn't a comment, or null if there isn't one.
+    x86Instruction *terminator(void) const;
+};
+
+// A function's instructions, cut up into blocks in the order they get printed.
+struct x86MachineFunction {
+    std::vector<std::unique_ptr<x86MachineBlock>> blocks;
+
+    x86MachineFunction(std::vector<x86Instruction *> const &);
+    std::vector<x86Instruction *> instructions(void) const;
+    void link_blocks(void);
+    void compute_liveness(void);
+    std::vector<x86RegisterSet> live_after(x86MachineBlock const &) const;
+    x86RegisterSet clobbered(std::string const &name) const;
+    bool remove_dead_saves(void);
+    bool remove_dead_code(void);
+    bool remove_useless_jumps(void);
+    bool shrink_wrap(void);
+};
@@ -0,0 +1,1277 @@
+#include "passes.hpp"
+#include "x86.hpp"
+#include <llvm/ADT/APInt.h>                       // for llvm::APInt
+#include <llvm/ADT/STLExtras.h>                    // for llvm::reverse
+#include <llvm/ADT/SmallVector.h>                  // for llvm::SmallVector
+#include <llvm/Analysis/LoopInfo.h>                // for llvm::LoopInfo, llvm::Loop
+#include <llvm/IR/BasicBlock.h>                    // for llvm::BasicBlock
+#include <llvm/IR/CFG.h>                           // for llvm::pred_begin, llvm::pred_end, llvm::successors
+#include <llvm/IR/Constants.h>                     // for llvm::ConstantInt, llvm::ConstantExpr
+#include <llvm/IR/Dominators.h>                    // for llvm::DominatorTree
+#include <llvm/IR/Function.h>                      // for llvm::Function
+#include <llvm/IR/InstrTypes.h>                    // for llvm::BinaryOperator, llvm::CastInst
+#include <llvm/IR/Instructions.h>                  // for llvm::AllocaInst
+#include <llvm/IR/Module.h>                        // for llvm::Module
+#include <llvm/Support/Casting.h>                  // for llvm::dyn_cast
+#include <llvm/Support/raw_ostream.h>              // for llvm::errs
+#include <llvm/Transforms/Utils/BasicBlockUtils.h> // for llvm::MergeBlockIntoPredecessor, llvm::SplitCriticalEdge
+#include <llvm/Transforms/Utils/Local.h>           // for llvm::RecursivelyDeleteTriviallyDeadInstructions, llvm::ConstantFoldTerminator, llvm::removeUnreachableBlocks
+#include <llvm/Transforms/Utils/LoopUtils.h>       // for llvm::InsertPreheaderForLoop
+#include <llvm/Transforms/Utils/PromoteMemToReg.h> // for llvm::PromoteMemToReg, llvm::isAllocaPromotable
+#include <algorithm>                               // for std::max, std::min_element
+#include <iterator>                                // for std::distance
+#include <map>                                     // for std::map
+#include <optional>                                // for std::optional
+#include <set>                                     // for std::set
+#include <tuple>                                   // for std::tuple
+#include <utility>                                 // for std::pair
+#include <vector>                                  // for std::vector
+
+// Rewrites scalar allocas that never escape into SSA values, so they get register slots like everything else.
+// Returns whether anything changed.
+bool promote_allocas(llvm::Function &function) {
+    // Unoptimized frontends put all their allocas at the top of the entry block.
+    std::vector<llvm::AllocaInst *> allocas;
+    for (llvm::Instruction &instruction : function.getEntryBlock()) {
+        llvm::AllocaInst *alloca = llvm::dyn_cast<llvm::AllocaInst>(&instruction);
+        // Promotable means that it's only ever loaded from and stored to directly, so its address never escapes.
+        if (alloca != nullptr && !alloca->isArrayAllocation() && alloca->getAllocatedType()->isIntOrPtrTy() && llvm::isAllocaPromotable(alloca)) {
+            allocas.push_back(alloca);
+        }
+    }
+
+    if (allocas.empty()) {
+        return false;
+    }
+
+    llvm::DominatorTree dominator_tree(function);
+    llvm::PromoteMemToReg(allocas, dominator_tree);
+    return true;
+}
+
+// What constant propagation knows about a value so far: nothing yet, that it's always the same constant, or that it
+// can be more than one thing.
+struct lattice_value {
+    enum { UNKNOWN, CONSTANT, OVERDEFINED } state = UNKNOWN;
+    llvm::ConstantInt *constant = nullptr;
+
+    bool operator==(lattice_value const &other) const {
+        return state == other.state && constant == other.constant;
+    }
+};
+
+static lattice_value const OVERDEFINED_VALUE{lattice_value::OVERDEFINED, nullptr};
+
+// Returns the constant that integer arithmetic, a comparison or an integer cast @instruction works out to when its
+// operands are @operands, or null if it doesn't fold into a plain integer (like a shift by too much) or would trap.
+static llvm::ConstantInt *fold(llvm::Instruction const &instruction, std::vector<llvm::ConstantInt *> const &operands) {
+    llvm::Constant *folded = nullptr;
+    if (llvm::ICmpInst const *icmp = llvm::dyn_cast<llvm::ICmpInst>(&instruction)) {
+        folded = llvm::ConstantExpr::getICmp(icmp->getPredicate(), operands[0], operands[1]);
+    }
+    else if (llvm::isa<llvm::CastInst>(instruction)) {
+        folded = llvm::ConstantExpr::getCast(instruction.getOpcode(), operands[0], instruction.getType());
+    }
+    else {
+        switch (instruction.getOpcode()) {
+        case llvm::Instruction::SDiv:
+        case llvm::Instruction::SRem:
+            if (operands[1]->isMinusOne() && operands[0]->getValue().isMinSignedValue()) {
+                return nullptr;
+            }
+            [[fallthrough]];
+        case llvm::Instruction::UDiv:
+        case llvm::Instruction::URem:
+            // Leave the ones that trap alone, so they still trap.
+            if (operands[1]->isZero()) {
+                return nullptr;
+            }
+            break;
+        default:
+            break;
+        }
+        folded = llvm::ConstantExpr::get(instruction.getOpcode(), operands[0], operands[1]);
+    }
+    return llvm::dyn_cast<llvm::ConstantInt>(folded);
+}
+
+// Sparse conditional constant propagation (Wegman and Zadeck). Starting from the entry block, only follows the edges
+// out of a branch or switch that its condition can actually take, and only lets phi nodes hear from incoming blocks
+// that can actually run, so constants make it around loops and through branches they decide. Then every integer value
+// that turned out to be a constant gets replaced by it, branches and switches on constants go straight where they go,
+// and the blocks nothing can get to any more are deleted, taking their phi edges with them.
+// Returns whether anything changed.
+bool propagate_constants(llvm::Function &function) {
+    std::map<llvm::Value const *, lattice_value> values;
+    std::set<std::pair<llvm::BasicBlock const *, llvm::BasicBlock const *>> executable_edges;
+    std::set<llvm::BasicBlock const *> executable_blocks;
+    std::vector<llvm::BasicBlock *> block_worklist;
+    std::vector<llvm::Instruction *> worklist;
+
+    auto lookup = [&](llvm::Value const *value) {
+        if (llvm::ConstantInt const *constant = llvm::dyn_cast<llvm::ConstantInt>(value)) {
+            return lattice_value{lattice_value::CONSTANT, const_cast<llvm::ConstantInt *>(constant)};
+        }
+        // Arguments, globals, undef and everything else we don't look into could be anything.
+        if (!llvm::isa<llvm::Instruction>(value)) {
+            return OVERDEFINED_VALUE;
+        }
+        auto found = values.find(value);
+        return found == values.end() ? lattice_value{} : found->second;
+    };
+
+    auto update = [&](llvm::Instruction &instruction, lattice_value value) {
+        lattice_value &old = values[&instruction];
+        if (old == value) {
+            return;
+        }
+        old = value;
+        for (llvm::User *user : instruction.users()) {
+            llvm::Instruction *user_instruction = llvm::cast<llvm::Instruction>(user);
+            if (executable_blocks.count(user_instruction->getParent()) != 0) {
+                worklist.push_back(user_instruction);
+            }
+        }
+    };
+
+    auto mark_edge = [&](llvm::BasicBlock *from, llvm::BasicBlock *to) {
+        if (!executable_edges.insert({from, to}).second) {
+            return;
+        }
+        if (executable_blocks.insert(to).second) {
+            block_worklist.push_back(to);
+        }
+        else {
+            // The phi nodes have a new incoming value to hear from.
+            for (llvm::PHINode &phi_node : to->phis()) {
+                worklist.push_back(&phi_node);
+            }
+        }
+    };
+
+    auto visit = [&](llvm::Instruction &instruction) {
+        llvm::BasicBlock *block = instruction.getParent();
+
+        if (llvm::BranchInst *br = llvm::dyn_cast<llvm::BranchInst>(&instruction)) {
+            if (br->isUnconditional()) {
+                mark_edge(block, br->getSuccessor(0));
+                return;
+            }
+            lattice_value condition = lookup(br->getCondition());
+            if (condition.state == lattice_value::CONSTANT) {
+                mark_edge(block, br->getSuccessor(condition.constant->isOne() ? 0 : 1));
+            }
+            else if (condition.state == lattice_value::OVERDEFINED) {
+                mark_edge(block, br->getSuccessor(0));
+                mark_edge(block, br->getSuccessor(1));
+            }
+            return;
+        }
+
+        if (llvm::SwitchInst *switch_inst = llvm::dyn_cast<llvm::SwitchInst>(&instruction)) {
+            lattice_value condition = lookup(switch_inst->getCondition());
+            if (condition.state == lattice_value::CONSTANT) {
+                mark_edge(block, switch_inst->findCaseValue(condition.constant)->getCaseSuccessor());
+            }
+            else if (condition.state == lattice_value::OVERDEFINED) {
+                for (llvm::BasicBlock *successor : llvm::successors(block)) {
+                    mark_edge(block, successor);
+                }
+            }
+            return;
+        }
+
+        if (instruction.isTerminator()) {
+            for (llvm::BasicBlock *successor : llvm::successors(block)) {
+                mark_edge(block, successor);
+            }
+            return;
+        }
+
+        if (instruction.getType()->isVoidTy()) {
+            return;
+        }
+        if (!instruction.getType()->isIntegerTy()) {
+            update(instruction, OVERDEFINED_VALUE);
+            return;
+        }
+
+        if (llvm::PHINode *phi_node = llvm::dyn_cast<llvm::PHINode>(&instruction)) {
+            lattice_value merged;
+            for (unsigned i = 0; i < phi_node->getNumIncomingValues() && merged.state != lattice_value::OVERDEFINED; i++) {
+                if (executable_edges.count({phi_node->getIncomingBlock(i), block}) == 0) {
+                    continue;
+                }
+                lattice_value incoming = lookup(phi_node->getIncomingValue(i));
+                if (incoming.state == lattice_value::UNKNOWN) {
+                    continue;
+                }
+                if (merged.state == lattice_value::UNKNOWN || incoming.state == lattice_value::OVERDEFINED) {
+                    merged = incoming;
+                }
+                else if (merged.constant != incoming.constant) {
+                    merged = OVERDEFINED_VALUE;
+                }
+            }
+            update(instruction, merged);
+            return;
+        }
+
+        if (llvm::SelectInst *select = llvm::dyn_cast<llvm::SelectInst>(&instruction)) {
+            lattice_value condition = lookup(select->getCondition());
+            lattice_value true_value = lookup(select->getTrueValue());
+            lattice_value false_value = lookup(select->getFalseValue());
+            if (condition.state == lattice_value::CONSTANT) {
+                update(instruction, condition.constant->isOne() ? true_value : false_value);
+            }
+            else if (condition.state == lattice_value::OVERDEFINED) {
+                // It could still be the same constant either way.
+                bool same = true_value.state == lattice_value::CONSTANT && true_value == false_value;
+                update(instruction, same ? true_value : OVERDEFINED_VALUE);
+            }
+            return;
+        }
+
+        unsigned opcode = instruction.getOpcode();
+        bool integer_cast = opcode == llvm::Instruction::SExt || opcode == llvm::Instruction::ZExt || opcode == llvm::Instruction::Trunc;
+        if (!llvm::isa<llvm::BinaryOperator>(instruction) && !llvm::isa<llvm::ICmpInst>(instruction) && !integer_cast) {
+            update(instruction, OVERDEFINED_VALUE);
+            return;
+        }
+
+        std::vector<llvm::ConstantInt *> operands;
+        for (llvm::Value *operand : instruction.operands()) {
+            lattice_value value = lookup(operand);
+            if (value.state == lattice_value::UNKNOWN) {
+                return;
+            }
+            if (value.state == lattice_value::OVERDEFINED) {
+                update(instruction, OVERDEFINED_VALUE);
+                return;
+            }
+            operands.push_back(value.constant);
+        }
+        llvm::ConstantInt *folded = fold(instruction, operands);
+        update(instruction, folded == nullptr ? OVERDEFINED_VALUE : lattice_value{lattice_value::CONSTANT, folded});
+    };
+
+    executable_blocks.insert(&function.getEntryBlock());
+    block_worklist.push_back(&function.getEntryBlock());
+    while (!block_worklist.empty() || !worklist.empty()) {
+        while (!worklist.empty()) {
+            llvm::Instruction *instruction = worklist.back();
+            worklist.pop_back();
+            visit(*instruction);
+        }
+        if (!block_worklist.empty()) {
+            llvm::BasicBlock *block = block_worklist.back();
+            block_worklist.pop_back();
+            for (llvm::Instruction &instruction : *block) {
+                visit(instruction);
+            }
+        }
+    }
+
+    bool changed = false;
+    for (llvm::BasicBlock &block : function) {
+        if (executable_blocks.count(&block) == 0) {
+            continue;
+        }
+        for (auto it = block.begin(); it != block.end();) {
+            llvm::Instruction &instruction = *it++;
+            auto found = values.find(&instruction);
+            if (found != values.end() && found->second.state == lattice_value::CONSTANT) {
+                instruction.replaceAllUsesWith(found->second.constant);
+                instruction.eraseFromParent();
+                changed = true;
+            }
+        }
+
+        // Branches and switches on constants only go one way now.
+        llvm::Instruction const *terminator = block.getTerminator();
+        llvm::BranchInst const *br = llvm::dyn_cast<llvm::BranchInst>(terminator);
+        llvm::SwitchInst const *switch_inst = llvm::dyn_cast<llvm::SwitchInst>(terminator);
+        if ((br != nullptr && br->isConditional() && llvm::isa<llvm::ConstantInt>(br->getCondition())) ||
+            (switch_inst != nullptr && llvm::isa<llvm::ConstantInt>(switch_inst->getCondition()))) {
+            changed = llvm::ConstantFoldTerminator(&block) || changed;
+        }
+    }
+
+    // Everything that never got marked executable can't be gotten to from the entry block any more.
+    changed = llvm::removeUnreachableBlocks(function) || changed;
+    return changed;
+}
+
+// Returns something simpler that @instruction always computes the same thing as, like a constant, or one of its own
+// operands, or null if there isn't anything simpler.
+static llvm::Value *simplify(llvm::Instruction &instruction) {
+    unsigned opcode = instruction.getOpcode();
+    bool integer_cast = opcode == llvm::Instruction::SExt || opcode == llvm::Instruction::ZExt || opcode == llvm::Instruction::Trunc;
+    if (integer_cast && llvm::isa<llvm::ConstantInt>(instruction.getOperand(0))) {
+        // LLVM folds casts of constants as soon as you ask for them.
+        return llvm::ConstantExpr::getCast(opcode, llvm::cast<llvm::ConstantInt>(instruction.getOperand(0)), instruction.getType());
+    }
+
+    if (llvm::isa<llvm::SelectInst>(instruction)) {
+        llvm::SelectInst &select = llvm::cast<llvm::SelectInst>(instruction);
+        // select true, a, b and select c, a, a
+        if (llvm::isa<llvm::ConstantInt>(select.getCondition())) {
+            return llvm::cast<llvm::ConstantInt>(select.getCondition())->isOne() ? select.getTrueValue() : select.getFalseValue();
+        }
+        if (select.getTrueValue() == select.getFalseValue()) {
+            return select.getTrueValue();
+        }
+        return nullptr;
+    }
+
+    if (!llvm::isa<llvm::BinaryOperator>(instruction)) {
+        return nullptr;
+    }
+    llvm::Value *lhs = instruction.getOperand(0);
+    llvm::Value *rhs = instruction.getOperand(1);
+    llvm::ConstantInt *lhs_constant = llvm::dyn_cast<llvm::ConstantInt>(lhs);
+    llvm::ConstantInt *rhs_constant = llvm::dyn_cast<llvm::ConstantInt>(rhs);
+
+    if (lhs_constant != nullptr && rhs_constant != nullptr) {
+        llvm::APInt const &l = lhs_constant->getValue();
+        llvm::APInt const &r = rhs_constant->getValue();
+        switch (instruction.getOpcode()) {
+        case llvm::Instruction::Add:
+            return llvm::ConstantInt::get(instruction.getType(), l + r);
+        case llvm::Instruction::Sub:
+            return llvm::ConstantInt::get(instruction.getType(), l - r);
+        case llvm::Instruction::Mul:
+            return llvm::ConstantInt::get(instruction.getType(), l * r);
+        case llvm::Instruction::SDiv:
+            // Leave the ones that trap alone, so they still trap.
+            if (r.isNullValue() || (r.isAllOnesValue() && l.isMinSignedValue())) {
+                return nullptr;
+            }
+            return llvm::ConstantInt::get(instruction.getType(), l.sdiv(r));
+        default:
+            return nullptr;
+        }
+    }
+
+    switch (instruction.getOpcode()) {
+    case llvm::Instruction::Add:
+        // x + 0 and 0 + x
+        if (rhs_constant != nullptr && rhs_constant->isZero()) {
+            return lhs;
+        }
+        if (lhs_constant != nullptr && lhs_constant->isZero()) {
+            return rhs;
+        }
+        return nullptr;
+    case llvm::Instruction::Sub:
+        // x - 0 and x - x
+        if (rhs_constant != nullptr && rhs_constant->isZero()) {
+            return lhs;
+        }
+        if (lhs == rhs) {
+            return llvm::ConstantInt::get(instruction.getType(), 0);
+        }
+        return nullptr;
+    case llvm::Instruction::Mul:
+        // x * 1, 1 * x, x * 0 and 0 * x
+        if (rhs_constant != nullptr && (rhs_constant->isOne() || rhs_constant->isZero())) {
+            return rhs_constant->isOne() ? lhs : rhs;
+        }
+        if (lhs_constant != nullptr && (lhs_constant->isOne() || lhs_constant->isZero())) {
+            return lhs_constant->isOne() ? rhs : lhs;
+        }
+        return nullptr;
+    case llvm::Instruction::SDiv:
+        // x / 1
+        if (rhs_constant != nullptr && rhs_constant->isOne()) {
+            return lhs;
+        }
+        return nullptr;
+    default:
+        return nullptr;
+    }
+}
+
+// Local value numbering. Within each block, folds arithmetic on constants, and reuses the result of an earlier
+// identical computation instead of doing it again. Since this is SSA, once a value has been replaced by the earlier
+// one, two computations are identical exactly when their opcodes, types and operands are.
+// Comparisons are left alone, since branches and selects need their own comparison right in front of them.
+// Returns whether anything changed.
+bool number_values(llvm::Function &function) {
+    bool changed = false;
+    for (llvm::BasicBlock &block : function) {
+        std::map<std::tuple<unsigned, llvm::Type *, llvm::Value *, llvm::Value *>, llvm::Instruction *> available;
+        for (auto it = block.begin(); it != block.end();) {
+            llvm::Instruction &instruction = *it++;
+
+            llvm::Value *simpler = simplify(instruction);
+            if (simpler != nullptr) {
+                instruction.replaceAllUsesWith(simpler);
+                instruction.eraseFromParent();
+                changed = true;
+                continue;
+            }
+
+            if (!llvm::isa<llvm::BinaryOperator>(instruction) && !llvm::isa<llvm::CastInst>(instruction)) {
+                continue;
+            }
+
+            llvm::Value *first = instruction.getOperand(0);
+            llvm::Value *second = instruction.getNumOperands() > 1 ? instruction.getOperand(1) : nullptr;
+            // a + b is the same as b + a, so put the operands of those in a consistent order.
+            if (instruction.isCommutative() && std::less<llvm::Value *>()(second, first)) {
+                std::swap(first, second);
+            }
+
+            auto key = std::make_tuple(instruction.getOpcode(), instruction.getType(), first, second);
+            auto found = available.find(key);
+            if (found != available.end()) {
+                // The earlier one only keeps the flags (like nsw) that both of them had.
+                found->second->andIRFlags(&instruction);
+                instruction.replaceAllUsesWith(found->second);
+                instruction.eraseFromParent();
+                changed = true;
+            }
+            else {
+                available.insert({key, &instruction});
+            }
+        }
+    }
+    return changed;
+}
+
+// Returns whether @instruction reads the flags from a comparison identical to @comparison, without touching them.
+static bool shares_flags(llvm::Instruction const &instruction, llvm::ICmpInst const &comparison) {
+    llvm::Value const *condition = nullptr;
+    if (llvm::isa<llvm::SelectInst>(instruction)) {
+        condition = llvm::cast<llvm::SelectInst>(instruction).getCondition();
+    }
+    else if (llvm::isa<llvm::ZExtInst>(instruction)) {
+        condition = instruction.getOperand(0);
+    }
+    return condition != nullptr && llvm::isa<llvm::ICmpInst>(condition) && llvm::cast<llvm::ICmpInst>(condition)->isIdenticalTo(&comparison);
+}
+
+// Gives everything that reads a comparison out of the flags (branches, selects and extensions) a copy of the
+// comparison right in front of it, so nothing can clobber the flags in between. Selects and zero-extensions leave the
+// flags alone, so a run of them can share one copy. Comparisons that end up with no uses go away.
+// Returns whether anything changed.
+bool place_comparisons(llvm::Function &function) {
+    // Go through the readers in order, so that a run of them that can share a copy finds the first one's copy.
+    std::vector<std::pair<llvm::Instruction *, llvm::ICmpInst *>> readers;
+    std::vector<llvm::ICmpInst *> comparisons;
+    for (llvm::BasicBlock &block : function) {
+        for (llvm::Instruction &instruction : block) {
+            if (llvm::isa<llvm::ICmpInst>(instruction)) {
+                comparisons.push_back(llvm::cast<llvm::ICmpInst>(&instruction));
+            }
+            for (llvm::Value *operand : instruction.operands()) {
+                if (llvm::isa<llvm::ICmpInst>(operand) && reads_flags(instruction, *operand)) {
+                    readers.push_back({&instruction, llvm::cast<llvm::ICmpInst>(operand)});
+                    break;
+                }
+            }
+        }
+    }
+
+    bool changed = false;
+    for (auto const &[reader, comparison] : readers) {
+        // Look back past anything that shares the flags for a copy that's already there.
+        llvm::Instruction *previous = reader->getPrevNode();
+        while (previous != nullptr && shares_flags(*previous, *comparison)) {
+            previous = previous->getPrevNode();
+        }
+
+        llvm::ICmpInst *copy = nullptr;
+        if (previous != nullptr && llvm::isa<llvm::ICmpInst>(previous) && previous->isIdenticalTo(comparison)) {
+            copy = llvm::cast<llvm::ICmpInst>(previous);
+        }
+        else {
+            copy = llvm::cast<llvm::ICmpInst>(comparison->clone());
+            copy->setName(comparison->getName());
+            copy->insertBefore(reader);
+        }
+
+        if (copy != comparison) {
+            reader->replaceUsesOfWith(comparison, copy);
+            changed = true;
+        }
+    }
+
+    for (llvm::ICmpInst *comparison : comparisons) {
+        if (comparison->use_empty()) {
+            comparison->eraseFromParent();
+        }
+    }
+    return changed;
+}
+
+// How much straight-line work we're willing to do to avoid a branch, in roughly the number of cycles it takes.
+// A mispredicted branch costs more than this, but a well-predicted one costs almost nothing, so we stay modest.
+static int const IF_CONVERSION_BUDGET = 6;
+
+// Returns roughly how many cycles it would cost to run @block's instructions unconditionally, or -1 if they can't all
+// be run unconditionally, eg. because they touch memory, call something, or might divide by zero.
+static int speculation_cost(llvm::BasicBlock const &block) {
+    int cost = 0;
+    for (llvm::Instruction const &instruction : block) {
+        if (instruction.isTerminator()) {
+            break;
+        }
+        switch (instruction.getOpcode()) {
+        case llvm::Instruction::Add:
+        case llvm::Instruction::Sub:
+            cost += 1;
+            break;
+        case llvm::Instruction::Mul:
+            cost += 3;
+            break;
+        default:
+            return -1;
+        }
+    }
+    return cost;
+}
+
+// Tries to turn the triangle or diamond hanging off of @head's conditional branch into straight-line code, with a
+// select for each phi node where the arms meet back up. Returns whether it did.
+static bool if_convert_block(llvm::BasicBlock &head) {
+    llvm::BranchInst *branch = llvm::dyn_cast<llvm::BranchInst>(head.getTerminator());
+    if (branch == nullptr || !branch->isConditional()) {
+        return false;
+    }
+
+    // The selects need the comparison's flags, so the comparison has to be something we can move down next to them.
+    llvm::ICmpInst *condition = llvm::dyn_cast<llvm::ICmpInst>(branch->getCondition());
+    if (condition == nullptr || condition->getParent() != &head || !condition->hasOneUse()) {
+        return false;
+    }
+
+    llvm::BasicBlock *if_true = branch->getSuccessor(0);
+    llvm::BasicBlock *if_false = branch->getSuccessor(1);
+    if (if_true == if_false) {
+        return false;
+    }
+
+    // An arm is a block that only @head goes to, and that goes straight on to one other block.
+    auto is_arm = [&](llvm::BasicBlock *block) {
+        return block->getSinglePredecessor() == &head && block->getSingleSuccessor() != nullptr && !llvm::isa<llvm::PHINode>(block->front());
+    };
+
+    llvm::BasicBlock *merge = nullptr;
+    std::vector<llvm::BasicBlock *> arms;
+    if (is_arm(if_true) && is_arm(if_false) && if_true->getSingleSuccessor() == if_false->getSingleSuccessor()) {
+        merge = if_true->getSingleSuccessor();
+        arms = {if_true, if_false};
+    }
+    else if (is_arm(if_true) && if_true->getSingleSuccessor() == if_false) {
+        merge = if_false;
+        arms = {if_true};
+    }
+    else if (is_arm(if_false) && if_false->getSingleSuccessor() == if_true) {
+        merge = if_true;
+        arms = {if_false};
+    }
+    else {
+        return false;
+    }
+
+    // If anything else comes into the merge block, its phi nodes have to stay phi nodes.
+    if (merge == &head || std::distance(llvm::pred_begin(merge), llvm::pred_end(merge)) != 2) {
+        return false;
+    }
+
+    // Each phi node turns into a cmov, and both arms always run.
+    int cost = std::distance(merge->phis().begin(), merge->phis().end());
+    for (llvm::BasicBlock *arm : arms) {
+        int arm_cost = speculation_cost(*arm);
+        if (arm_cost < 0) {
+            return false;
+        }
+        cost += arm_cost;
+    }
+    if (cost > IF_CONVERSION_BUDGET) {
+        return false;
+    }
+
+    // Hoist the arms into the head, then put the comparison right after them so nothing clobbers its flags before
+    // the selects.
+    for (llvm::BasicBlock *arm : arms) {
+        while (&arm->front() != arm->getTerminator()) {
+            arm->front().moveBefore(branch);
+        }
+    }
+    condition->moveBefore(branch);
+
+    // The blocks that the merge block's phi nodes see the true and false edges come from.
+    llvm::BasicBlock *true_edge = if_true == merge ? &head : if_true;
+    llvm::BasicBlock *false_edge = if_false == merge ? &head : if_false;
+
+    std::vector<llvm::PHINode *> phi_nodes;
+    for (llvm::PHINode &phi_node : merge->phis()) {
+        phi_nodes.push_back(&phi_node);
+    }
+    for (llvm::PHINode *phi_node : phi_nodes) {
+        llvm::SelectInst *select = llvm::SelectInst::Create(condition, phi_node->getIncomingValueForBlock(true_edge),
+                                                            phi_node->getIncomingValueForBlock(false_edge), phi_node->getName(), branch);
+        phi_node->replaceAllUsesWith(select);
+        phi_node->eraseFromParent();
+    }
+
+    llvm::BranchInst::Create(merge, branch);
+    branch->eraseFromParent();
+    for (llvm::BasicBlock *arm : arms) {
+        arm->eraseFromParent();
+    }
+
+    // Now the head just falls into the merge block, so they might as well be one block.
+    llvm::MergeBlockIntoPredecessor(merge);
+    return true;
+}
+
+// Replaces small triangles and diamonds in the control flow graph with selects, which turn into branchless code.
+// Arms that would cost too much to run unconditionally keep their branches.
+// Returns whether anything changed.
+bool if_convert(llvm::Function &function) {
+    bool changed = false;
+    bool converted = true;
+    // Converting one diamond can make the one around it small enough, so keep going until nothing changes.
+    while (converted) {
+        converted = false;
+        for (llvm::BasicBlock &block : function) {
+            if (if_convert_block(block)) {
+                converted = changed = true;
+                break;
+            }
+        }
+    }
+    return changed;
+}
+
+// Returns whether @instruction can be moved somewhere that it might run more often than it used to, without changing
+// what the program does.
+static bool is_hoistable(llvm::Instruction const &instruction) {
+    switch (instruction.getOpcode()) {
+    case llvm::Instruction::Add:
+    case llvm::Instruction::Sub:
+    case llvm::Instruction::Mul:
+        return true;
+    case llvm::Instruction::SDiv: {
+        // Division traps on zero and on INT_MIN / -1, so only a constant divisor that can't do either is safe.
+        llvm::ConstantInt const *divisor = llvm::dyn_cast<llvm::ConstantInt>(instruction.getOperand(1));
+        return divisor != nullptr && !divisor->isZero() && !divisor->isMinusOne();
+    }
+    default:
+        // Note that comparisons stay put, since branches and selects need them right in front of them for the flags.
+        return false;
+    }
+}
+
+// Moves arithmetic that computes the same thing on every trip around a loop out into the loop's preheader, so it only
+// gets computed once. Inner loops go first, so something invariant in a whole loop nest ends up outside all of it.
+// Returns whether anything changed.
+bool hoist_loop_invariants(llvm::Function &function) {
+    llvm::DominatorTree dominator_tree(function);
+    llvm::LoopInfo loop_info(dominator_tree);
+
+    bool changed = false;
+    llvm::SmallVector<llvm::Loop *, 4> loops = loop_info.getLoopsInPreorder();
+    for (llvm::Loop *loop : llvm::reverse(loops)) {
+        // The preheader is the one block outside the loop that goes into it. If there isn't one, make one.
+        llvm::BasicBlock *preheader = loop->getLoopPreheader();
+        if (preheader == nullptr) {
+            preheader = llvm::InsertPreheaderForLoop(loop, &dominator_tree, &loop_info, nullptr, false);
+            if (preheader == nullptr) {
+                continue;
+            }
+            changed = true;
+        }
+
+        // Hoisting one instruction can make the ones that use it invariant, so keep going until nothing moves.
+        bool hoisted = true;
+        while (hoisted) {
+            hoisted = false;
+            for (llvm::BasicBlock *block : loop->blocks()) {
+                for (auto it = block->begin(); it != block->end();) {
+                    llvm::Instruction &instruction = *it++;
+                    if (is_hoistable(instruction) && loop->hasLoopInvariantOperands(&instruction)) {
+                        instruction.moveBefore(preheader->getTerminator());
+                        hoisted = changed = true;
+                    }
+                }
+            }
+        }
+    }
+    return changed;
+}
+
+// Roughly how many cycles it takes a recent x86 core (something like Skylake or Zen 2) before the result of the code
+// we generate for @instruction can be used by the next instruction that needs it.
+static unsigned latency(llvm::Instruction const &instruction) {
+    switch (instruction.getOpcode()) {
+    case llvm::Instruction::PHI:
+    case llvm::Instruction::Alloca:
+        return 0;
+    case llvm::Instruction::Mul:
+        return 3;
+    case llvm::Instruction::SDiv:
+    case llvm::Instruction::UDiv:
+    case llvm::Instruction::SRem:
+    case llvm::Instruction::URem:
+        // 64-bit idiv is a lot slower than 32-bit idiv on everything before Ice Lake.
+        return instruction.getType()->getIntegerBitWidth() > 32 ? 42 : 26;
+    case llvm::Instruction::Load:
+        return 5;
+    case llvm::Instruction::Call:
+        return 5;
+    default:
+        return 1;
+    }
+}
+
+// How many registers the slot allocator has to hand out (not counting %rbp in leaf functions). Once that many values
+// are live at once, the next one gets spilled.
+static unsigned const SCHEDULING_REGISTERS = 13;
+
+// Something the scheduler places all at once. That's usually one instruction, but a comparison and the branches,
+// selects and extensions right after it that read its flags have to stay together, since everything else clobbers
+// the flags. %rax and %rdx are only ever scratch space inside the code for one instruction, so the flags are the only
+// thing besides slots and memory that gets passed from one instruction to the next.
+struct schedule_node {
+    std::vector<llvm::Instruction *> instructions;
+
+    // The nodes that have to come after this one, and how many cycles after.
+    std::vector<std::pair<size_t, unsigned>> successors;
+
+    // How many nodes that have to come before this one haven't been placed yet.
+    unsigned waiting_for = 0;
+
+    // The longest path in cycles from the start of this node to the end of the block.
+    unsigned height = 0;
+
+    // The earliest cycle this node can start without waiting for anything.
+    unsigned earliest = 0;
+};
+
+// List scheduling. Reorders the instructions in @block, whose function has the liveness @live, keeping phi nodes and
+// allocas where they are and the terminator at the end, so that the ones on the longest chain of latencies go first and
+// independent work fills in behind slow instructions like idiv. When nearly every register is taken, it goes for
+// whatever frees up the most slots instead, so the slot allocator doesn't have to spill anything it wouldn't have
+// anyway.
+// Returns whether anything changed.
+static bool schedule_block(llvm::BasicBlock &block, liveness const &live) {
+    std::vector<schedule_node> nodes;
+    std::map<llvm::Instruction const *, size_t> node_of;
+    for (llvm::Instruction &instruction : block) {
+        if (llvm::isa<llvm::PHINode>(instruction) || llvm::isa<llvm::AllocaInst>(instruction)) {
+            continue;
+        }
+        // place_comparisons put every comparison right in front of whatever reads its flags.
+        bool reads_comparison = false;
+        for (llvm::Value *operand : instruction.operands()) {
+            llvm::Instruction *comparison = llvm::dyn_cast<llvm::ICmpInst>(operand);
+            if (comparison != nullptr && comparison->getParent() == &block && reads_flags(instruction, *comparison)) {
+                reads_comparison = true;
+            }
+        }
+        if (!reads_comparison || nodes.empty()) {
+            nodes.emplace_back();
+        }
+        nodes.back().instructions.push_back(&instruction);
+        node_of[&instruction] = nodes.size() - 1;
+    }
+    if (nodes.size() < 3) {
+        return false;
+    }
+
+    auto add_edge = [&](size_t from, size_t to, unsigned cycles) {
+        if (from != to) {
+            nodes[from].successors.push_back({to, cycles});
+            nodes[to].waiting_for++;
+        }
+    };
+
+    // The values each node reads out of slots, and how many unplaced nodes still read each of them.
+    std::vector<std::set<llvm::Value const *>> reads(nodes.size());
+    std::map<llvm::Value const *, unsigned> remaining_readers;
+
+    // Stores and calls stay in order, and loads and divisions (which might trap) stay between the same two of them.
+    std::optional<size_t> last_writer;
+    std::vector<size_t> readers_since;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        bool writes = false;
+        bool reads_memory = false;
+        for (llvm::Instruction *instruction : nodes[i].instructions) {
+            for (llvm::Value *operand : instruction->operands()) {
+                llvm::Instruction *definition = llvm::dyn_cast<llvm::Instruction>(operand);
+                if (definition != nullptr && node_of.count(definition) != 0) {
+                    add_edge(node_of[definition], i, latency(*definition));
+                }
+                if (needs_slot(*operand) && (definition == nullptr || node_of.count(definition) == 0 || node_of[definition] != i)) {
+                    reads[i].insert(operand);
+                }
+            }
+            writes = writes || instruction->mayWriteToMemory() || instruction->mayHaveSideEffects();
+            reads_memory = reads_memory || instruction->mayReadFromMemory() || instruction->isIntDivRem();
+        }
+        for (llvm::Value const *value : reads[i]) {
+            remaining_readers[value]++;
+        }
+
+        if (writes) {
+            if (last_writer.has_value()) {
+                add_edge(*last_writer, i, 1);
+            }
+            for (size_t reader : readers_since) {
+                add_edge(reader, i, 0);
+            }
+            readers_since.clear();
+            last_writer = i;
+        }
+        else if (reads_memory) {
+            if (last_writer.has_value()) {
+                add_edge(*last_writer, i, 1);
+            }
+            readers_since.push_back(i);
+        }
+    }
+
+    // The terminator goes last.
+    size_t last = nodes.size() - 1;
+    for (size_t i = 0; i < last; i++) {
+        add_edge(i, last, 0);
+    }
+
+    // Edges only go forward, so the heights can be filled in from the bottom up.
+    for (size_t i = nodes.size(); i-- > 0;) {
+        for (llvm::Instruction *instruction : nodes[i].instructions) {
+            nodes[i].height = std::max(nodes[i].height, latency(*instruction));
+        }
+        for (auto const &[successor, cycles] : nodes[i].successors) {
+            nodes[i].height = std::max(nodes[i].height, cycles + nodes[successor].height);
+        }
+    }
+
+    // The values in slots right before the first node, and what placing node @i does to them.
+    std::set<llvm::Value const *> const &live_out = live.live_out.at(&block);
+    std::set<llvm::Value const *> live_before = live.live_in.at(&block);
+    for (llvm::Instruction const &instruction : block) {
+        if (node_of.count(&instruction) == 0 && needs_slot(instruction)) {
+            live_before.insert(&instruction);
+        }
+    }
+    auto place = [&](size_t i, std::set<llvm::Value const *> &live_values, std::map<llvm::Value const *, unsigned> &readers) {
+        for (llvm::Value const *value : reads[i]) {
+            if (--readers[value] == 0 && live_out.count(value) == 0) {
+                live_values.erase(value);
+            }
+        }
+        for (llvm::Instruction *instruction : nodes[i].instructions) {
+            if (needs_slot(*instruction)) {
+                live_values.insert(instruction);
+            }
+        }
+    };
+
+    // The most values that are ever in slots at once if the nodes go in @order.
+    auto peak_pressure = [&](std::vector<size_t> const &order) {
+        std::set<llvm::Value const *> live_values = live_before;
+        std::map<llvm::Value const *, unsigned> readers = remaining_readers;
+        size_t peak = live_values.size();
+        for (size_t i : order) {
+            place(i, live_values, readers);
+            peak = std::max(peak, live_values.size());
+        }
+        return peak;
+    };
+
+    // peak_pressure starts over from these, so these are copies for placing the nodes one at a time.
+    std::set<llvm::Value const *> live_values = live_before;
+    std::map<llvm::Value const *, unsigned> readers_left = remaining_readers;
+
+    // How many more slots would be taken after placing node @i next.
+    auto pressure_change = [&](size_t i) {
+        int change = 0;
+        for (llvm::Instruction *instruction : nodes[i].instructions) {
+            if (needs_slot(*instruction)) {
+                change++;
+            }
+        }
+        for (llvm::Value const *value : reads[i]) {
+            if (readers_left[value] == 1 && live_out.count(value) == 0) {
+                change--;
+            }
+        }
+        return change;
+    };
+
+    std::vector<size_t> ready;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (nodes[i].waiting_for == 0) {
+            ready.push_back(i);
+        }
+    }
+
+    std::vector<size_t> order;
+    unsigned cycle = 0;
+    while (!ready.empty()) {
+        bool crowded = live_values.size() + 1 >= SCHEDULING_REGISTERS;
+        auto better = [&](size_t a, size_t b) {
+            if (crowded && pressure_change(a) != pressure_change(b)) {
+                return pressure_change(a) < pressure_change(b);
+            }
+            // Something that can start right away beats something that would stall, and if everything would stall,
+            // the one that stalls the least goes first.
+            unsigned a_start = std::max(nodes[a].earliest, cycle);
+            unsigned b_start = std::max(nodes[b].earliest, cycle);
+            if (a_start != b_start) {
+                return a_start < b_start;
+            }
+            if (nodes[a].height != nodes[b].height) {
+                return nodes[a].height > nodes[b].height;
+            }
+            return a < b;
+        };
+        auto best = std::min_element(ready.begin(), ready.end(), better);
+        size_t chosen = *best;
+        ready.erase(best);
+        order.push_back(chosen);
+
+        // One node starts per cycle.
+        cycle = std::max(nodes[chosen].earliest, cycle);
+        for (auto const &[successor, cycles] : nodes[chosen].successors) {
+            nodes[successor].earliest = std::max(nodes[successor].earliest, cycle + cycles);
+            if (--nodes[successor].waiting_for == 0) {
+                ready.push_back(successor);
+            }
+        }
+        cycle++;
+
+        place(chosen, live_values, readers_left);
+    }
+
+    std::vector<size_t> original(nodes.size());
+    for (size_t i = 0; i < nodes.size(); i++) {
+        original[i] = i;
+    }
+    if (order == original) {
+        return false;
+    }
+
+    // Hiding some latency isn't worth a spill, so if the new order needs more registers than there are (and more than
+    // the old order did), keep the old one.
+    size_t peak = peak_pressure(order);
+    if (peak > SCHEDULING_REGISTERS && peak > peak_pressure(original)) {
+        return false;
+    }
+
+    for (size_t i : order) {
+        for (llvm::Instruction *instruction : nodes[i].instructions) {
+            instruction->removeFromParent();
+            block.getInstList().push_back(instruction);
+        }
+    }
+    return true;
+}
+
+// Schedules the instructions in every block of @function, so that slow instructions get started as early as they can
+// and the instructions that need their results come as late as they can, without running out of registers.
+// Returns whether anything changed.
+bool schedule_instructions(llvm::Function &function) {
+    liveness live = compute_liveness(function);
+    bool changed = false;
+    for (llvm::BasicBlock &block : function) {
+        changed = schedule_block(block, live) || changed;
+    }
+    return changed;
+}
+
+// Fills in @depths with how many loops deep each block in @function is. Blocks that aren't in any loop are at 0.
+void compute_loop_depths(llvm::Function &function, std::map<llvm::BasicBlock const *, unsigned> &depths) {
+    llvm::DominatorTree dominator_tree(function);
+    llvm::LoopInfo loop_info(dominator_tree);
+    for (llvm::BasicBlock const &block : function) {
+        depths[&block] = loop_info.getLoopDepth(&block);
+    }
+}
+
+// Lists everything in @module that gets counted when a program is instrumented. Every function's entry comes first,
+// then every edge out of each block, in the order the blocks and their successors come in. The order only depends on
+// the IR, so a profile written by an instrumented program lines up with the same IR when it gets compiled again.
+std::vector<profile_counter> list_profile_counters(llvm::Module &module) {
+    std::vector<profile_counter> counters;
+    for (llvm::Function &function : module) {
+        if (function.isDeclaration()) {
+            continue;
+        }
+        counters.push_back({nullptr, &function.getEntryBlock()});
+        for (llvm::BasicBlock &block : function) {
+            // A switch can have several cases that go to the same place. That's only one edge as far as we're concerned.
+            std::set<llvm::BasicBlock *> seen;
+            for (llvm::BasicBlock *successor : llvm::successors(&block)) {
+                if (seen.insert(successor).second) {
+                    counters.push_back({&block, successor});
+                }
+            }
+        }
+    }
+    return counters;
+}
+
+// Decides where each of @counters gets bumped, and fills in the instrumentation part of @options.
+// A function's entry gets counted at the start of its entry block. An edge gets counted at the start of the block it
+// goes to if nothing else goes there, or else at the end of the block it comes from if that can't go anywhere else.
+// If neither is true, the edge is critical, so it gets split, and the new block in the middle counts it.
+void place_profile_counters(std::vector<profile_counter> const &counters, x86Options &options) {
+    options.instrument = true;
+    options.counter_count = counters.size();
+
+    for (size_t i = 0; i < counters.size(); i++) {
+        llvm::BasicBlock *from = counters[i].from;
+        llvm::BasicBlock *to = counters[i].to;
+
+        if (from == nullptr || to->getUniquePredecessor() == from) {
+            options.counters_at_start[to].push_back(i);
+            continue;
+        }
+
+        if (from->getUniqueSuccessor() == to) {
+            // A conditional branch that goes to the same place either way would need the flags after the counter had
+            // clobbered them, so it turns into an unconditional one.
+            llvm::BranchInst *br = llvm::dyn_cast<llvm::BranchInst>(from->getTerminator());
+            if (br != nullptr && br->isConditional()) {
+                llvm::Value *condition = br->getCondition();
+                llvm::BranchInst::Create(to, br);
+                br->eraseFromParent();
+                llvm::RecursivelyDeleteTriviallyDeadInstructions(condition);
+            }
+            options.counters_at_end[from].push_back(i);
+            continue;
+        }
+
+        llvm::Instruction *terminator = from->getTerminator();
+        llvm::BasicBlock *middle = nullptr;
+        for (unsigned j = 0; j < terminator->getNumSuccessors() && middle == nullptr; j++) {
+            if (terminator->getSuccessor(j) == to) {
+                middle = llvm::SplitCriticalEdge(terminator, j, llvm::CriticalEdgeSplittingOptions().setMergeIdenticalEdges());
+            }
+        }
+        if (middle == nullptr) {
+            llvm::errs() << "ERROR: COULDN'T FIND A PLACE TO COUNT AN EDGE.\n";
+            continue;
+        }
+        options.counters_at_start[middle].push_back(i);
+    }
+}
+
+// Uses @counts, which a program instrumented with @counters counted, to lay out the blocks of every function in
+// @module, and fills in the block counts in @options for the slot allocator.
+// The layout starts at the entry block and keeps following the edge out of the last block that was taken the most.
+// When that runs into blocks that are already placed, it picks up again at the hottest block that isn't.
+void apply_profile(llvm::Module &module, std::vector<profile_counter> const &counters, std::vector<uint64_t> const &counts,
+                   x86Options &options) {
+    std::map<std::pair<llvm::BasicBlock const *, llvm::BasicBlock const *>, uint64_t> edge_counts;
+    for (llvm::Function &function : module) {
+        for (llvm::BasicBlock &block : function) {
+            options.block_counts[&block] = 0;
+        }
+    }
+    for (size_t i = 0; i < counters.size(); i++) {
+        options.block_counts[counters[i].to] += counts[i];
+        if (counters[i].from != nullptr) {
+            edge_counts[{counters[i].from, counters[i].to}] = counts[i];
+        }
+    }
+
+    for (llvm::Function &function : module) {
+        if (function.isDeclaration()) {
+            continue;
+        }
+
+        std::vector<llvm::BasicBlock *> order{&function.getEntryBlock()};
+        std::set<llvm::BasicBlock *> placed{&function.getEntryBlock()};
+        while (order.size() < function.size()) {
+            llvm::BasicBlock *last = order.back();
+            llvm::BasicBlock *next = nullptr;
+            for (llvm::BasicBlock *successor : llvm::successors(last)) {
+                uint64_t count = edge_counts[{last, successor}];
+                if (placed.count(successor) == 0 && count > 0 && (next == nullptr || count > edge_counts[{last, next}])) {
+                    next = successor;
+                }
+            }
+            if (next == nullptr) {
+                for (llvm::BasicBlock &block : function) {
+                    if (placed.count(&block) == 0 && (next == nullptr || options.block_counts[&block] > options.block_counts[next])) {
+                        next = &block;
+                    }
+                }
+            }
+            order.push_back(next);
+            placed.insert(next);
+        }
+
+        for (size_t i = 1; i < order.size(); i++) {
+            order[i]->moveAfter(order[i - 1]);
+        }
+    }
+}
+
+// Returns whether @block can only be going somewhere nothing's supposed to go: it ends in unreachable, or it calls
+// something that never returns or that's marked cold.
+static bool is_dead_end(llvm::BasicBlock const &block) {
+    if (llvm::isa<llvm::UnreachableInst>(block.getTerminator())) {
+        return true;
+    }
+    for (llvm::Instruction const &instruction : block) {
+        llvm::CallInst const *call = llvm::dyn_cast<llvm::CallInst>(&instruction);
+        if (call != nullptr && (call->doesNotReturn() || call->hasFnAttr(llvm::Attribute::Cold))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Returns whether @block returns a constant (or nothing) right away, or just goes straight to a block that does, handing
+// it a constant to return. That's what bailing out on an error looks like.
+static bool returns_constant(llvm::BasicBlock const &block) {
+    if (llvm::ReturnInst const *ret = llvm::dyn_cast<llvm::ReturnInst>(block.getTerminator())) {
+        return ret->getReturnValue() == nullptr || llvm::isa<llvm::Constant>(ret->getReturnValue());
+    }
+    llvm::BasicBlock const *next = block.getSingleSuccessor();
+    if (&block.front() != block.getTerminator() || next == nullptr || !llvm::isa<llvm::ReturnInst>(next->getTerminator())) {
+        return false;
+    }
+    llvm::Value const *value = llvm::cast<llvm::ReturnInst>(next->getTerminator())->getReturnValue();
+    llvm::PHINode const *phi_node = value == nullptr ? nullptr : llvm::dyn_cast<llvm::PHINode>(value);
+    return value == nullptr || (phi_node != nullptr && phi_node->getParent() == next &&
+                                llvm::isa<llvm::Constant>(phi_node->getIncomingValueForBlock(&block)));
+}
+
+// Moves the blocks of @function that probably won't run to the end of it, in the order they were in, and fills in @cold
+// with them. With a profile (@block_counts), that's the blocks that never ran. Otherwise, it's the blocks that lead
+// nowhere anything's supposed to go, and early returns of constants off to the side of a conditional branch, which is
+// what error checks look like. That doesn't go for recursive functions, whose early returns are their base cases, or
+// for functions whose only way out is through one of them. Blocks that can only be reached from cold blocks, or can
+// only lead to them, are cold too.
+void move_cold_blocks(llvm::Function &function, std::map<llvm::BasicBlock const *, uint64_t> const &block_counts,
+                      std::set<llvm::BasicBlock const *> &cold) {
+    cold.clear();
+    llvm::BasicBlock const *entry = &function.getEntryBlock();
+
+    auto entry_count = block_counts.find(entry);
+    if (entry_count != block_counts.end()) {
+        if (entry_count->second == 0) {
+            // Nothing's known about a function that never ran.
+            return;
+        }
+        for (llvm::BasicBlock const &block : function) {
+            auto count = block_counts.find(&block);
+            if (count != block_counts.end() && count->second == 0) {
+                cold.insert(&block);
+            }
+        }
+    }
+    else {
+        bool recursive = false;
+        unsigned returns = 0;
+        for (llvm::BasicBlock const &block : function) {
+            returns += llvm::isa<llvm::ReturnInst>(block.getTerminator());
+            for (llvm::Instruction const &instruction : block) {
+                llvm::CallInst const *call = llvm::dyn_cast<llvm::CallInst>(&instruction);
+                recursive = recursive || (call != nullptr && call->getCalledFunction() == &function);
+            }
+        }
+
+        for (llvm::BasicBlock const &block : function) {
+            if (&block == entry) {
+                continue;
+            }
+            if (is_dead_end(block)) {
+                cold.insert(&block);
+                continue;
+            }
+
+            // An early return: the one block that gets here has a conditional branch whose other side keeps going.
+            llvm::BasicBlock const *from = block.getSinglePredecessor();
+            llvm::BranchInst const *br = from == nullptr ? nullptr : llvm::dyn_cast<llvm::BranchInst>(from->getTerminator());
+            if (recursive || returns < 2 || br == nullptr || !br->isConditional() || !returns_constant(block)) {
+                continue;
+            }
+            llvm::BasicBlock const *other = br->getSuccessor(0) == &block ? br->getSuccessor(1) : br->getSuccessor(0);
+            if (other != &block && !returns_constant(*other)) {
+                cold.insert(&block);
+            }
+        }
+    }
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (llvm::BasicBlock const &block : function) {
+            if (&block == entry || cold.count(&block) != 0) {
+                continue;
+            }
+            bool all_successors = llvm::succ_size(&block) > 0;
+            for (llvm::BasicBlock const *successor : llvm::successors(&block)) {
+                all_successors = all_successors && cold.count(successor) != 0;
+            }
+            bool all_predecessors = llvm::pred_size(&block) > 0;
+            for (llvm::BasicBlock const *predecessor : llvm::predecessors(&block)) {
+                all_predecessors = all_predecessors && cold.count(predecessor) != 0;
+            }
+            if (all_successors || all_predecessors) {
+                cold.insert(&block);
+                changed = true;
+            }
+        }
+    }
+
+    std::vector<llvm::BasicBlock *> moving;
+    for (llvm::BasicBlock &block : function) {
+        if (cold.count(&block) != 0) {
+            moving.push_back(&block);
+        }
+    }
+    for (llvm::BasicBlock *block : moving) {
+        block->moveAfter(&function.back());
+    }
+}
+
+// Fills in @back_edges with the edges in @function from the bottoms of loops back up to their tops.
+void find_back_edges(llvm::Function &function, std::set<std::pair<llvm::BasicBlock const *, llvm::BasicBlock const *>> &back_edges) {
+    llvm::DominatorTree dominator_tree(function);
+    llvm::LoopInfo loop_info(dominator_tree);
+    back_edges.clear();
+    for (llvm::Loop const *loop : loop_info.getLoopsInPreorder()) {
+        llvm::SmallVector<llvm::BasicBlock *, 4> latches;
+        loop->getLoopLatches(latches);
+        for (llvm::BasicBlock const *latch : latches) {
+            back_edges.insert({latch, loop->getHeader()});
+        }
+    }
+}
+
+// Runs all the passes over @function.
+void run_passes(llvm::Function &function, x86Options const &options) {
+    promote_allocas(function);
+    propagate_constants(function);
+    number_values(function);
+    place_comparisons(function);
+    if_convert(function);
+    hoist_loop_invariants(function);
+    // Loops that got written out count with constants, which can be folded now.
+    if (unroll_loops(function, options)) {
+        propagate_constants(function);
+        number_values(function);
+    }
+    schedule_instructions(function);
+}
+
+// Runs all the passes over every function in @module.
+void run_passes(llvm::Module &module, x86Options const &options) {
+    for (llvm::Function &function : module) {
+        if (!function.isDeclaration()) {
+            run_passes(function, options);
+        }
+    }
+}
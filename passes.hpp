@@ -0,0 +1,118 @@
+#pragma once
+
+#include <llvm/ADT/APInt.h>       // for llvm::APInt
+#include <llvm/IR/BasicBlock.h>   // for llvm::BasicBlock
+#include <llvm/IR/Function.h>     // for llvm::Function
+#include <llvm/IR/InstrTypes.h>   // for llvm::CmpInst
+#include <llvm/IR/Instructions.h> // for llvm::ICmpInst, llvm::PHINode
+#include <llvm/IR/Module.h>       // for llvm::Module
+#include <cstdint>                // for uint64_t
+#include <map>                    // for std::map
+#include <set>                    // for std::set
+#include <utility>                // for std::pair
+#include <vector>                 // for std::vector
+
+struct x86Options;
+
+// These are the passes that rewrite the IR before we generate any code from it.
+// They all need to run before the x86Program gets constructed, since that's when the labels get made.
+
+// Rewrites scalar allocas that never escape into SSA values, so they get register slots like everything else.
+// Returns whether anything changed.
+bool promote_allocas(llvm::Function &function);
+
+// Finds the values in @function that are always the same constant, following only the branches that can actually
+// be taken, and replaces them with it. Branches on constants get folded, and blocks that can't run get deleted.
+// Returns whether anything changed.
+bool propagate_constants(llvm::Function &function);
+
+// Folds arithmetic on constants and reuses earlier identical computations within each block.
+// Returns whether anything changed.
+bool number_values(llvm::Function &function);
+
+// Gives everything that reads a comparison out of the flags a copy of the comparison right in front of it.
+// Returns whether anything changed.
+bool place_comparisons(llvm::Function &function);
+
+// Replaces small triangles and diamonds in the control flow graph with selects, which turn into branchless code.
+// Arms that would cost too much to run unconditionally keep their branches.
+// Returns whether anything changed.
+bool if_convert(llvm::Function &function);
+
+// Moves arithmetic that computes the same thing on every trip around a loop out into the loop's preheader.
+// Returns whether anything changed.
+bool hoist_loop_invariants(llvm::Function &function);
+
+// Unrolls single-block loops that count by a constant, by @options.unroll_factor with the loop itself left to do the
+// rest, or all the way if they start and stop at constants close enough together. See unroll.cpp.
+// Returns whether anything changed.
+bool unroll_loops(llvm::Function &function, x86Options const &options);
+
+// A loop that's a single block, and counts by a constant step until comparing the count against something that doesn't
+// change says to stop. The unroller and the vectorizer both work on these.
+struct counted_loop {
+    llvm::BasicBlock *block;
+
+    // The one block that jumps into the loop, and the block it goes to when it's done.
+    llvm::BasicBlock *preheader;
+    llvm::BasicBlock *exit;
+
+    // The count, and what it'll be on the next iteration, which is the count plus @step.
+    llvm::PHINode *induction;
+    llvm::Instruction *bump;
+    llvm::APInt step;
+
+    // The loop goes around again while @bump is @predicate @bound.
+    llvm::ICmpInst *exit_test;
+    llvm::Value *bound;
+    llvm::CmpInst::Predicate predicate;
+
+    // How many instructions one iteration takes, not counting phi nodes or the exit test and the branch.
+    unsigned size;
+};
+
+
+// Works out whether @block is a counted loop, and if so, fills in @loop. See unroll.cpp.
+bool match_counted_loop(llvm::BasicBlock &block, counted_loop &loop);
+
+// Returns whether @value is computed in @block.
+bool defined_in(llvm::Value const *value, llvm::BasicBlock const &block);
+
+// Reorders the instructions in each block so that slow ones get started early, without running out of registers.
+// Returns whether anything changed.
+bool schedule_instructions(llvm::Function &function);
+
+// Fills in @depths with how many loops deep each block in @function is. Blocks that aren't in any loop are at 0.
+void compute_loop_depths(llvm::Function &function, std::map<llvm::BasicBlock const *, unsigned> &depths);
+
+// Something that gets counted when a program is instrumented: either a call to a function, in which case @from is null
+// and @to is the function's entry block, or a trip along the edge of the control flow graph from @from to @to.
+struct profile_counter {
+    llvm::BasicBlock *from;
+    llvm::BasicBlock *to;
+};
+
+// Lists everything in @module that gets counted when a program is instrumented, in an order that only depends on the IR.
+std::vector<profile_counter> list_profile_counters(llvm::Module &module);
+
+// Decides where to bump each of @counters, splitting critical edges where it has to, and fills in @options to match.
+void place_profile_counters(std::vector<profile_counter> const &counters, x86Options &options);
+
+// Lays out the blocks of every function in @module so that the paths @counts says are hot fall through, and fills in
+// the block counts in @options.
+void apply_profile(llvm::Module &module, std::vector<profile_counter> const &counters, std::vector<uint64_t> const &counts,
+                   x86Options &options);
+
+// Moves the blocks of @function that probably won't run to the end of it, and fills in @cold with them. Uses
+// @block_counts if there's a profile, and guesses otherwise.
+void move_cold_blocks(llvm::Function &function, std::map<llvm::BasicBlock const *, uint64_t> const &block_counts,
+                      std::set<llvm::BasicBlock const *> &cold);
+
+// Fills in @back_edges with the edges in @function from the bottoms of loops back up to their tops.
+void find_back_edges(llvm::Function &function, std::set<std::pair<llvm::BasicBlock const *, llvm::BasicBlock const *>> &back_edges);
+
+// Runs all the passes over @function. None of them look outside the function, so functions can go one at a time.
+void run_passes(llvm::Function &function, x86Options const &options);
+
+// Runs all the passes over every function in @module.
+void run_passes(llvm::Module &module, x86Options const &options);
@@ -0,0 +1,74 @@
+; ModuleID = 'test.c'
+source_filename = "test.c"
+target datalayout = "e-m:e-p270:32:32-p271:32:32-p272:64:64-i64:64-f80:128-n8:16:32:64-S128"
+target triple = "x86_64-pc-linux-gnu"
+
+; Unoptimized IR, straight out of the frontend without mem2reg.
+
+; Function Attrs: noinline nounwind optnone sspstrong uwtable
+define dso_local i32 @sum3(i32 %0, i32 %1, i32 %2) #0 {
+  %4 = alloca i32, align 4
+  %5 = alloca i32, align 4
+  %6 = alloca i32, align 4
+  %7 = alloca i32, align 4
+  store i32 %0, i32* %4, align 4
+  store i32 %1, i32* %5, align 4
+  store i32 %2, i32* %6, align 4
+  %8 = load i32, i32* %4, align 4
+  store i32 %8, i32* %7, align 4
+  %9 = load i32, i32* %7, align 4
+  %10 = load i32, i32* %5, align 4
+  %11 = add nsw i32 %9, %10
+  store i32 %11, i32* %7, align 4
+  %12 = load i32, i32* %6, align 4
+  %13 = icmp sgt i32 %12, 0
+  br i1 %13, label %14, label %18
+
+14:                                               ; preds = %3
+  %15 = load i32, i32* %7, align 4
+  %16 = load i32, i32* %6, align 4
+  %17 = add nsw i32 %15, %16
+  store i32 %17, i32* %7, align 4
+  br label %18
+
+18:                                               ; preds = %14, %3
+  %19 = load i32, i32* %7, align 4
+  ret i32 %19
+}
+
+; Function Attrs: noinline nounwind optnone sspstrong uwtable
+define dso_local void @bump(i32* %0) #0 {
+  %2 = alloca i32*, align 8
+  store i32* %0, i32** %2, align 8
+  %3 = load i32*, i32** %2, align 8
+  %4 = load i32, i32* %3, align 4
+  %5 = add nsw i32 %4, 5
+  %6 = load i32*, i32** %2, align 8
+  store i32 %5, i32* %6, align 4
+  ret void
+}
+
+; %2 escapes into the call to bump, so it has to stay in memory.
+; Function Attrs: noinline nounwind optnone sspstrong uwtable
+define dso_local i32 @main() #0 {
+  %1 = alloca i32, align 4
+  %2 = alloca i32, align 4
+  store i32 0, i32* %1, align 4
+  %3 = call i32 @sum3(i32 4, i32 5, i32 6)
+  store i32 %3, i32* %2, align 4
+  call void @bump(i32* %2)
+  %4 = load i32, i32* %2, align 4
+  ret i32 %4
+}
+
+attributes #0 = { noinline nounwind optnone sspstrong uwtable "frame-pointer"="all" "min-legal-vector-width"="0" "no-trapping-math"="true" "stack-protector-buffer-size"="8" "target-cpu"="x86-64" "target-features"="+cx8,+fxsr,+mmx,+sse,+sse2,+x87" "tune-cpu"="generic" }
+
+!llvm.module.flags = !{!0, !1, !2, !3, !4}
+!llvm.ident = !{!5}
+
+!0 = !{i32 1, !"wchar_size", i32 4}
+!1 = !{i32 7, !"PIC Level", i32 2}
+!2 = !{i32 7, !"PIE Level", i32 2}
+!3 = !{i32 7, !"uwtable", i32 1}
+!4 = !{i32 7, !"frame-pointer", i32 2}
+!5 = !{!"clang version 13.0.1"}
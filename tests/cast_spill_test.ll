@@ -0,0 +1,74 @@
+; Extensions of all three narrow widths into values that get spilled, so the extension has to go through %rax.
+
+define i64 @spread(i32 %a, i8 %b, i16 %c, i32 %n) {
+entry:
+  %x0 = add i32 %a, 0
+  %e0 = sext i32 %x0 to i64
+  %x1 = add i32 %a, 1
+  %e1 = zext i32 %x1 to i64
+  %x2 = add i8 %b, 2
+  %e2 = sext i8 %x2 to i64
+  %x3 = add i16 %c, 3
+  %e3 = zext i16 %x3 to i64
+  %x4 = add i16 %c, 4
+  %e4 = sext i16 %x4 to i64
+  %x5 = add i8 %b, 5
+  %e5 = zext i8 %x5 to i64
+  %x6 = add i32 %a, 6
+  %e6 = sext i32 %x6 to i64
+  %x7 = add i32 %a, 7
+  %e7 = zext i32 %x7 to i64
+  %x8 = add i8 %b, 8
+  %e8 = sext i8 %x8 to i64
+  %x9 = add i16 %c, 9
+  %e9 = zext i16 %x9 to i64
+  %x10 = add i16 %c, 10
+  %e10 = sext i16 %x10 to i64
+  %x11 = add i8 %b, 11
+  %e11 = zext i8 %x11 to i64
+  %x12 = add i32 %a, 12
+  %e12 = sext i32 %x12 to i64
+  %x13 = add i32 %a, 13
+  %e13 = zext i32 %x13 to i64
+  %x14 = add i8 %b, 14
+  %e14 = sext i8 %x14 to i64
+  %x15 = add i16 %c, 15
+  %e15 = zext i16 %x15 to i64
+  %x16 = add i16 %c, 16
+  %e16 = sext i16 %x16 to i64
+  %x17 = add i8 %b, 17
+  %e17 = zext i8 %x17 to i64
+  br label %loop
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  %acc = phi i64 [ 0, %entry ], [ %s17, %loop ]
+  %s0 = add i64 %acc, %e0
+  %s1 = add i64 %s0, %e1
+  %s2 = add i64 %s1, %e2
+  %s3 = add i64 %s2, %e3
+  %s4 = add i64 %s3, %e4
+  %s5 = add i64 %s4, %e5
+  %s6 = add i64 %s5, %e6
+  %s7 = add i64 %s6, %e7
+  %s8 = add i64 %s7, %e8
+  %s9 = add i64 %s8, %e9
+  %s10 = add i64 %s9, %e10
+  %s11 = add i64 %s10, %e11
+  %s12 = add i64 %s11, %e12
+  %s13 = add i64 %s12, %e13
+  %s14 = add i64 %s13, %e14
+  %s15 = add i64 %s14, %e15
+  %s16 = add i64 %s15, %e16
+  %s17 = add i64 %s16, %e17
+  %i.next = add i32 %i, 1
+  %c1 = icmp slt i32 %i.next, %n
+  br i1 %c1, label %loop, label %exit
+exit:
+  ret i64 %s17
+}
+
+define i32 @main() {
+  %1 = call i64 @spread(i32 -3, i8 -2, i16 -1, i32 3)
+  %2 = trunc i64 %1 to i32
+  ret i32 %2
+}
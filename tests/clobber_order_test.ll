@@ -0,0 +1,36 @@
+; Functions that get called before they're defined. They're generated before their callers anyway, so the call to
+; @twice doesn't save anything, and the call to @busy still saves what @busy changes.
+
+define i32 @caller(i32 %0, i32 %1) {
+  %3 = call i32 @twice(i32 %0)
+  %4 = call i32 @busy(i32 %1, i32 %3)
+  %5 = add nsw i32 %3, %4
+  %6 = add nsw i32 %5, %0
+  %7 = add nsw i32 %6, %1
+  ret i32 %7
+}
+
+define i32 @twice(i32 %0) {
+  %2 = add nsw i32 %0, %0
+  ret i32 %2
+}
+
+define i32 @busy(i32 %0, i32 %1) {
+  %3 = mul nsw i32 %0, 3
+  %4 = add nsw i32 %1, 5
+  %5 = mul nsw i32 %3, %4
+  %6 = sub nsw i32 %5, %0
+  %7 = add nsw i32 %6, %3
+  %8 = mul nsw i32 %7, %4
+  %9 = sub nsw i32 %8, %1
+  %10 = add nsw i32 %9, %5
+  %11 = add nsw i32 %10, %6
+  ret i32 %11
+}
+
+define i32 @main() {
+  %1 = call i32 @caller(i32 5, i32 7)
+  %2 = call i32 @caller(i32 -2, i32 3)
+  %3 = add nsw i32 %1, %2
+  ret i32 %3
+}
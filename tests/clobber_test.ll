@@ -0,0 +1,47 @@
+; Calls only save the registers that the function being called actually changes. Values that live across calls to
+; small functions stay right where they are, and recursive calls only save what the recursion itself changes.
+
+define i32 @square(i32 %0) {
+  %2 = mul nsw i32 %0, %0
+  ret i32 %2
+}
+
+define i32 @sum_squares(i32 %0, i32 %1, i32 %2, i32 %3) {
+  %5 = call i32 @square(i32 %0)
+  %6 = call i32 @square(i32 %1)
+  %7 = call i32 @square(i32 %2)
+  %8 = call i32 @square(i32 %3)
+  %9 = add nsw i32 %5, %6
+  %10 = add nsw i32 %9, %7
+  %11 = add nsw i32 %10, %8
+  %12 = sub nsw i32 %11, %0
+  %13 = sub nsw i32 %12, %1
+  %14 = sub nsw i32 %13, %2
+  %15 = sub nsw i32 %14, %3
+  ret i32 %15
+}
+
+define i32 @depth(i32 %0, i32 %1) {
+  %3 = icmp sle i32 %0, 0
+  br i1 %3, label %4, label %5
+
+4:
+  ret i32 %1
+
+5:
+  %6 = sub nsw i32 %0, 1
+  %7 = call i32 @square(i32 %6)
+  %8 = sub nsw i32 %7, %1
+  %9 = call i32 @depth(i32 %6, i32 %8)
+  %10 = add nsw i32 %9, %1
+  %11 = add nsw i32 %10, %0
+  ret i32 %11
+}
+
+define i32 @main() {
+  %1 = call i32 @sum_squares(i32 1, i32 2, i32 3, i32 4)
+  %2 = call i32 @depth(i32 6, i32 1)
+  %3 = mul nsw i32 %1, 5
+  %4 = add nsw i32 %3, %2
+  ret i32 %4
+}
@@ -0,0 +1,25 @@
+; Repeated computations in a block only happen once, and arithmetic on constants happens at compile time.
+
+define i32 @f(i32 %0, i32 %1) {
+  %3 = mul nsw i32 %0, %1
+  %4 = add nsw i32 %3, 7
+  %5 = mul i32 %1, %0
+  %6 = add i32 %5, 7
+  %7 = sub nsw i32 %4, %6
+  %8 = add nsw i32 %7, %4
+  %9 = mul nsw i32 %8, 1
+  %10 = add nsw i32 %9, 0
+  %11 = sext i32 %10 to i64
+  %12 = sext i32 %10 to i64
+  %13 = add i64 %11, %12
+  %14 = trunc i64 %13 to i32
+  %15 = mul nsw i32 6, 7
+  %16 = sdiv i32 %15, 2
+  %17 = add nsw i32 %14, %16
+  ret i32 %17
+}
+
+define i32 @main() {
+  %1 = call i32 @f(i32 3, i32 5)
+  ret i32 %1
+}
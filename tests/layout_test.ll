@@ -0,0 +1,47 @@
+; Checks that bail out early with an error code get moved out of the way into .text.unlikely, and the loops left behind
+; get aligned. The cold code still has to work when it does run.
+
+define i32 @sum_to(i32 %0, i32 %1) {
+  %3 = icmp slt i32 %0, 0
+  br i1 %3, label %4, label %5
+
+4:
+  ret i32 -1
+
+5:
+  %6 = icmp sgt i32 %0, %1
+  br i1 %6, label %16, label %7
+
+7:
+  %8 = phi i32 [ 0, %5 ], [ %11, %7 ]
+  %9 = phi i32 [ 0, %5 ], [ %10, %7 ]
+  %10 = add nsw i32 %9, %8
+  %11 = add nsw i32 %8, 1
+  %12 = icmp sgt i32 %11, %0
+  br i1 %12, label %13, label %7
+
+13:
+  %14 = sub nsw i32 %10, 5
+  br label %15
+
+15:
+  %.result = phi i32 [ %14, %13 ], [ -2, %16 ]
+  ret i32 %.result
+
+16:
+  br label %15
+}
+
+define i32 @main() {
+  %1 = call i32 @sum_to(i32 10, i32 100)
+  %2 = call i32 @sum_to(i32 -3, i32 100)
+  %3 = call i32 @sum_to(i32 200, i32 100)
+  %4 = call i32 @sum_to(i32 40, i32 100)
+  %5 = mul nsw i32 %1, 10
+  %6 = sub nsw i32 %5, %2
+  %7 = mul nsw i32 %6, 10
+  %8 = sub nsw i32 %7, %3
+  %9 = mul nsw i32 %8, 10
+  %10 = add nsw i32 %9, %4
+  ret i32 %10
+}
@@ -0,0 +1,57 @@
+; The multiply and add in the loop don't change from one trip to the next, so they get hoisted into a preheader,
+; and the values that are only used after the loop are the ones that get spilled.
+
+define i64 @kernel(i64 %0, i64 %1, i64 %2) {
+  %4 = add i64 %1, 0
+  %5 = add i64 %1, 1
+  %6 = add i64 %1, 2
+  %7 = add i64 %1, 3
+  %8 = add i64 %1, 4
+  %9 = add i64 %1, 5
+  %10 = add i64 %1, 6
+  %11 = add i64 %1, 7
+  %12 = add i64 %1, 8
+  %13 = add i64 %1, 9
+  %14 = add i64 %1, 10
+  %15 = add i64 %1, 11
+  %16 = add i64 %1, 12
+  %17 = add i64 %1, 13
+  %18 = icmp sgt i64 %0, 0
+  br i1 %18, label %19, label %28
+
+19:
+  %20 = phi i64 [ 0, %3 ], [ %26, %19 ]
+  %21 = phi i64 [ 0, %3 ], [ %25, %19 ]
+  %22 = mul i64 %1, %2
+  %23 = add i64 %22, 5
+  %24 = add i64 %21, %23
+  %25 = add i64 %24, %20
+  %26 = add i64 %20, 1
+  %27 = icmp slt i64 %26, %0
+  br i1 %27, label %19, label %28
+
+28:
+  %29 = phi i64 [ 0, %3 ], [ %25, %19 ]
+  %30 = add i64 %29, %4
+  %31 = add i64 %30, %5
+  %32 = add i64 %31, %6
+  %33 = add i64 %32, %7
+  %34 = add i64 %33, %8
+  %35 = add i64 %34, %9
+  %36 = add i64 %35, %10
+  %37 = add i64 %36, %11
+  %38 = add i64 %37, %12
+  %39 = add i64 %38, %13
+  %40 = add i64 %39, %14
+  %41 = add i64 %40, %15
+  %42 = add i64 %41, %16
+  %43 = add i64 %42, %17
+  ret i64 %43
+}
+
+define i64 @main() {
+  %1 = call i64 @kernel(i64 5, i64 2, i64 3)
+  %2 = call i64 @kernel(i64 0, i64 2, i64 3)
+  %3 = sub i64 %1, %2
+  ret i64 %3
+}
@@ -0,0 +1,49 @@
+; ModuleID = '<stdin>'
+source_filename = "test.c"
+target datalayout = "e-m:e-p270:32:32-p271:32:32-p272:64:64-i64:64-f80:128-n8:16:32:64-S128"
+target triple = "x86_64-pc-linux-gnu"
+
+; Reads its arguments as the bits of a binary number, so any argument that ends up in the wrong place changes the result.
+; Function Attrs: nounwind sspstrong uwtable
+define dso_local i32 @weigh(i32 %0, i32 %1, i32 %2, i32 %3, i32 %4, i32 %5, i32 %6, i32 %7) #0 {
+  %9 = add nsw i32 %0, %0
+  %10 = add nsw i32 %9, %1
+  %11 = add nsw i32 %10, %10
+  %12 = add nsw i32 %11, %2
+  %13 = add nsw i32 %12, %12
+  %14 = add nsw i32 %13, %3
+  %15 = add nsw i32 %14, %14
+  %16 = add nsw i32 %15, %4
+  %17 = add nsw i32 %16, %16
+  %18 = add nsw i32 %17, %5
+  %19 = add nsw i32 %18, %18
+  %20 = add nsw i32 %19, %6
+  %21 = add nsw i32 %20, %20
+  %22 = add nsw i32 %21, %7
+  ret i32 %22
+}
+
+; Passes its arguments along with a few of them swapped around, so the register arguments form cycles.
+; Function Attrs: nounwind sspstrong uwtable
+define dso_local i32 @shuffle(i32 %0, i32 %1, i32 %2, i32 %3, i32 %4, i32 %5, i32 %6, i32 %7) #0 {
+  %9 = call i32 @weigh(i32 %1, i32 %0, i32 %3, i32 %2, i32 %4, i32 %5, i32 %7, i32 %6)
+  %10 = add nsw i32 %9, %6
+  ret i32 %10
+}
+
+; Function Attrs: nounwind sspstrong uwtable
+define dso_local i32 @main() #0 {
+  %1 = call i32 @shuffle(i32 1, i32 0, i32 1, i32 1, i32 0, i32 0, i32 1, i32 0)
+  ret i32 %1
+}
+
+attributes #0 = { nounwind sspstrong uwtable "frame-pointer"="none" "min-legal-vector-width"="0" "no-trapping-math"="true" "stack-protector-buffer-size"="8" "target-cpu"="x86-64" "target-features"="+cx8,+fxsr,+mmx,+sse,+sse2,+x87" "tune-cpu"="generic" }
+
+!llvm.module.flags = !{!0, !1, !2, !3}
+!llvm.ident = !{!4}
+
+!0 = !{i32 1, !"wchar_size", i32 4}
+!1 = !{i32 7, !"PIC Level", i32 2}
+!2 = !{i32 7, !"PIE Level", i32 2}
+!3 = !{i32 7, !"uwtable", i32 1}
+!4 = !{!"clang version 13.0.1"}
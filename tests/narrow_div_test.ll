@@ -0,0 +1,29 @@
+; i8 and i16 sdivs get done as i32s, so their operands have to be sign-extended first: 1011 is -13 as an i8.
+
+define i32 @narrow(i32 %0, i32 %1) {
+  %3 = trunc i32 %0 to i8
+  %4 = trunc i32 %1 to i8
+  %5 = sdiv i8 %3, 2
+  %6 = sdiv i8 %3, %4
+  %7 = trunc i32 %0 to i16
+  %8 = trunc i32 %1 to i16
+  %9 = sdiv i16 %7, %8
+  %10 = sdiv i16 -300, %8
+  %11 = sext i8 %5 to i32
+  %12 = sext i8 %6 to i32
+  %13 = sext i16 %9 to i32
+  %14 = sext i16 %10 to i32
+  %15 = mul i32 %11, 1000
+  %16 = mul i32 %12, 100
+  %17 = add i32 %15, %16
+  %18 = add i32 %17, %13
+  %19 = add i32 %18, %14
+  ret i32 %19
+}
+
+define i32 @main() {
+  %1 = call i32 @narrow(i32 1011, i32 -3)
+  %2 = call i32 @narrow(i32 65436, i32 65533)
+  %3 = sub i32 %1, %2
+  ret i32 %3
+}
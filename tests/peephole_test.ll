@@ -0,0 +1,52 @@
+; Loops and early exits whose branches come out as a conditional jump over an unconditional one, or as a jump to
+; the very next label. The machine passes turn the first into the opposite conditional jump and take out the second,
+; and the values live across the calls to @step stay where they are.
+
+define i32 @step(i32 %0, i32 %1) {
+  %3 = icmp slt i32 %0, %1
+  br i1 %3, label %4, label %6
+
+4:
+  %5 = add nsw i32 %0, 3
+  br label %8
+
+6:
+  %7 = sub nsw i32 %0, %1
+  br label %8
+
+8:
+  %9 = phi i32 [ %5, %4 ], [ %7, %6 ]
+  ret i32 %9
+}
+
+define i32 @walk(i32 %0) {
+  br label %2
+
+2:
+  %3 = phi i32 [ 0, %1 ], [ %10, %9 ]
+  %4 = phi i32 [ 0, %1 ], [ %11, %9 ]
+  %5 = icmp sgt i32 %3, 40
+  br i1 %5, label %12, label %6
+
+6:
+  %7 = call i32 @step(i32 %3, i32 %0)
+  %8 = icmp eq i32 %7, 7
+  br i1 %8, label %12, label %9
+
+9:
+  %10 = add nsw i32 %3, 1
+  %11 = add nsw i32 %4, %7
+  br label %2
+
+12:
+  %13 = phi i32 [ %4, %2 ], [ %3, %6 ]
+  ret i32 %13
+}
+
+define i32 @main() {
+  %1 = call i32 @walk(i32 20)
+  %2 = call i32 @walk(i32 3)
+  %3 = mul nsw i32 %2, 2
+  %4 = add nsw i32 %1, %3
+  ret i32 %4
+}
@@ -0,0 +1,37 @@
+; A loop whose branches nearly always go the same way, with critical edges both inside it and out of it. Built with
+; --instrument, the edges get counted, and built with --profile, the hot path gets laid out to fall through.
+
+define i32 @rare(i32 %0) {
+  %2 = sub i32 %0, 1000
+  ret i32 %2
+}
+
+define i32 @main() {
+  br label %1
+
+1:
+  %2 = phi i32 [ 0, %0 ], [ %12, %10 ]
+  %3 = phi i32 [ 0, %0 ], [ %13, %10 ]
+  %4 = icmp slt i32 %2, 100
+  br i1 %4, label %5, label %14
+
+5:
+  %6 = icmp eq i32 %2, 50
+  br i1 %6, label %7, label %10
+
+7:
+  %8 = call i32 @rare(i32 %3)
+  %9 = icmp sgt i32 %8, 1000000
+  br i1 %9, label %14, label %10
+
+10:
+  %11 = phi i32 [ %3, %5 ], [ %8, %7 ]
+  %12 = add i32 %2, 1
+  %13 = add i32 %11, %2
+  br label %1
+
+14:
+  %15 = phi i32 [ %3, %1 ], [ %8, %7 ]
+  %16 = sdiv i32 %15, 19
+  ret i32 %16
+}
@@ -0,0 +1,50 @@
+; Values that turn out to be constants after all, like phi nodes that get the same constant from everywhere, never
+; take up a slot. Every use gets the constant as an immediate instead.
+
+define i32 @twice(i32 %0) {
+  %2 = add nsw i32 %0, %0
+  ret i32 %2
+}
+
+define i32 @scaled_sum(i32 %0, i32 %1) {
+  %3 = icmp slt i32 %0, %1
+  br i1 %3, label %4, label %6
+
+4:
+  %5 = call i32 @twice(i32 %0)
+  br label %8
+
+6:
+  %7 = call i32 @twice(i32 %1)
+  br label %8
+
+8:
+  %9 = phi i32 [ 5, %4 ], [ 5, %6 ]
+  %10 = phi i32 [ %5, %4 ], [ %7, %6 ]
+  %11 = mul nsw i32 %9, 3
+  %12 = sext i32 %11 to i64
+  br label %13
+
+13:
+  %14 = phi i32 [ 0, %8 ], [ %19, %13 ]
+  %15 = phi i64 [ 0, %8 ], [ %18, %13 ]
+  %16 = phi i64 [ %12, %8 ], [ %16, %13 ]
+  %17 = sext i32 %14 to i64
+  %.scaled = mul nsw i64 %17, %16
+  %18 = add nsw i64 %15, %.scaled
+  %19 = add nsw i32 %14, 1
+  %20 = icmp slt i32 %19, %10
+  br i1 %20, label %13, label %21
+
+21:
+  %22 = trunc i64 %18 to i32
+  %23 = add nsw i32 %22, %9
+  ret i32 %23
+}
+
+define i32 @main() {
+  %1 = call i32 @scaled_sum(i32 2, i32 9)
+  %2 = call i32 @scaled_sum(i32 4, i32 1)
+  %3 = sub nsw i32 %1, %2
+  ret i32 %3
+}
@@ -0,0 +1,131 @@
+#!/bin/bash
+# Runs every test in tests/results.txt and checks that it exits with what it should, then checks the things an exit
+# code can't show by looking at the assembly. Build codegen first. Prints what failed, and exits with 1 if anything did.
+
+cd "$(dirname "$0")/.." || exit 1
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+failures=0
+
+fail() {
+    echo "FAIL: $1"
+    failures=$((failures + 1))
+}
+
+# Assembles and links $work/$1.s into $work/$1.
+link() {
+    as "$work/$1.s" -o "$work/$1.o" && ld "$work/$1.o" -o "$work/$1"
+}
+
+# Compiles tests/$1.ll with the rest of the arguments as options into $work/$1.s, and links it.
+build() {
+    local name=$1
+    shift
+    ./codegen "$@" "tests/$name.ll" > "$work/$name.s" 2> "$work/$name.err" && link "$name"
+}
+
+while IFS=: read -r file expected; do
+    [[ $file == *.ll ]] || continue
+    name=${file%.ll}
+    if ! build "$name"; then
+        fail "$name doesn't compile"
+        continue
+    fi
+    "$work/$name"
+    got=$?
+    if [ "$got" != "${expected// /}" ]; then
+        fail "$name exited with $got instead of${expected}"
+    fi
+done < tests/results.txt
+
+# The machine passes take out jumps to the very next label, and turn a conditional jump over an unconditional one into
+# the opposite conditional jump.
+awk '/^[ \t]*#/ { next }
+    /:$/ {
+        label = substr($1, 1, length($1) - 1)
+        if (last == "jmp " label) {
+            print "FAIL: " FILENAME " jumps to the very next label, " label
+        }
+        if (last ~ /^jmp / && before ~ /^j[a-z]+ / && before !~ /^jmp / && before ~ (" " label "$")) {
+            print "FAIL: " FILENAME " jumps over a jump to " label
+        }
+    }
+    { before = last; last = $1 " " $2 }' "$work"/*.s > "$work/jumps.txt"
+if [ -s "$work/jumps.txt" ]; then
+    cat "$work/jumps.txt"
+    failures=$((failures + 1))
+fi
+
+# A loop whose back edge has nothing to move jumps straight to its top, not to a trampoline that only jumps there.
+if grep -h -A1 -E "^__PHI_FROM_(.*)_TO_\1:$" "$work"/*.s | grep "jmp __PHI_DONE_" > /dev/null; then
+    fail "a loop's back edge goes through an empty trampoline"
+fi
+
+# Prints the lines of $work/$1.s from where $2 starts up to where the next function starts.
+function_text() {
+    sed -n "/^$2:/,/^[A-Za-z][A-Za-z0-9_]*:/p" "$work/$1.s"
+}
+
+# Calls only save what the function being called changes. The only register sum_squares keeps in one that square
+# changes is its first argument, which the calls pass theirs in, and twice doesn't change anything caller keeps.
+if function_text clobber_test sum_squares | grep pushq | grep -v -e "%rbp" -e "%rdi" > /dev/null; then
+    fail "sum_squares saves registers that square doesn't change"
+fi
+if function_text clobber_order_test caller | sed -n "/before call to twice/,/callq twice/p" | grep pushq > /dev/null; then
+    fail "caller saves registers around twice, which is defined after it"
+fi
+
+# --time counts every call, and only adds up the cycles of the outermost call to fib, so main's cycles cover fib's.
+if ./codegen --time tests/fib_test.ll > "$work/timed.s" 2> /dev/null && link timed; then
+    "$work/timed" 2> "$work/timed.txt"
+    got=$?
+    fib=$(sed -n "s/^  fib: \([0-9]*\) cycles in 177 calls$/\1/p" "$work/timed.txt")
+    main=$(sed -n "s/^  main: \([0-9]*\) cycles in 1 calls$/\1/p" "$work/timed.txt")
+    if [ "$got" != 89 ] || [ -z "$fib" ] || [ -z "$main" ] || [ "$fib" -gt "$main" ]; then
+        fail "fib_test doesn't time right with --time"
+    fi
+else
+    fail "fib_test doesn't compile with --time"
+fi
+
+# A batch worker reuses its context for every file it compiles, and that mustn't change what comes out.
+mkdir "$work/batch"
+cp tests/*.ll "$work/batch"
+if ./codegen --batch --jobs=1 "$work"/batch/*.ll > /dev/null 2>&1; then
+    for file in tests/*.ll; do
+        name=$(basename "$file" .ll)
+        if ! ./codegen "$file" 2> /dev/null | cmp -s - "$work/batch/$name.s"; then
+            fail "$name comes out differently in batch mode"
+        fi
+    done
+else
+    fail "batch mode doesn't compile the tests"
+fi
+
+# Bitcode gets its function bodies loaded one at a time, as they get generated, and that mustn't change anything.
+llvm_as="$(${LLVM_CONFIG:-llvm-config} --bindir)/llvm-as"
+for file in tests/*.ll; do
+    name=$(basename "$file" .ll)
+    if ! "$llvm_as" "$file" -o "$work/$name.bc" || ! ./codegen "$work/$name.bc" 2> /dev/null | cmp -s - "$work/$name.s"; then
+        fail "$name comes out differently from bitcode"
+    fi
+done
+
+# Compiling again with the same cache has to take every function out of it, and come out the same apart from saying so.
+for file in tests/*.ll; do
+    name=$(basename "$file" .ll)
+    ./codegen --cache="$work/cache" "$file" > "$work/$name.first.s" 2> /dev/null
+    ./codegen --cache="$work/cache" "$file" > "$work/$name.second.s" 2> /dev/null
+    functions=$(grep -c "^define" "$file")
+    hits=$(grep -c "came out of the cache" "$work/$name.second.s")
+    if [ "$hits" != "$functions" ]; then
+        fail "$name only got $hits of its $functions functions out of the cache"
+    fi
+    # Functions that are the same as ones in other tests can come out of the cache the first time too.
+    if ! grep -v "came out of the cache" "$work/$name.first.s" | cmp -s - "$work/$name.s" ||
+        ! grep -v "came out of the cache" "$work/$name.second.s" | cmp -s - "$work/$name.s"; then
+        fail "$name comes out of the cache differently"
+    fi
+done
+
+exit $((failures != 0))
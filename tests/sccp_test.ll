@@ -0,0 +1,96 @@
+; Unoptimized frontend output with branches on things that are always the same. Constant propagation follows only the
+; branches that can be taken, so it finds that %mode in @count stays 1 all the way around the loop, and the blocks
+; that only run with other settings get deleted along with their phi edges.
+
+define i32 @debug_enabled() {
+  %1 = alloca i32, align 4
+  store i32 0, i32* %1, align 4
+  %2 = load i32, i32* %1, align 4
+  br i1 true, label %3, label %4
+
+3:
+  ret i32 %2
+
+4:
+  ret i32 1
+}
+
+define i32 @count(i32 %0) {
+  %2 = alloca i32, align 4
+  %3 = alloca i32, align 4
+  store i32 %0, i32* %2, align 4
+  store i32 1, i32* %3, align 4
+  br label %4
+
+4:
+  %5 = phi i32 [ 0, %1 ], [ %17, %14 ]
+  %6 = phi i32 [ 1, %1 ], [ %15, %14 ]
+  %7 = phi i32 [ 0, %1 ], [ %16, %14 ]
+  %8 = icmp eq i32 %6, 1
+  br i1 %8, label %9, label %11
+
+9:
+  %10 = add nsw i32 %7, 3
+  br label %14
+
+11:
+  %12 = call i32 @debug_enabled()
+  %13 = mul nsw i32 %7, %12
+  br label %14
+
+14:
+  %15 = phi i32 [ 1, %9 ], [ 2, %11 ]
+  %16 = phi i32 [ %10, %9 ], [ %13, %11 ]
+  %17 = add nsw i32 %5, 1
+  %18 = load i32, i32* %2, align 4
+  %19 = icmp slt i32 %17, %18
+  br i1 %19, label %4, label %20
+
+20:
+  ret i32 %16
+}
+
+define i32 @pick(i32 %0) {
+  %2 = alloca i32, align 4
+  store i32 2, i32* %2, align 4
+  %3 = load i32, i32* %2, align 4
+  %4 = mul nsw i32 %3, 3
+  switch i32 %4, label %5 [
+    i32 6, label %6
+    i32 7, label %8
+  ]
+
+5:
+  br label %10
+
+6:
+  %7 = add nsw i32 %0, 100
+  br label %10
+
+8:
+  %9 = sub nsw i32 %0, 100
+  br label %10
+
+10:
+  %11 = phi i32 [ 0, %5 ], [ %7, %6 ], [ %9, %8 ]
+  ret i32 %11
+}
+
+define i32 @main() {
+  %1 = call i32 @debug_enabled()
+  %2 = icmp ne i32 %1, 0
+  br i1 %2, label %9, label %3
+
+3:
+  %4 = call i32 @count(i32 10)
+  %5 = call i32 @pick(i32 %4)
+  %6 = icmp sgt i32 %5, 100
+  br i1 %6, label %7, label %9
+
+7:
+  %8 = sub nsw i32 %5, 100
+  ret i32 %8
+
+9:
+  ret i32 1
+}
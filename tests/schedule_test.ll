@@ -0,0 +1,34 @@
+; Instructions get reordered within their blocks, but loads and stores stay on the right side of calls and each
+; other, and comparisons stay right in front of the selects that read their flags.
+
+define void @bump(i32* %0) {
+  %2 = load i32, i32* %0
+  %3 = add nsw i32 %2, 1
+  store i32 %3, i32* %0
+  ret void
+}
+
+define i32 @work(i32 %0, i32 %1, i32 %2) {
+  %4 = alloca i32
+  store i32 %2, i32* %4
+  %5 = sdiv i32 %0, %1
+  %6 = sdiv i32 %5, 3
+  %7 = add nsw i32 %0, %2
+  %8 = mul nsw i32 %7, %7
+  %9 = sub nsw i32 %8, %1
+  call void @bump(i32* %4)
+  %10 = load i32, i32* %4
+  %11 = icmp slt i32 %9, %6
+  %12 = select i1 %11, i32 %9, i32 %6
+  %13 = add nsw i32 %12, %10
+  ret i32 %13
+}
+
+define i32 @main() {
+  %1 = call i32 @work(i32 100, i32 7, i32 5)
+  %2 = call i32 @work(i32 -50, i32 3, i32 2)
+  %3 = call i32 @work(i32 3, i32 50, i32 -3)
+  %4 = add nsw i32 %1, %2
+  %5 = add nsw i32 %4, %3
+  ret i32 %5
+}
@@ -0,0 +1,61 @@
+; Selects the way a frontend writes them: the comparison isn't always right in front of the select, one comparison
+; can feed several selects and a branch, and some conditions are plain i1 values instead of comparisons.
+
+define i32 @clamp_sum(i32 %0, i32 %1) {
+  %3 = icmp sgt i32 %0, %1
+  %4 = add nsw i32 %0, %1
+  %5 = mul nsw i32 %4, 2
+  %6 = select i1 %3, i32 %0, i32 %1
+  %7 = select i1 %3, i32 %1, i32 %0
+  %8 = sub nsw i32 %6, %7
+  %9 = add nsw i32 %8, %5
+  br i1 %3, label %10, label %12
+
+10:
+  %11 = add nsw i32 %9, 100
+  br label %12
+
+12:
+  %13 = phi i32 [ %11, %10 ], [ %9, %2 ]
+  ret i32 %13
+}
+
+define i32 @pick(i1 %0, i32 %1) {
+  %3 = select i1 %0, i32 %1, i32 5
+  %4 = select i1 %0, i32 10, i32 %1
+  %5 = add nsw i32 %3, %4
+  ret i32 %5
+}
+
+define i32 @flag_phi(i32 %0) {
+  %2 = icmp slt i32 %0, 0
+  br i1 %2, label %3, label %5
+
+3:
+  %4 = icmp eq i32 %0, -5
+  br label %5
+
+5:
+  %6 = phi i1 [ %4, %3 ], [ %2, %1 ]
+  %7 = select i1 %6, i32 20, i32 21
+  %8 = zext i1 %6 to i32
+  %9 = sub nsw i32 %7, %8
+  ret i32 %9
+}
+
+define i32 @main() {
+  %1 = call i32 @clamp_sum(i32 7, i32 3)
+  %2 = call i32 @clamp_sum(i32 2, i32 9)
+  %3 = call i32 @pick(i1 true, i32 7)
+  %4 = call i32 @pick(i1 false, i32 7)
+  %5 = call i32 @flag_phi(i32 -5)
+  %6 = call i32 @flag_phi(i32 -1)
+  %7 = call i32 @flag_phi(i32 3)
+  %8 = add i32 %1, %2
+  %9 = add i32 %8, %3
+  %10 = add i32 %9, %4
+  %11 = add i32 %10, %5
+  %12 = add i32 %11, %6
+  %13 = add i32 %12, %7
+  ret i32 %13
+}
@@ -0,0 +1,70 @@
+; Small diamonds and triangles get turned into selects, but big arms keep their branches.
+
+define i64 @pick(i64 %0, i64 %1) {
+  %3 = icmp slt i64 %0, %1
+  br i1 %3, label %4, label %7
+
+4:
+  %5 = sub i64 %1, %0
+  %6 = add i64 %5, 1
+  br label %10
+
+7:
+  %8 = sub i64 %0, %1
+  %9 = add i64 %8, 2
+  br label %10
+
+10:
+  %11 = phi i64 [ %6, %4 ], [ %9, %7 ]
+  %12 = phi i64 [ 7, %4 ], [ 3, %7 ]
+  %13 = add i64 %11, %12
+  ret i64 %13
+}
+
+define i64 @clamp(i64 %0) {
+  %2 = icmp sgt i64 %0, 10
+  br i1 %2, label %3, label %5
+
+3:
+  %4 = sub i64 %0, 10
+  br label %5
+
+5:
+  %6 = phi i64 [ %4, %3 ], [ %0, %1 ]
+  ret i64 %6
+}
+
+define i64 @big(i64 %0) {
+  %2 = icmp ult i64 %0, 5
+  br i1 %2, label %3, label %12
+
+3:
+  %4 = add i64 %0, 1
+  %5 = add i64 %4, 1
+  %6 = add i64 %5, 1
+  %7 = add i64 %6, 1
+  %8 = add i64 %7, 1
+  %9 = add i64 %8, 1
+  %10 = add i64 %9, 1
+  %11 = add i64 %10, 1
+  br label %12
+
+12:
+  %13 = phi i64 [ %11, %3 ], [ 0, %1 ]
+  ret i64 %13
+}
+
+define i64 @main() {
+  %1 = call i64 @pick(i64 3, i64 10)
+  %2 = call i64 @pick(i64 10, i64 3)
+  %3 = call i64 @clamp(i64 25)
+  %4 = call i64 @clamp(i64 4)
+  %5 = call i64 @big(i64 1)
+  %6 = call i64 @big(i64 7)
+  %7 = add i64 %1, %2
+  %8 = add i64 %7, %3
+  %9 = add i64 %8, %4
+  %10 = add i64 %9, %5
+  %11 = add i64 %10, %6
+  ret i64 %11
+}
@@ -0,0 +1,46 @@
+; Functions whose early exits don't need the frame. The prologue only runs on the paths that use it, so the base case
+; of @sum_down and the quick return from @scan just return, while the loop in @scan gets its frame set up before it
+; starts instead of on every trip.
+
+define i32 @sum_down(i32 %0) {
+  %2 = icmp slt i32 %0, 1
+  br i1 %2, label %3, label %4
+
+3:
+  ret i32 0
+
+4:
+  %5 = sub nsw i32 %0, 1
+  %6 = call i32 @sum_down(i32 %5)
+  %7 = add nsw i32 %6, %0
+  ret i32 %7
+}
+
+define i32 @scan(i32 %0, i32 %1) {
+  %3 = icmp sgt i32 %0, %1
+  br i1 %3, label %4, label %5
+
+4:
+  ret i32 -1
+
+5:
+  %6 = phi i32 [ %0, %2 ], [ %10, %5 ]
+  %7 = phi i32 [ 0, %2 ], [ %9, %5 ]
+  %8 = call i32 @sum_down(i32 %6)
+  %9 = add nsw i32 %7, %8
+  %10 = add nsw i32 %6, 1
+  %11 = icmp sgt i32 %10, %1
+  br i1 %11, label %12, label %5
+
+12:
+  ret i32 %9
+}
+
+define i32 @main() {
+  %1 = call i32 @scan(i32 5, i32 2)
+  %2 = call i32 @scan(i32 1, i32 4)
+  %3 = call i32 @sum_down(i32 -3)
+  %4 = add nsw i32 %1, %2
+  %5 = add nsw i32 %4, %3
+  ret i32 %5
+}
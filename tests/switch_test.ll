@@ -0,0 +1,173 @@
+; Dense switches get a jump table, sparse ones get a tree of comparisons, and ones that only go a couple of places
+; get bit tests. Every way has to get the phi nodes in the blocks they go to right.
+
+define i32 @dense(i32 %0) {
+  switch i32 %0, label %8 [
+    i32 -2, label %2
+    i32 -1, label %3
+    i32 0, label %4
+    i32 1, label %5
+    i32 3, label %6
+    i32 4, label %7
+  ]
+
+2:
+  br label %9
+
+3:
+  br label %9
+
+4:
+  br label %9
+
+5:
+  br label %9
+
+6:
+  br label %9
+
+7:
+  br label %9
+
+8:
+  br label %9
+
+9:
+  %10 = phi i32 [ 1, %2 ], [ 2, %3 ], [ 3, %4 ], [ 4, %5 ], [ 5, %6 ], [ 6, %7 ], [ 9, %8 ]
+  ret i32 %10
+}
+
+define i32 @sparse(i32 %0) {
+  switch i32 %0, label %10 [
+    i32 -7, label %2
+    i32 1, label %3
+    i32 3, label %4
+    i32 42, label %5
+    i32 100, label %6
+    i32 1000, label %7
+    i32 5000, label %8
+    i32 77777, label %9
+  ]
+
+2:
+  br label %11
+
+3:
+  br label %11
+
+4:
+  br label %11
+
+5:
+  br label %11
+
+6:
+  br label %11
+
+7:
+  br label %11
+
+8:
+  br label %11
+
+9:
+  br label %11
+
+10:
+  br label %11
+
+11:
+  %12 = phi i32 [ 1, %2 ], [ 2, %3 ], [ 3, %4 ], [ 4, %5 ], [ 5, %6 ], [ 6, %7 ], [ 7, %8 ], [ 8, %9 ], [ 9, %10 ]
+  ret i32 %12
+}
+
+define i32 @small_set(i32 %0) {
+  switch i32 %0, label %5 [
+    i32 1, label %2
+    i32 5, label %2
+    i32 9, label %2
+    i32 15, label %2
+    i32 21, label %2
+    i32 2, label %3
+    i32 4, label %3
+    i32 7, label %4
+  ]
+
+2:
+  br label %5
+
+3:
+  br label %5
+
+4:
+  br label %5
+
+5:
+  %6 = phi i32 [ 1, %2 ], [ 2, %3 ], [ 3, %4 ], [ 0, %1 ]
+  ret i32 %6
+}
+
+define i32 @main() {
+  %1 = call i32 @dense(i32 -3)
+  %2 = call i32 @dense(i32 -2)
+  %3 = add i32 %1, %2
+  %4 = call i32 @dense(i32 -1)
+  %5 = add i32 %3, %4
+  %6 = call i32 @dense(i32 0)
+  %7 = add i32 %5, %6
+  %8 = call i32 @dense(i32 1)
+  %9 = add i32 %7, %8
+  %10 = call i32 @dense(i32 2)
+  %11 = add i32 %9, %10
+  %12 = call i32 @dense(i32 3)
+  %13 = add i32 %11, %12
+  %14 = call i32 @dense(i32 4)
+  %15 = add i32 %13, %14
+  %16 = call i32 @dense(i32 5)
+  %17 = add i32 %15, %16
+  %18 = call i32 @sparse(i32 -7)
+  %19 = add i32 %17, %18
+  %20 = call i32 @sparse(i32 -6)
+  %21 = add i32 %19, %20
+  %22 = call i32 @sparse(i32 1)
+  %23 = add i32 %21, %22
+  %24 = call i32 @sparse(i32 3)
+  %25 = add i32 %23, %24
+  %26 = call i32 @sparse(i32 42)
+  %27 = add i32 %25, %26
+  %28 = call i32 @sparse(i32 100)
+  %29 = add i32 %27, %28
+  %30 = call i32 @sparse(i32 999)
+  %31 = add i32 %29, %30
+  %32 = call i32 @sparse(i32 1000)
+  %33 = add i32 %31, %32
+  %34 = call i32 @sparse(i32 5000)
+  %35 = add i32 %33, %34
+  %36 = call i32 @sparse(i32 77777)
+  %37 = add i32 %35, %36
+  %38 = call i32 @sparse(i32 77778)
+  %39 = add i32 %37, %38
+  %40 = call i32 @small_set(i32 0)
+  %41 = add i32 %39, %40
+  %42 = call i32 @small_set(i32 1)
+  %43 = add i32 %41, %42
+  %44 = call i32 @small_set(i32 2)
+  %45 = add i32 %43, %44
+  %46 = call i32 @small_set(i32 4)
+  %47 = add i32 %45, %46
+  %48 = call i32 @small_set(i32 5)
+  %49 = add i32 %47, %48
+  %50 = call i32 @small_set(i32 9)
+  %51 = add i32 %49, %50
+  %52 = call i32 @small_set(i32 15)
+  %53 = add i32 %51, %52
+  %54 = call i32 @small_set(i32 21)
+  %55 = add i32 %53, %54
+  %56 = call i32 @small_set(i32 22)
+  %57 = add i32 %55, %56
+  %58 = call i32 @small_set(i32 7)
+  %59 = add i32 %57, %58
+  %60 = call i32 @small_set(i32 -1)
+  %61 = add i32 %59, %60
+  ret i32 %61
+}
@@ -0,0 +1,118 @@
+; Counted loops get unrolled, with the loop itself doing whatever's left over, and ones that start and stop at
+; constants get written out in full.
+
+define i32 @full() {
+  br label %1
+
+1:
+  %2 = phi i32 [ 0, %0 ], [ %6, %1 ]
+  %3 = phi i32 [ 0, %0 ], [ %5, %1 ]
+  %4 = mul nsw i32 %2, %2
+  %5 = add nsw i32 %3, %4
+  %6 = add nsw i32 %2, 1
+  %7 = icmp slt i32 %6, 6
+  br i1 %7, label %1, label %8
+
+8:
+  ret i32 %5
+}
+
+define i32 @up(i32 %0) {
+  br label %2
+
+2:
+  %3 = phi i32 [ 0, %1 ], [ %7, %2 ]
+  %4 = phi i32 [ 0, %1 ], [ %6, %2 ]
+  %5 = mul nsw i32 %3, 3
+  %.sub = sub nsw i32 %5, 1
+  %6 = add nsw i32 %4, %.sub
+  %7 = add nsw i32 %3, 1
+  %8 = icmp slt i32 %7, %0
+  br i1 %8, label %2, label %9
+
+9:
+  ret i32 %6
+}
+
+define i32 @down(i32 %0) {
+  br label %2
+
+2:
+  %3 = phi i32 [ %0, %1 ], [ %6, %2 ]
+  %4 = phi i32 [ 0, %1 ], [ %5, %2 ]
+  %5 = add nsw i32 %4, %3
+  %6 = sub nsw i32 %3, 3
+  %7 = icmp sle i32 %6, 0
+  br i1 %7, label %8, label %2
+
+8:
+  ret i32 %5
+}
+
+define i32 @until(i32 %0, i32 %1) {
+  br label %3
+
+3:
+  %4 = phi i32 [ %0, %2 ], [ %7, %3 ]
+  %5 = phi i32 [ 0, %2 ], [ %6, %3 ]
+  %6 = add nsw i32 %5, %4
+  %7 = add nsw i32 %4, 1
+  %8 = icmp ne i32 %1, %7
+  br i1 %8, label %3, label %9
+
+9:
+  ret i32 %6
+}
+
+define i32 @evens(i32 %0) {
+  br label %2
+
+2:
+  %3 = phi i32 [ 0, %1 ], [ %6, %2 ]
+  %4 = phi i32 [ 0, %1 ], [ %5, %2 ]
+  %5 = add i32 %4, %3
+  %6 = add i32 %3, 2
+  %7 = icmp ult i32 %6, %0
+  br i1 %7, label %2, label %8
+
+8:
+  ret i32 %5
+}
+
+define i32 @twice(i32 %0) {
+  %2 = add nsw i32 %0, %0
+  ret i32 %2
+}
+
+define i32 @calls(i32 %0) {
+  br label %2
+
+2:
+  %3 = phi i32 [ 1, %1 ], [ %7, %2 ]
+  %4 = phi i32 [ 0, %1 ], [ %6, %2 ]
+  %5 = call i32 @twice(i32 %3)
+  %6 = add nsw i32 %4, %5
+  %7 = add nsw i32 %3, 1
+  %8 = icmp slt i32 %7, %0
+  br i1 %8, label %2, label %9
+
+9:
+  ret i32 %6
+}
+
+define i32 @main() {
+  %1 = call i32 @full()
+  %2 = call i32 @up(i32 10)
+  %3 = call i32 @up(i32 -5)
+  %4 = call i32 @down(i32 20)
+  %5 = call i32 @until(i32 3, i32 11)
+  %6 = call i32 @evens(i32 15)
+  %7 = call i32 @calls(i32 7)
+  %8 = add nsw i32 %1, %2
+  %9 = add nsw i32 %8, %3
+  %10 = add nsw i32 %9, %4
+  %11 = add nsw i32 %10, %5
+  %12 = add nsw i32 %11, %6
+  %13 = add nsw i32 %12, %7
+  ret i32 %13
+}
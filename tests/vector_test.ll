@@ -0,0 +1,82 @@
+; Counted loops that accumulate sums, differences and products. Built with --target=sse4.1 or --target=avx2, they run
+; several iterations at a time in vector registers, and the loops themselves only finish off what's left over.
+
+define i32 @sum_of_squares(i32 %0) {
+  br label %2
+
+2:
+  %3 = phi i32 [ 0, %1 ], [ %7, %2 ]
+  %4 = phi i32 [ 0, %1 ], [ %6, %2 ]
+  %5 = mul i32 %3, %3
+  %6 = add i32 %4, %5
+  %7 = add i32 %3, 1
+  %8 = icmp slt i32 %7, %0
+  br i1 %8, label %2, label %9
+
+9:
+  ret i32 %6
+}
+
+; Three accumulators at once, counting from 5 until the count hits %1.
+define i32 @mixed(i32 %0, i32 %1) {
+  br label %3
+
+3:
+  %4 = phi i32 [ 5, %2 ], [ %15, %3 ]
+  %5 = phi i32 [ 7, %2 ], [ %10, %3 ]
+  %6 = phi i32 [ 1, %2 ], [ %13, %3 ]
+  %7 = phi i32 [ 1000, %2 ], [ %14, %3 ]
+  %8 = mul i32 %4, %0
+  %9 = mul i32 %8, 2
+  %10 = add i32 %9, %5
+  %11 = mul i32 %4, 2
+  %12 = add i32 %11, 1
+  %13 = mul i32 %6, %12
+  %14 = sub i32 %7, %4
+  %15 = add i32 %4, 1
+  %16 = icmp eq i32 %15, %1
+  br i1 %16, label %17, label %3
+
+17:
+  %18 = add i32 %10, %13
+  %19 = add i32 %18, %14
+  ret i32 %19
+}
+
+; Unsigned bounds, and a starting count that comes from outside.
+define i32 @unsigned_sum(i32 %0, i32 %1) {
+  br label %3
+
+3:
+  %4 = phi i32 [ %0, %2 ], [ %8, %3 ]
+  %5 = phi i32 [ 0, %2 ], [ %7, %3 ]
+  %6 = sub i32 %4, %0
+  %7 = add i32 %5, %6
+  %8 = add i32 %4, 1
+  %9 = icmp ult i32 %8, %1
+  br i1 %9, label %3, label %10
+
+10:
+  ret i32 %7
+}
+
+define i32 @main() {
+  %1 = call i32 @sum_of_squares(i32 1000)
+  %2 = call i32 @sum_of_squares(i32 3)
+  %3 = call i32 @sum_of_squares(i32 0)
+  %4 = call i32 @mixed(i32 3, i32 1003)
+  %5 = call i32 @mixed(i32 3, i32 9)
+  %6 = call i32 @unsigned_sum(i32 4294967290, i32 20)
+  %7 = call i32 @unsigned_sum(i32 100, i32 137)
+  %8 = add i32 %1, %2
+  %9 = add i32 %8, %3
+  %10 = mul i32 %9, 3
+  %11 = add i32 %10, %4
+  %12 = mul i32 %11, 5
+  %13 = add i32 %12, %5
+  %14 = mul i32 %13, 7
+  %15 = add i32 %14, %6
+  %16 = mul i32 %15, 11
+  %17 = add i32 %16, %7
+  ret i32 %17
+}
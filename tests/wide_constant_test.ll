@@ -0,0 +1,40 @@
+; i64 constants that don't fit in the 32 bits of an immediate, which only movq into a register can take. Everything
+; else has to get them out of %rax.
+
+define i64 @wide(i64 %0, i64 %1) {
+  %3 = alloca i64, align 8
+  %4 = add i64 %0, 8589934593
+  %5 = mul i64 %4, 4294967297
+  %6 = sub i64 %5, -4294967296
+  %7 = icmp sgt i64 %1, 4294967296
+  %8 = select i1 %7, i64 -8589934592, i64 -8589934591
+  %9 = add i64 %6, %8
+  store volatile i64 12884901888, i64* %3, align 8
+  %10 = load volatile i64, i64* %3, align 8
+  %11 = add i64 %9, %10
+  %12 = sub i64 %1, 4294967296
+  %13 = add i64 %11, %12
+  ret i64 %13
+}
+
+define i64 @spill(i64 %0, i64 %1, i64 %2, i64 %3, i64 %4, i64 %5, i64 %6, i64 %7) {
+  %9 = add i64 %0, %6
+  %10 = sub i64 %7, 4294967296
+  %11 = add i64 %9, %10
+  ret i64 %11
+}
+
+define i32 @main() {
+  %1 = call i64 @wide(i64 3, i64 5000000000)
+  %2 = call i64 @wide(i64 -7, i64 2)
+  %3 = call i64 @spill(i64 1, i64 2, i64 3, i64 4, i64 5, i64 6, i64 7, i64 8589934600)
+  %4 = add i64 %1, %2
+  %5 = sdiv i64 %4, 536870912
+  %6 = trunc i64 %4 to i32
+  %7 = trunc i64 %3 to i32
+  %8 = trunc i64 %5 to i32
+  %9 = mul i32 %6, 7
+  %10 = add i32 %9, %7
+  %11 = add i32 %10, %8
+  ret i32 %11
+}
@@ -0,0 +1,81 @@
+; i64 switches on cases too big for an immediate: a binary search with cases all over the place, and a jump table
+; whose lowest case is past 32 bits.
+
+define i64 @tree(i64 %0) {
+  switch i64 %0, label %6 [
+    i64 -4294967296, label %2
+    i64 4294967296, label %3
+    i64 8589934592, label %4
+    i64 7, label %5
+    i64 -9223372036854775808, label %3
+  ]
+
+2:
+  ret i64 1
+
+3:
+  ret i64 2
+
+4:
+  ret i64 3
+
+5:
+  ret i64 4
+
+6:
+  ret i64 5
+}
+
+define i64 @dense(i64 %0) {
+  switch i64 %0, label %6 [
+    i64 8589934592, label %2
+    i64 8589934593, label %3
+    i64 8589934594, label %4
+    i64 8589934595, label %5
+    i64 8589934596, label %2
+    i64 8589934598, label %3
+  ]
+
+2:
+  ret i64 10
+
+3:
+  ret i64 20
+
+4:
+  ret i64 30
+
+5:
+  ret i64 40
+
+6:
+  ret i64 50
+}
+
+define i32 @main() {
+  %1 = call i64 @tree(i64 -4294967296)
+  %2 = call i64 @tree(i64 4294967296)
+  %3 = call i64 @tree(i64 8589934592)
+  %4 = call i64 @tree(i64 7)
+  %5 = call i64 @tree(i64 -9223372036854775808)
+  %6 = call i64 @tree(i64 0)
+  %7 = call i64 @dense(i64 8589934594)
+  %8 = call i64 @dense(i64 8589934598)
+  %9 = call i64 @dense(i64 8589934597)
+  %10 = call i64 @dense(i64 2)
+  %11 = call i64 @dense(i64 8589934596)
+  %12 = mul i64 %1, 1
+  %13 = mul i64 %2, 10
+  %14 = add i64 %12, %13
+  %15 = add i64 %14, %3
+  %16 = add i64 %15, %4
+  %17 = add i64 %16, %5
+  %18 = add i64 %17, %6
+  %19 = add i64 %18, %7
+  %20 = add i64 %19, %8
+  %21 = add i64 %20, %9
+  %22 = add i64 %21, %10
+  %23 = add i64 %22, %11
+  %24 = trunc i64 %23 to i32
+  ret i32 %24
+}
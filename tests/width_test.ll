@@ -0,0 +1,47 @@
+; i32 arithmetic has to wrap around at 32 bits, narrow comparisons have to ignore the high bits, and division has to
+; leave %rdx the way it found it.
+
+define i32 @wrap(i32 %0) {
+  %2 = add i32 %0, 1
+  %3 = icmp slt i32 %2, 0
+  %4 = zext i1 %3 to i32
+  ret i32 %4
+}
+
+define i64 @widen(i32 %0) {
+  %2 = sext i32 %0 to i64
+  %3 = zext i32 %0 to i64
+  %4 = add i64 %2, %3
+  %5 = sdiv i64 %4, 1073741824
+  ret i64 %5
+}
+
+define i32 @divide(i32 %0, i32 %1, i32 %2) {
+  %4 = sdiv i32 %0, %2
+  %5 = sdiv i32 %4, 3
+  %6 = mul nsw i32 %5, 5
+  %7 = add nsw i32 %6, %1
+  %8 = add nsw i32 %7, %2
+  ret i32 %8
+}
+
+define i32 @narrow(i32 %0) {
+  %2 = trunc i32 %0 to i8
+  %3 = add i8 %2, -6
+  %4 = icmp ult i8 %3, 40
+  %5 = sext i8 %3 to i32
+  %6 = select i1 %4, i32 %5, i32 0
+  ret i32 %6
+}
+
+define i32 @main() {
+  %1 = call i32 @wrap(i32 2147483647)
+  %2 = call i64 @widen(i32 -5)
+  %3 = trunc i64 %2 to i32
+  %4 = call i32 @divide(i32 -100, i32 30, i32 7)
+  %5 = call i32 @narrow(i32 300)
+  %6 = add i32 %1, %3
+  %7 = add i32 %6, %4
+  %8 = add i32 %7, %5
+  ret i32 %8
+}
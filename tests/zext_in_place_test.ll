@@ -0,0 +1,16 @@
+; Zero-extending an i32 that was truncated from an i64 with its top half set. The extension usually gets the same
+; register as the value it extends, and it still has to clear the top half.
+
+define i64 @low_half(i64 %0, i64 %1) {
+  %3 = add i64 %0, %1
+  %4 = trunc i64 %3 to i32
+  %5 = zext i32 %4 to i64
+  ret i64 %5
+}
+
+define i32 @main() {
+  %1 = call i64 @low_half(i64 8589934592, i64 1)
+  %2 = icmp eq i64 %1, 1
+  %3 = select i1 %2, i32 42, i32 7
+  ret i32 %3
+}
@@ -0,0 +1,367 @@
+#include "passes.hpp"
+#include "x86.hpp"
+#include <llvm/ADT/APInt.h>              // for llvm::APInt
+#include <llvm/IR/BasicBlock.h>          // for llvm::BasicBlock
+#include <llvm/IR/CFG.h>                 // for llvm::predecessors
+#include <llvm/IR/Constants.h>           // for llvm::ConstantInt
+#include <llvm/IR/Function.h>            // for llvm::Function
+#include <llvm/IR/InstrTypes.h>          // for llvm::BinaryOperator, llvm::CmpInst
+#include <llvm/IR/Instructions.h>        // for llvm::BranchInst, llvm::ICmpInst, llvm::PHINode
+#include <llvm/Support/Casting.h>        // for llvm::dyn_cast, llvm::isa
+#include <llvm/Transforms/Utils/Local.h> // for llvm::isInstructionTriviallyDead
+#include <algorithm>                     // for std::max
+#include <cstdint>                       // for uint64_t
+#include <map>                           // for std::map
+#include <string>                        // for std::string
+#include <utility>                       // for std::pair, std::swap
+#include <vector>                        // for std::vector
+
+// The loop unroller.
+//
+// Every trip around a loop costs a comparison, a jump or two, and the phi moves on the way back to the top, which can
+// easily be more than the loop's actual work. So a loop like
+//
+//     loop:
+//       %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+//       %sum = phi i32 [ 0, %entry ], [ %sum.next, %loop ]
+//       %sum.next = add i32 %sum, %i
+//       %i.next = add i32 %i, 1
+//       %again = icmp slt i32 %i.next, %n
+//       br i1 %again, label %loop, label %done
+//
+// gets a copy in front of it that does several iterations per trip for as long as there are more than that many
+// left, and then the loop itself finishes off the rest, which is always at least one iteration. A loop whose count
+// starts and ends at constants close enough together doesn't need to be a loop at all, so it gets written out in full.
+
+// Returns whether @value is computed in @block.
+bool defined_in(llvm::Value const *value, llvm::BasicBlock const &block) {
+    llvm::Instruction const *instruction = llvm::dyn_cast<llvm::Instruction>(value);
+    return instruction != nullptr && instruction->getParent() == &block;
+}
+
+// Works out whether @block is a counted loop, and if so, fills in @loop.
+bool match_counted_loop(llvm::BasicBlock &block, counted_loop &loop) {
+    loop.block = &block;
+
+    // The loop goes around on one side of a conditional branch and leaves on the other.
+    llvm::BranchInst *br = llvm::dyn_cast<llvm::BranchInst>(block.getTerminator());
+    if (br == nullptr || !br->isConditional() || (br->getSuccessor(0) == &block) == (br->getSuccessor(1) == &block)) {
+        return false;
+    }
+    loop.exit = br->getSuccessor(0) == &block ? br->getSuccessor(1) : br->getSuccessor(0);
+
+    // hoist_loop_invariants gave the loop a preheader, which only goes into the loop.
+    loop.preheader = nullptr;
+    for (llvm::BasicBlock *predecessor : llvm::predecessors(&block)) {
+        if (predecessor == &block) {
+            continue;
+        }
+        if (loop.preheader != nullptr && loop.preheader != predecessor) {
+            return false;
+        }
+        loop.preheader = predecessor;
+    }
+    if (loop.preheader == nullptr || loop.preheader->getSingleSuccessor() != &block ||
+        !llvm::isa<llvm::BranchInst>(loop.preheader->getTerminator())) {
+        return false;
+    }
+
+    // Normalize the exit test into `%bump <predicate> %bound` being true when the loop goes around again.
+    loop.exit_test = llvm::dyn_cast<llvm::ICmpInst>(br->getCondition());
+    if (loop.exit_test == nullptr || loop.exit_test->getParent() != &block || !loop.exit_test->hasOneUse()) {
+        return false;
+    }
+    loop.predicate = br->getSuccessor(0) == &block ? loop.exit_test->getPredicate() : loop.exit_test->getInversePredicate();
+    llvm::Value *increment = loop.exit_test->getOperand(0);
+    loop.bound = loop.exit_test->getOperand(1);
+    if (defined_in(loop.bound, block)) {
+        std::swap(increment, loop.bound);
+        loop.predicate = llvm::CmpInst::getSwappedPredicate(loop.predicate);
+    }
+    if (defined_in(loop.bound, block)) {
+        return false;
+    }
+
+    // The count goes up or down by a constant, like `add i32 %i, 1` or `sub i32 %i, 2`.
+    loop.bump = llvm::dyn_cast<llvm::BinaryOperator>(increment);
+    if (loop.bump == nullptr || loop.bump->getParent() != &block || !loop.bump->getType()->isIntegerTy() ||
+        loop.bump->getType()->getIntegerBitWidth() < 8 || loop.bump->getType()->getIntegerBitWidth() > 64) {
+        return false;
+    }
+    loop.induction = nullptr;
+    unsigned opcode = loop.bump->getOpcode();
+    for (unsigned i = 0; i < 2; i++) {
+        llvm::PHINode *phi_node = llvm::dyn_cast<llvm::PHINode>(loop.bump->getOperand(i));
+        llvm::ConstantInt *step = llvm::dyn_cast<llvm::ConstantInt>(loop.bump->getOperand(1 - i));
+        if (phi_node == nullptr || step == nullptr || phi_node->getParent() != &block || phi_node->getIncomingValueForBlock(&block) != loop.bump) {
+            continue;
+        }
+        if (opcode == llvm::Instruction::Add) {
+            loop.induction = phi_node;
+            loop.step = step->getValue();
+        }
+        else if (opcode == llvm::Instruction::Sub && i == 0) {
+            loop.induction = phi_node;
+            loop.step = -step->getValue();
+        }
+    }
+    if (loop.induction == nullptr || loop.step.isZero() || loop.step.isMinSignedValue()) {
+        return false;
+    }
+
+    // We need to know how far the count has to go. Counting up to a bound or down to one works for any step, but
+    // counting until the count hits the bound only works one at a time, since a bigger step could skip right over it.
+    bool up = loop.step.isStrictlyPositive();
+    switch (loop.predicate) {
+    case llvm::CmpInst::ICMP_SLT:
+    case llvm::CmpInst::ICMP_ULT:
+        if (!up) {
+            return false;
+        }
+        break;
+    case llvm::CmpInst::ICMP_SGT:
+    case llvm::CmpInst::ICMP_UGT:
+        if (up) {
+            return false;
+        }
+        break;
+    case llvm::CmpInst::ICMP_NE:
+        if (!loop.step.isOne() && !loop.step.isAllOnes()) {
+            return false;
+        }
+        break;
+    default:
+        return false;
+    }
+
+    loop.size = 0;
+    for (llvm::Instruction &instruction : block) {
+        if (llvm::isa<llvm::AllocaInst>(instruction)) {
+            return false;
+        }
+        if (!llvm::isa<llvm::PHINode>(instruction) && &instruction != loop.exit_test && !instruction.isTerminator()) {
+            loop.size++;
+        }
+    }
+    return true;
+}
+
+namespace {
+
+// How many instructions an unrolled loop body gets to be. The same goes for a loop that's unrolled all the way.
+unsigned const UNROLL_BUDGET = 64;
+
+// Returns how many times @loop goes around if it starts at a constant and counts to a constant, or 0 if it doesn't or
+// if that's more than @limit.
+uint64_t constant_trip_count(counted_loop const &loop, uint64_t limit) {
+    llvm::ConstantInt const *start = llvm::dyn_cast<llvm::ConstantInt>(loop.induction->getIncomingValueForBlock(loop.preheader));
+    llvm::ConstantInt const *bound = llvm::dyn_cast<llvm::ConstantInt>(loop.bound);
+    if (start == nullptr || bound == nullptr) {
+        return 0;
+    }
+    llvm::APInt count = start->getValue();
+    for (uint64_t trips = 1; trips <= limit; trips++) {
+        count += loop.step;
+        if (!llvm::ICmpInst::compare(count, bound->getValue(), loop.predicate)) {
+            return trips;
+        }
+    }
+    return 0;
+}
+
+// Copies one iteration of @loop in front of @before. @values says what the loop's phi nodes hold going in, and gets
+// what each copied instruction computes added to it.
+void copy_iteration(counted_loop const &loop, llvm::Instruction *before, std::map<llvm::Value *, llvm::Value *> &values) {
+    for (llvm::Instruction &instruction : *loop.block) {
+        if (llvm::isa<llvm::PHINode>(instruction) || &instruction == loop.exit_test || instruction.isTerminator()) {
+            continue;
+        }
+        llvm::Instruction *copy = instruction.clone();
+        copy->setName(instruction.getName());
+        for (llvm::Use &operand : copy->operands()) {
+            auto found = values.find(operand.get());
+            if (found != values.end()) {
+                operand.set(found->second);
+            }
+        }
+        copy->insertBefore(before);
+        values[&instruction] = copy;
+    }
+}
+
+// Moves @values on to the next iteration of @loop: every phi node gets what comes back around to it.
+void next_iteration(counted_loop const &loop, std::map<llvm::Value *, llvm::Value *> &values) {
+    std::map<llvm::Value *, llvm::Value *> next;
+    for (llvm::PHINode &phi_node : loop.block->phis()) {
+        llvm::Value *incoming = phi_node.getIncomingValueForBlock(loop.block);
+        auto found = values.find(incoming);
+        next[&phi_node] = found != values.end() ? found->second : incoming;
+    }
+    for (auto const &[phi_node, value] : next) {
+        values[phi_node] = value;
+    }
+}
+
+// Gets rid of whatever in @block nothing uses, like the last copy of the count in a loop that's been written out.
+void remove_dead_instructions(llvm::BasicBlock &block) {
+    for (auto it = block.rbegin(); it != block.rend();) {
+        llvm::Instruction &instruction = *it++;
+        if (llvm::isInstructionTriviallyDead(&instruction)) {
+            instruction.eraseFromParent();
+        }
+    }
+}
+
+// Returns a name for a new block that comes out of @loop, like "loop.unrolled" for ("loop", "unrolled").
+std::string block_name(counted_loop const &loop, std::string const &suffix) {
+    return loop.block->hasName() ? loop.block->getName().str() + "." + suffix : suffix;
+}
+
+// Replaces @loop, which goes around @trips times, with a block that just does all of its iterations one after another.
+void unroll_fully(counted_loop const &loop, uint64_t trips) {
+    llvm::LLVMContext &context = loop.block->getContext();
+    llvm::BasicBlock *unrolled = llvm::BasicBlock::Create(context, block_name(loop, "unrolled"), loop.block->getParent(), loop.block);
+    llvm::BranchInst *br = llvm::BranchInst::Create(loop.exit, unrolled);
+
+    std::map<llvm::Value *, llvm::Value *> values;
+    for (llvm::PHINode &phi_node : loop.block->phis()) {
+        values[&phi_node] = phi_node.getIncomingValueForBlock(loop.preheader);
+    }
+    for (uint64_t trip = 0; trip < trips; trip++) {
+        if (trip > 0) {
+            next_iteration(loop, values);
+        }
+        copy_iteration(loop, br, values);
+    }
+
+    // Whatever uses the loop's values afterwards gets them from the last iteration.
+    for (auto const &[original, value] : values) {
+        llvm::cast<llvm::Instruction>(original)->replaceUsesOutsideBlock(value, loop.block);
+    }
+    for (llvm::PHINode &phi_node : loop.exit->phis()) {
+        for (unsigned i = 0; i < phi_node.getNumIncomingValues(); i++) {
+            if (phi_node.getIncomingBlock(i) == loop.block) {
+                phi_node.setIncomingBlock(i, unrolled);
+            }
+        }
+    }
+
+    loop.preheader->getTerminator()->replaceSuccessorWith(loop.block, unrolled);
+    loop.block->dropAllReferences();
+    loop.block->eraseFromParent();
+    remove_dead_instructions(*unrolled);
+}
+
+// Puts a copy of @loop in front of it that does @factor iterations per trip, for as long as that leaves at least one
+// for the loop itself.
+void unroll_with_remainder(counted_loop const &loop, unsigned factor) {
+    llvm::LLVMContext &context = loop.block->getContext();
+    llvm::Function *function = loop.block->getParent();
+    llvm::Type *type = loop.induction->getType();
+    bool up = loop.step.isStrictlyPositive();
+    llvm::Value *start = loop.induction->getIncomingValueForBlock(loop.preheader);
+
+    // How far @count is from the bound, or at least how far it is if it hasn't already gone past it. The unrolled
+    // loop goes around while that's more than it covers in one trip.
+    llvm::Constant *stride = llvm::ConstantInt::get(type, (loop.step.abs() * factor).getZExtValue());
+    auto distance = [&](llvm::Value *count, llvm::BasicBlock *block) {
+        llvm::Value *distance = up ? llvm::BinaryOperator::CreateSub(loop.bound, count, "", block)
+                                   : llvm::BinaryOperator::CreateSub(count, loop.bound, "", block);
+        return new llvm::ICmpInst(*block, llvm::CmpInst::ICMP_UGT, distance, stride);
+    };
+
+    // A count that's already past the bound is still good for one trip around the original loop, and its distance
+    // from the bound doesn't mean anything, so that gets checked first. Counting until hitting the bound always has
+    // a distance to go.
+    std::vector<llvm::BasicBlock *> checks;
+    if (loop.predicate != llvm::CmpInst::ICMP_NE) {
+        checks.push_back(llvm::BasicBlock::Create(context, block_name(loop, "unroll.start"), function, loop.block));
+    }
+    llvm::BasicBlock *check = llvm::BasicBlock::Create(context, block_name(loop, "unroll.check"), function, loop.block);
+    checks.push_back(check);
+    llvm::BasicBlock *unrolled = llvm::BasicBlock::Create(context, block_name(loop, "unrolled"), function, loop.block);
+
+    if (checks.size() > 1) {
+        // Immediates go on the right of a comparison.
+        llvm::ICmpInst *before_bound = llvm::isa<llvm::Constant>(start)
+                                           ? new llvm::ICmpInst(*checks[0], llvm::CmpInst::getSwappedPredicate(loop.predicate), loop.bound, start)
+                                           : new llvm::ICmpInst(*checks[0], loop.predicate, start, loop.bound);
+        llvm::BranchInst::Create(check, loop.block, before_bound, checks[0]);
+    }
+    llvm::BranchInst::Create(unrolled, loop.block, distance(start, check), check);
+
+    // The unrolled loop gets its own phi nodes, which start out with what the loop's would have.
+    std::map<llvm::Value *, llvm::Value *> values;
+    std::vector<std::pair<llvm::PHINode *, llvm::PHINode *>> copies;
+    for (llvm::PHINode &phi_node : loop.block->phis()) {
+        llvm::PHINode *copy = llvm::PHINode::Create(phi_node.getType(), 2, phi_node.getName(), unrolled);
+        copy->addIncoming(phi_node.getIncomingValueForBlock(loop.preheader), check);
+        values[&phi_node] = copy;
+        copies.push_back({&phi_node, copy});
+    }
+    llvm::BranchInst *br = llvm::BranchInst::Create(unrolled, unrolled);
+    for (unsigned i = 0; i < factor; i++) {
+        copy_iteration(loop, br, values);
+        next_iteration(loop, values);
+    }
+    for (auto const &[phi_node, copy] : copies) {
+        copy->addIncoming(values[phi_node], unrolled);
+    }
+    llvm::BranchInst::Create(unrolled, loop.block, distance(values[loop.induction], unrolled), unrolled);
+    br->eraseFromParent();
+    remove_dead_instructions(*unrolled);
+
+    // The loop itself can now be reached from any of those, with its phi nodes starting wherever they left off.
+    for (auto const &[phi_node, copy] : copies) {
+        llvm::Value *start_value = phi_node->getIncomingValueForBlock(loop.preheader);
+        phi_node->removeIncomingValue(loop.preheader, false);
+        for (llvm::BasicBlock *block : checks) {
+            phi_node->addIncoming(start_value, block);
+        }
+        phi_node->addIncoming(values[phi_node], unrolled);
+    }
+    loop.preheader->getTerminator()->replaceSuccessorWith(loop.block, checks[0]);
+}
+
+} // namespace
+
+// Unrolls the single-block loops in @function that count by a constant until they reach something that doesn't change.
+// Ones that start and stop at constants and are short enough get written out in full, and the others get a copy in
+// front of them that does @options.unroll_factor iterations per trip. Loops that are going to be vectorized are left
+// for the vectorizer.
+// Returns whether anything changed.
+bool unroll_loops(llvm::Function &function, x86Options const &options) {
+    std::vector<llvm::BasicBlock *> blocks;
+    for (llvm::BasicBlock &block : function) {
+        blocks.push_back(&block);
+    }
+
+    bool changed = false;
+    for (llvm::BasicBlock *block : blocks) {
+        counted_loop loop;
+        if (!match_counted_loop(*block, loop) || (options.vector_bits != 0 && vectorizable_loop(*block))) {
+            continue;
+        }
+
+        uint64_t trips = constant_trip_count(loop, UNROLL_BUDGET / std::max(loop.size, 1u));
+        if (trips > 0) {
+            unroll_fully(loop, trips);
+            changed = true;
+            continue;
+        }
+
+        // Shrink the factor until the body fits, but don't bother with less than two at a time.
+        unsigned factor = options.unroll_factor;
+        while (factor > 1 && factor * loop.size > UNROLL_BUDGET) {
+            factor /= 2;
+        }
+        // The distance to the bound is unsigned, so a whole trip's worth of counting has to fit in the signed range.
+        unsigned bits = loop.induction->getType()->getIntegerBitWidth();
+        if (factor < 2 || loop.step.abs().getZExtValue() * factor >= (uint64_t(1) << (bits - 1))) {
+            continue;
+        }
+        unroll_with_remainder(loop, factor);
+        changed = true;
+    }
+    return changed;
+}
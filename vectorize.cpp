@@ -0,0 +1,414 @@
+#include "passes.hpp"
+#include "x86.hpp"
+#include <llvm/IR/BasicBlock.h>       // for llvm::BasicBlock
+#include <llvm/IR/Constants.h>        // for llvm::ConstantInt
+#include <llvm/IR/Function.h>         // for llvm::Function
+#include <llvm/IR/InstrTypes.h>       // for llvm::BinaryOperator, llvm::CmpInst
+#include <llvm/IR/Instructions.h>     // for llvm::PHINode
+#include <llvm/Support/Casting.h>     // for llvm::dyn_cast, llvm::isa
+#include <algorithm>                  // for std::find, std::max
+#include <cstdint>                    // for int32_t
+#include <map>                        // for std::map
+#include <set>                        // for std::set
+#include <string>                     // for std::string, std::to_string
+#include <vector>                     // for std::vector
+
+// The loop vectorizer.
+//
+// Kernels spend most of their time in loops like
+//
+//     loop:
+//       %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+//       %sum = phi i32 [ 0, %entry ], [ %sum.next, %loop ]
+//       %square = mul i32 %i, %i
+//       %sum.next = add i32 %sum, %square
+//       %i.next = add i32 %i, 1
+//       %again = icmp slt i32 %i.next, %n
+//       br i1 %again, label %loop, label %done
+//
+// where every iteration is independent except for the count and the accumulators, and adding and multiplying don't
+// care what order things happen in. So on the edge into the loop, right after the phi moves, we run as many
+// iterations as we can 4 at a time (SSE4.1) or 8 at a time (AVX2): lane n of every vector register holds what the
+// scalar loop would have on its nth iteration of the batch, every accumulator gets a vector of partial results, and
+// afterwards they get added (or multiplied) across into the accumulator's slot and the count gets moved up. Then the
+// loop proper runs whatever's left, which is always at least one iteration, as is.
+//
+// 32-bit adds, subtracts and multiplies wrap around the same way whichever order they're done in, so the answers are
+// exactly the same as without vectorizing.
+
+namespace {
+
+// Returns whether @instruction is arithmetic that the vector units can do on 32-bit lanes.
+bool vectorizable(llvm::Instruction const *instruction) {
+    if (!instruction->getType()->isIntegerTy(32)) {
+        return false;
+    }
+    unsigned opcode = instruction->getOpcode();
+    return opcode == llvm::Instruction::Add || opcode == llvm::Instruction::Sub || opcode == llvm::Instruction::Mul;
+}
+
+// Returns which operand of @update, the incoming value of the accumulator @phi_node from its own loop, is the
+// accumulator, or -1 if @update isn't an add, sub or mul that accumulates into it.
+int accumulator_operand(llvm::PHINode const *phi_node, llvm::Value const *update) {
+    llvm::BinaryOperator const *binop = llvm::dyn_cast<llvm::BinaryOperator>(update);
+    if (binop == nullptr || binop->getParent() != phi_node->getParent() || !binop->getType()->isIntegerTy(32)) {
+        return -1;
+    }
+    unsigned opcode = binop->getOpcode();
+    if (binop->getOperand(0) == phi_node && binop->getOperand(1) != phi_node &&
+        (opcode == llvm::Instruction::Add || opcode == llvm::Instruction::Sub || opcode == llvm::Instruction::Mul)) {
+        return 0;
+    }
+    // Note that x - acc isn't an accumulation.
+    if (binop->getOperand(1) == phi_node && binop->getOperand(0) != phi_node && (opcode == llvm::Instruction::Add || opcode == llvm::Instruction::Mul)) {
+        return 1;
+    }
+    return -1;
+}
+
+// Works out whether @block is a loop that can be vectorized with @register_count vector registers, and if so, how.
+bool analyze_loop(llvm::BasicBlock const &block, unsigned register_count, x86VectorLoop &loop) {
+    // The loop counts up by one to something that doesn't change, like `icmp slt %i.next, %n`. Note that
+    // match_counted_loop only looks at the block, but it hands back pointers that the unroller changes things through.
+    counted_loop counted;
+    if (!match_counted_loop(const_cast<llvm::BasicBlock &>(block), counted) || !counted.step.isOne() ||
+        counted.bump->getOpcode() != llvm::Instruction::Add || !counted.induction->getType()->isIntegerTy(32) ||
+        (counted.predicate != llvm::CmpInst::ICMP_SLT && counted.predicate != llvm::CmpInst::ICMP_ULT && counted.predicate != llvm::CmpInst::ICMP_NE)) {
+        return false;
+    }
+    loop.preheader = counted.preheader;
+    loop.induction = counted.induction;
+    loop.bound = counted.bound;
+    loop.predicate = counted.predicate;
+
+    // Every other phi node is an accumulator that's only read to update it. Its update isn't read anywhere else in
+    // the loop either, so the accumulators don't depend on each other.
+    std::set<llvm::Value const *> updates;
+    for (llvm::PHINode const &phi_node : block.phis()) {
+        if (&phi_node == loop.induction) {
+            continue;
+        }
+        llvm::Value const *update = phi_node.getIncomingValueForBlock(&block);
+        if (!phi_node.hasOneUse() || accumulator_operand(&phi_node, update) < 0) {
+            return false;
+        }
+        for (llvm::User const *user : update->users()) {
+            if (user != &phi_node && defined_in(user, block)) {
+                return false;
+            }
+        }
+        loop.reductions.push_back(&phi_node);
+        updates.insert(update);
+    }
+    if (loop.reductions.empty()) {
+        return false;
+    }
+
+    // Skipping iterations had better not skip anything anyone could notice.
+    for (llvm::Instruction const &instruction : block) {
+        if (instruction.mayHaveSideEffects()) {
+            return false;
+        }
+    }
+
+    // Find everything that what gets accumulated is computed from. Anything from outside the loop gets copied into
+    // every lane.
+    std::set<llvm::Value const *> needed;
+    std::set<llvm::Value const *> invariants;
+    std::vector<llvm::Value const *> work;
+    for (llvm::PHINode const *phi_node : loop.reductions) {
+        llvm::Instruction const *update = llvm::cast<llvm::Instruction>(phi_node->getIncomingValueForBlock(&block));
+        work.push_back(update->getOperand(1 - accumulator_operand(phi_node, update)));
+    }
+    while (!work.empty()) {
+        llvm::Value const *value = work.back();
+        work.pop_back();
+        if (value == loop.induction || needed.count(value) != 0) {
+            continue;
+        }
+        if (!defined_in(value, block)) {
+            if (llvm::isa<llvm::Constant>(value) && !llvm::isa<llvm::ConstantInt>(value)) {
+                return false;
+            }
+            invariants.insert(value);
+            continue;
+        }
+        llvm::Instruction const *instruction = llvm::cast<llvm::Instruction>(value);
+        if (llvm::isa<llvm::PHINode>(instruction) || updates.count(instruction) != 0 || !vectorizable(instruction)) {
+            return false;
+        }
+        needed.insert(instruction);
+        work.push_back(instruction->getOperand(0));
+        work.push_back(instruction->getOperand(1));
+    }
+
+    // Hand out the vector registers. The count, the step, the accumulators and everything from outside keep theirs
+    // the whole time. Computations give theirs back once nothing else in the loop reads them.
+    unsigned next_register = 0;
+    loop.registers[loop.induction] = next_register++;
+    loop.step_register = next_register++;
+    for (llvm::PHINode const *phi_node : loop.reductions) {
+        loop.registers[phi_node] = next_register++;
+    }
+    for (llvm::Instruction const &instruction : block) {
+        for (llvm::Value const *operand : instruction.operands()) {
+            if (invariants.count(operand) != 0 && loop.registers.count(operand) == 0) {
+                loop.registers[operand] = next_register++;
+            }
+        }
+    }
+
+    std::map<llvm::Value const *, llvm::Instruction const *> last_reads;
+    for (llvm::Instruction const &instruction : block) {
+        if (needed.count(&instruction) != 0 || updates.count(&instruction) != 0) {
+            for (llvm::Value const *operand : instruction.operands()) {
+                last_reads[operand] = &instruction;
+            }
+        }
+    }
+
+    std::vector<unsigned> free_registers;
+    unsigned most_registers = next_register;
+    for (llvm::Instruction const &instruction : block) {
+        if (needed.count(&instruction) != 0 || updates.count(&instruction) != 0) {
+            loop.computations.push_back(&instruction);
+        }
+        if (needed.count(&instruction) != 0) {
+            // Note that this gets a register before its operands give theirs back, since SSE copies the first operand
+            // into the result before it reads the second.
+            if (free_registers.empty()) {
+                loop.registers[&instruction] = next_register++;
+            }
+            else {
+                loop.registers[&instruction] = free_registers.back();
+                free_registers.pop_back();
+            }
+        }
+        else if (updates.count(&instruction) == 0) {
+            continue;
+        }
+        for (llvm::Value const *operand : instruction.operands()) {
+            if (needed.count(operand) != 0 && last_reads[operand] == &instruction &&
+                std::find(free_registers.begin(), free_registers.end(), loop.registers[operand]) == free_registers.end()) {
+                free_registers.push_back(loop.registers[operand]);
+            }
+        }
+        most_registers = std::max(most_registers, next_register);
+    }
+
+    return most_registers <= register_count;
+}
+
+// Returns the 32-bit version of @source, which had better not be in use anywhere else if it's a register that isn't a
+// slot.
+x86Source *low_half(x86Source *source) {
+    if (source->type != x86Source::REG) {
+        return source;
+    }
+    x86Register *low = new x86Register(sized_register_name(static_cast<x86Register *>(source)->name, 32));
+    if (!contains(all_slots, source)) {
+        delete source;
+    }
+    return low;
+}
+
+} // namespace
+
+// Finds the loops in @function that can be vectorized for the target. Does nothing without a vector target.
+void x86Program::find_vector_loops(llvm::Function const &function) {
+    vector_loops.clear();
+    if (options.vector_bits == 0) {
+        return;
+    }
+
+    for (llvm::BasicBlock const &block : function) {
+        x86VectorLoop loop{};
+        if (analyze_loop(block, 16, loop)) {
+            vector_loops.insert({&block, loop});
+        }
+    }
+}
+
+// Returns whether @block is a loop that find_vector_loops would vectorize, so that the passes that run before it can
+// leave it the way the vectorizer expects it.
+bool vectorizable_loop(llvm::BasicBlock const &block) {
+    x86VectorLoop loop{};
+    return analyze_loop(block, 16, loop);
+}
+
+// Runs the vectorized iterations of the loop @block. Goes on the loop's way in from its preheader, right after the phi
+// moves, so the count and the accumulators are in their slots with their starting values.
+void x86Program::insert_vector_loop(llvm::BasicBlock const &block) {
+    x86VectorLoop const &loop = vector_loops[&block];
+    bool avx = options.vector_bits >= 256;
+    int32_t lanes = options.vector_bits / 32;
+    unsigned lane_shift = avx ? 3 : 2;
+    std::string name = labels[&block]->get_name();
+
+    auto vector_register = [&](unsigned number, bool whole = true) {
+        return new x86Register((avx && whole ? "ymm" : "xmm") + std::to_string(number));
+    };
+    auto vector = [&](std::string const &opcode, std::vector<x86Source *> operands) {
+        insert_instruction(new x86VectorInstruction((avx ? "v" : "") + opcode, operands));
+    };
+
+    // Puts @values in .rodata, aligned for loading a whole vector at once.
+    size_t constant_count = 0;
+    auto constant = [&](std::vector<int32_t> const &values) {
+        x86Label *label = new x86Label(name + "_VECTOR_CONSTANT_" + std::to_string(constant_count++));
+        std::string contents = ".long ";
+        for (size_t i = 0; i < values.size(); i++) {
+            contents += (i == 0 ? "" : ", ") + std::to_string(values[i]);
+        }
+        read_only_data.push_back(new x86Directive(avx ? ".p2align 5" : ".p2align 4"));
+        read_only_data.push_back(label);
+        read_only_data.push_back(new x86Directive(contents));
+        return new x86LabelPointer(label);
+    };
+
+    // Copies the 32-bit @value into every lane of vector register @number.
+    auto broadcast = [&](llvm::Value const &value, unsigned number) {
+        if (llvm::ConstantInt const *constant_int = constant_value(value)) {
+            int32_t val = constant_int->getSExtValue();
+            vector("movdqa", {constant(std::vector<int32_t>(lanes, val)), vector_register(number)});
+            return;
+        }
+        vector("movd", {low_half(query_source(value)), vector_register(number, false)});
+        if (avx) {
+            vector("pbroadcastd", {vector_register(number, false), vector_register(number)});
+        }
+        else {
+            vector("pshufd", {new x86Immediate(0), vector_register(number), vector_register(number)});
+        }
+    };
+
+    // Does @opcode on vector registers, like `result = left + right`.
+    auto arithmetic = [&](std::string const &opcode, x86Source *right, unsigned left, unsigned result) {
+        if (avx) {
+            vector(opcode, {right, vector_register(left), vector_register(result)});
+            return;
+        }
+        if (left != result) {
+            vector("movdqa", {vector_register(left), vector_register(result)});
+        }
+        vector(opcode, {right, vector_register(result)});
+    };
+
+    x86Source *induction = query_slot(*loop.induction);
+    x86Label *scalar = new x86Label(name + "_SCALAR");
+    x86Label *top = new x86Label(name + "_VECTOR");
+
+    insert_instruction(new x86Comment("running the loop " + std::to_string(lanes) + " iterations at a time while there's more than that to go"));
+    if (loop.predicate != llvm::CmpInst::ICMP_NE) {
+        // If it starts out at the bound, it only goes around once.
+        insert_instruction(new x86SrcDstInstruction("movl", low_half(induction), new x86Register("eax")));
+        insert_instruction(new x86SrcDstInstruction("cmpl", low_half(query_source(*loop.bound)), new x86Register("eax")));
+        insert_instruction(new x86LblInstruction(loop.predicate == llvm::CmpInst::ICMP_SLT ? "jge" : "jae", scalar));
+    }
+    // Otherwise it goes around (bound - count) times, counting from here. The last one's left to the loop itself.
+    insert_instruction(new x86SrcDstInstruction("movl", low_half(query_source(*loop.bound)), new x86Register("eax")));
+    insert_instruction(new x86SrcDstInstruction("subl", low_half(induction), new x86Register("eax")));
+    insert_instruction(new x86SrcDstInstruction("cmpl", new x86Immediate(lanes), new x86Register("eax")));
+    insert_instruction(new x86LblInstruction("jbe", scalar));
+
+    // Lane n starts out at count + n, and they all go up by the number of lanes each time.
+    broadcast(*loop.induction, loop.registers.at(loop.induction));
+    std::vector<int32_t> offsets;
+    for (int32_t i = 0; i < lanes; i++) {
+        offsets.push_back(i);
+    }
+    arithmetic("paddd", constant(offsets), loop.registers.at(loop.induction), loop.registers.at(loop.induction));
+    vector("movdqa", {constant(std::vector<int32_t>(lanes, lanes)), vector_register(loop.step_register)});
+
+    for (llvm::PHINode const *phi_node : loop.reductions) {
+        unsigned accumulator = loop.registers.at(phi_node);
+        llvm::Instruction const *update = llvm::cast<llvm::Instruction>(phi_node->getIncomingValueForBlock(&block));
+        if (update->getOpcode() == llvm::Instruction::Mul) {
+            vector("movdqa", {constant(std::vector<int32_t>(lanes, 1)), vector_register(accumulator)});
+        }
+        else {
+            arithmetic("pxor", vector_register(accumulator), accumulator, accumulator);
+        }
+    }
+    std::set<llvm::Value const *> broadcasted;
+    for (llvm::Instruction const &instruction : block) {
+        for (llvm::Value const *operand : instruction.operands()) {
+            if (!defined_in(operand, block) && loop.registers.count(operand) != 0 && broadcasted.insert(operand).second) {
+                broadcast(*operand, loop.registers.at(operand));
+            }
+        }
+    }
+
+    // How many times to go around.
+    insert_instruction(new x86DstInstruction("decl", new x86Register("eax")));
+    insert_instruction(new x86SrcDstInstruction("shrl", new x86Immediate(lane_shift), new x86Register("eax")));
+
+    insert_instruction(new x86Directive(".p2align 4,,10"));
+    insert_instruction(top);
+    std::map<llvm::Value const *, llvm::PHINode const *> accumulators;
+    for (llvm::PHINode const *phi_node : loop.reductions) {
+        accumulators[phi_node->getIncomingValueForBlock(&block)] = phi_node;
+    }
+    for (llvm::Instruction const *computation : loop.computations) {
+        // Subtracting everything is the same as subtracting the sum of everything, so that's what sub accumulates.
+        if (accumulators.count(computation) != 0) {
+            llvm::PHINode const *phi_node = accumulators[computation];
+            llvm::Value const *term = computation->getOperand(1 - accumulator_operand(phi_node, computation));
+            unsigned accumulator = loop.registers.at(phi_node);
+            arithmetic(computation->getOpcode() == llvm::Instruction::Mul ? "pmulld" : "paddd", vector_register(loop.registers.at(term)), accumulator,
+                       accumulator);
+            continue;
+        }
+
+        unsigned result = loop.registers.at(computation);
+        unsigned left = loop.registers.at(computation->getOperand(0));
+        unsigned right = loop.registers.at(computation->getOperand(1));
+        std::string opcode = computation->getOpcode() == llvm::Instruction::Add ? "paddd" : computation->getOpcode() == llvm::Instruction::Sub ? "psubd" : "pmulld";
+        arithmetic(opcode, vector_register(right), left, result);
+    }
+    arithmetic("paddd", vector_register(loop.step_register), loop.registers.at(loop.induction), loop.registers.at(loop.induction));
+    insert_instruction(new x86DstInstruction("decl", new x86Register("eax")));
+    insert_instruction(new x86LblInstruction("jne", top));
+
+    // Combine the lanes of each accumulator, halving the width each time, and then fold them into its slot. The step's
+    // register is free to use for this now.
+    insert_instruction(new x86Comment("folding the vectorized iterations back in"));
+    unsigned spare = loop.step_register;
+    for (llvm::PHINode const *phi_node : loop.reductions) {
+        llvm::Instruction const *update = llvm::cast<llvm::Instruction>(phi_node->getIncomingValueForBlock(&block));
+        std::string opcode = update->getOpcode() == llvm::Instruction::Mul ? "pmulld" : "paddd";
+        unsigned accumulator = loop.registers.at(phi_node);
+        if (avx) {
+            insert_instruction(new x86VectorInstruction("vextracti128", {new x86Immediate(1), vector_register(accumulator), vector_register(spare, false)}));
+            vector(opcode, {vector_register(spare, false), vector_register(accumulator, false), vector_register(accumulator, false)});
+        }
+        for (int64_t shuffle : {0x4e, 0xb1}) {
+            vector("pshufd", {new x86Immediate(shuffle), vector_register(accumulator, false), vector_register(spare, false)});
+            if (avx) {
+                vector(opcode, {vector_register(spare, false), vector_register(accumulator, false), vector_register(accumulator, false)});
+            }
+            else {
+                vector(opcode, {vector_register(spare, false), vector_register(accumulator, false)});
+            }
+        }
+        vector("movd", {vector_register(accumulator, false), new x86Register("eax")});
+
+        x86Source *slot = query_slot(*phi_node);
+        if (update->getOpcode() == llvm::Instruction::Mul) {
+            insert_instruction(new x86SrcDstInstruction("imull", low_half(slot), new x86Register("eax")));
+            insert_instruction(new x86SrcDstInstruction("movl", new x86Register("eax"), static_cast<x86Destination *>(low_half(slot))));
+        }
+        else {
+            std::string fold = update->getOpcode() == llvm::Instruction::Sub ? "subl" : "addl";
+            insert_instruction(new x86SrcDstInstruction(fold, new x86Register("eax"), static_cast<x86Destination *>(low_half(slot))));
+        }
+    }
+
+    // The first lane has where the count's gotten to.
+    vector("movd", {vector_register(loop.registers.at(loop.induction), false), static_cast<x86Destination *>(low_half(induction))});
+    if (avx) {
+        insert_instruction(new x86NoArgInstruction("vzeroupper"));
+    }
+    insert_instruction(scalar);
+    flags = nullptr;
+}
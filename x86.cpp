@@ -1,6 +1,8 @@
 #include "x86.hpp"
 #include <llvm/IR/BasicBlock.h>       // for llvm::BasicBlock
+#include <llvm/IR/CFG.h>              // for llvm::predecessors
 #include <llvm/IR/Constants.h>        // for llvm::ConstantInt
+#include <llvm/IR/DataLayout.h>       // for llvm::DataLayout
 #include <llvm/IR/Function.h>         // for llvm::Function
 #include <llvm/IR/Instruction.h>      // for llvm::Instruction
 #include <llvm/IR/Instructions.h>     // for CallInst
@@ -9,6 +11,8 @@
 #include <llvm/IR/Value.h>            // for llvm::Value
 #include <llvm/Support/Casting.h>     // for llvm::isa, llvm::cast
 #include <llvm/Support/raw_ostream.h> // for llvm::raw_ostream, llvm::raw_string_ostream, llvm::errs, llvm::outs
+#include <algorithm>                  // for std::max, std::find
+#include <cstdint>                    // for INT32_MIN, INT32_MAX
 #include <map>                        // for std::set
 #include <set>                        // for std::map
 #include <string>                     // for std::string
@@ -32,16 +36,167 @@ bool block_starts_with_phi(llvm::BasicBlock const &block) {
     return block.begin()->getOpcode() == llvm::Instruction::PHI;
 }
 
+// Returns the blocks that @block's phi nodes take values from, each once, in the order the phi nodes list them. That
+// order doesn't depend on where anything happens to be in memory, so the same IR always comes out the same.
+std::vector<llvm::BasicBlock const *> phi_incoming_blocks(llvm::BasicBlock const &block) {
+    std::vector<llvm::BasicBlock const *> result;
+    std::set<llvm::BasicBlock const *> seen;
+    for (llvm::PHINode const &phi_instruction : block.phis()) {
+        for (llvm::BasicBlock const *incoming_block : phi_instruction.blocks()) {
+            if (seen.insert(incoming_block).second) {
+                result.push_back(incoming_block);
+            }
+        }
+    }
+    return result;
+}
+
+// Returns whether @function never calls anything.
+bool is_leaf_function(llvm::Function const &function) {
+    for (llvm::BasicBlock const &block : function) {
+        for (llvm::Instruction const &instruction : block) {
+            if (llvm::isa<llvm::CallInst>(instruction)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Returns whether the address that @alloca makes gets used for anything other than loading from it or storing to it.
+bool alloca_escapes(llvm::AllocaInst const &alloca) {
+    for (llvm::User const *user : alloca.users()) {
+        if (llvm::isa<llvm::LoadInst>(user)) {
+            continue;
+        }
+        if (llvm::isa<llvm::StoreInst>(user) && llvm::cast<llvm::StoreInst>(user)->getValueOperand() != &alloca) {
+            continue;
+        }
+        return true;
+    }
+    return false;
+}
+
+// Returns whether @user gets the comparison @comparison straight out of the flags, rather than out of a slot.
+// That's branches and selects that use it as their condition, and extensions of it.
+bool reads_flags(llvm::User const &user, llvm::Value const &comparison) {
+    if (llvm::isa<llvm::BranchInst>(user) || llvm::isa<llvm::ZExtInst>(user) || llvm::isa<llvm::SExtInst>(user)) {
+        return true;
+    }
+    if (llvm::isa<llvm::SelectInst>(user)) {
+        llvm::SelectInst const &select = llvm::cast<llvm::SelectInst>(user);
+        return select.getCondition() == &comparison && select.getTrueValue() != &comparison && select.getFalseValue() != &comparison;
+    }
+    return false;
+}
+
+// Returns whether @value is going to need a slot to live in.
+// Constants are immediates, comparisons live in the flags, and allocas that don't escape are just places in the frame.
+bool needs_slot(llvm::Value const &value) {
+    if (value.use_empty()) {
+        return false;
+    }
+    if (llvm::isa<llvm::Argument>(value)) {
+        return true;
+    }
+    if (!llvm::isa<llvm::Instruction>(value) || value.getType()->isVoidTy()) {
+        return false;
+    }
+    if (llvm::isa<llvm::ICmpInst>(value)) {
+        // Comparisons usually only live in the flags.
+        for (llvm::User const *user : value.users()) {
+            if (!reads_flags(*user, value)) {
+                return true;
+            }
+        }
+        return false;
+    }
+    if (llvm::isa<llvm::AllocaInst>(value)) {
+        return alloca_escapes(llvm::cast<llvm::AllocaInst>(value));
+    }
+    return true;
+}
+
+// Returns the name of the @bits-bit piece of the 64-bit register @name, like "eax" for ("rax", 32).
+std::string sized_register_name(std::string const &name, unsigned bits) {
+    if (bits > 32) {
+        return name;
+    }
+
+    // %r8 through %r15 just get a suffix.
+    if (name[1] >= '0' && name[1] <= '9') {
+        return name + (bits > 16 ? "d" : bits > 8 ? "w" : "b");
+    }
+
+    // %rax, %rbx, %rcx and %rdx
+    if (name[2] == 'x') {
+        std::string low = name.substr(1, 1);
+        return bits > 16 ? "e" + low + "x" : bits > 8 ? low + "x" : low + "l";
+    }
+
+    // %rsi, %rdi, %rbp and %rsp
+    std::string low = name.substr(1, 2);
+    return bits > 16 ? "e" + low : bits > 8 ? low : low + "l";
+}
+
+// Returns how many bits wide a value of @type is. Pointers are 64 bits.
+static unsigned bit_width(llvm::Type const *type) {
+    if (type->isPointerTy()) {
+        return 64;
+    }
+    return type->getIntegerBitWidth();
+}
+
+// Returns how wide arithmetic on a value of @type gets done. Only the low bits of a slot mean anything, so anything
+// 32 bits or narrower can use the 32-bit forms, which wrap around at the right place and don't need REX prefixes.
+static unsigned operation_width(llvm::Type const *type) {
+    return bit_width(type) > 32 ? 64 : 32;
+}
+
+// Returns the AT&T suffix for an operation @bits wide, like "l" for 32.
+static std::string size_suffix(unsigned bits) {
+    return bits > 32 ? "q" : bits > 16 ? "l" : bits > 8 ? "w" : "b";
+}
+
 // A set of all the slots. This exists so the destructors don't double-free slots used in more than one place.
 // I really should be passing things by value. Oh well.
-// global so it can be accessed from any destructor.
-std::set<x86Source *> all_slots;
+// global so it can be accessed from any destructor. It's per thread, since each thread has its own program.
+thread_local std::set<x86Source *> all_slots;
+
+// Returns @source as an operand @bits wide. Registers get renamed, and immediates and memory stay the same, since the
+// instruction's suffix says how wide they are. Takes @source over unless it's a slot.
+static x86Source *sized(x86Source *source, unsigned bits) {
+    if (source->type != x86Source::REG || bits > 32) {
+        return source;
+    }
+    x86Register *sized_register = new x86Register(sized_register_name(static_cast<x86Register *>(source)->name, bits));
+    if (all_slots.count(source) == 0) {
+        delete source;
+    }
+    return sized_register;
+}
+
+static x86Destination *sized(x86Destination *destination, unsigned bits) {
+    return static_cast<x86Destination *>(sized(static_cast<x86Source *>(destination), bits));
+}
+
+// Returns whether @source is an immediate that doesn't fit in the sign-extended 32 bits that every instruction but a
+// movq into a register is limited to.
+static bool wide_immediate(x86Source const *source) {
+    if (source->type != x86Source::IMM) {
+        return false;
+    }
+    int64_t val = static_cast<x86Immediate const *>(source)->val;
+    return val < INT32_MIN || val > INT32_MAX;
+}
 
 x86Immediate::x86Immediate(int64_t val) : val{val} {
     type = IMM;
 }
 
-x86Immediate::x86Immediate(llvm::ConstantInt const &constant_int) : val{constant_int.getSExtValue()} {
+// Note that i1s are 0 or 1, not 0 or -1.
+x86Immediate::x86Immediate(llvm::ConstantInt const &constant_int)
+    : val{constant_int.getBitWidth() == 1 ? (int64_t)constant_int.getZExtValue() : constant_int.getSExtValue()}, bits{constant_int.getBitWidth()} {
     type = IMM;
 }
 
@@ -98,6 +253,22 @@ void x86Pointer::print_as_pointer(llvm::raw_ostream &, int64_t) const {
     llvm::errs() << "ERROR: YOU CANNOT MAKE A POINTER OUT OF A POINTER. THIS WILL NOT ASSEMBLE.\n";
 }
 
+x86LabelPointer::x86LabelPointer(x86Label *label, int64_t offset) : label{label}, offset{offset} {
+    type = IMM_PTR;
+}
+
+void x86LabelPointer::print(llvm::raw_ostream &os) const {
+    os << label->get_name();
+    if (offset != 0) {
+        os << "+" << offset;
+    }
+    os << "(%rip)";
+}
+
+void x86LabelPointer::print_as_pointer(llvm::raw_ostream &, int64_t) const {
+    llvm::errs() << "ERROR: YOU CANNOT MAKE A POINTER OUT OF A POINTER. THIS WILL NOT ASSEMBLE.\n";
+}
+
 x86Label::x86Label(std::string name) : name{name} {
 }
 
@@ -109,6 +280,13 @@ void x86Label::print(llvm::raw_ostream &os) const {
     os << name << ":\n";
 }
 
+x86Text::x86Text(std::string text) : text{text} {
+}
+
+void x86Text::print(llvm::raw_ostream &os) const {
+    os << text;
+}
+
 x86Directive::x86Directive(std::string contents) : contents{contents} {
 }
 
@@ -123,6 +301,13 @@ void x86Comment::print(llvm::raw_ostream &os) const {
     os << "    # " << contents << "\n";
 }
 
+x86TableJump::x86TableJump(x86Label *table, std::string index) : table{table}, index{index} {
+}
+
+void x86TableJump::print(llvm::raw_ostream &os) const {
+    os << "    jmp *" << table->get_name() << "(,%" << index << ",8)\n";
+}
+
 x86NoArgInstruction::x86NoArgInstruction(std::string opcode) : opcode{opcode} {
 }
 
@@ -201,75 +386,191 @@ void x86SrcDstInstruction::print(llvm::raw_ostream &os) const {
     os << "\n";
 }
 
-// Constructs the program. Fills in the `labels` dictionary.
-// Note: It's on you to put the labels in `instructions` in the appropriate places.
-x86Program::x86Program(llvm::Module const &module) {
-    x86Label *main_label = nullptr;
+x86VectorInstruction::x86VectorInstruction(std::string opcode, std::vector<x86Source *> operands) : opcode{opcode}, operands{operands} {
+}
 
-    // Make the basic block labels and stick them in the labels map.
-    // Also fill in a map of instruction ids for later determining the latest use of each instruction.
-    for (llvm::Function const &function : module) {
-        for (llvm::BasicBlock const &block : function) {
-            // The first block of a function should be labelled with the function's name.
-            if (is_entry_block(block)) {
-                std::string function_name(function.getName());
-                x86Label *label = new x86Label(function_name);
-                if (function_name == "main") {
-                    main_label = label;
-                }
-                labels.insert({&block, label});
-            }
-            else {
-                // Otherwise, just give it a unique name.
-                std::string label;
-                llvm::raw_string_ostream rsos(label);
-                block.printAsOperand(rsos, false);
-                label = rsos.str(); // This isn't necessary in llvm 13, but llvm 10 has a bug that requires this.
-
-                label.replace(0, 1, "_block_");
-                label = std::string("__") + std::string(function.getName()) + label;
-                labels.insert({&block, new x86Label(label)});
-            }
+x86VectorInstruction::~x86VectorInstruction(void) {
+    for (x86Source *operand : operands) {
+        if (!contains(all_slots, operand)) {
+            delete operand;
+        }
+    }
+}
 
-            std::set<llvm::BasicBlock const *> incoming_blocks_to_phi_batch;
-            for (llvm::Instruction const &instruction : block) {
-                if (!llvm::isa<llvm::PHINode>(instruction)) {
-                    break;
-                }
-                llvm::PHINode const &phi_instruction = llvm::cast<llvm::PHINode>(instruction);
+void x86VectorInstruction::print(llvm::raw_ostream &os) const {
+    os << "    " << opcode;
+    for (size_t i = 0; i < operands.size(); i++) {
+        os << (i == 0 ? " " : ", ");
+        operands[i]->print(os);
+    }
+    os << "\n";
+}
 
-                for (llvm::BasicBlock const *incoming_block : phi_instruction.blocks()) {
-                    incoming_blocks_to_phi_batch.insert(incoming_block);
-                }
-            }
+x86Frame::x86Frame(bool frameless, std::vector<std::string> const &callee_saved_registers)
+    : frameless{frameless}, callee_saved_registers{callee_saved_registers}, lowest_offset{-8 * (int64_t)callee_saved_registers.size()},
+      base{new x86FrameRegister(*this)} {
+    all_slots.insert(base);
+}
+
+x86Frame::~x86Frame(void) {
+    // base is in all_slots, so the x86Program destructor takes care of it.
+}
+
+// Returns the callee-saved registers that the prologue has to save, which are the ones the function actually uses.
+std::vector<std::string> x86Frame::saved_registers(void) const {
+    std::vector<std::string> saved;
+    for (std::string const &register_name : callee_saved_registers) {
+        if (contains(used_registers, register_name)) {
+            saved.push_back(register_name);
+        }
+    }
+    return saved;
+}
 
-            // Grab this block's name
-            std::string block_label = labels[&block]->get_name();
+// Returns the %rbp offset that the prologue saves @register_name at.
+// Every callee-saved register has its own spot, whether or not it gets saved, so the spill slots don't have to wait
+// until the end of the function to find out where they go.
+int64_t x86Frame::saved_register_offset(std::string const &register_name) const {
+    int64_t offset = -8;
+    for (std::string const &callee_saved : callee_saved_registers) {
+        if (callee_saved == register_name) {
+            break;
+        }
+        offset -= 8;
+    }
+    return offset;
+}
 
-            for (llvm::BasicBlock const *incoming_block : incoming_blocks_to_phi_batch) {
-                // Make the incoming block's name
-                // It might already exist, but who cares? It doesn't take long to make a string.
+// Returns how far the prologue has to move %rsp down (past where it pushes %rbp) to make room for every slot, including
+// the spots for the callee-saved registers.
+int64_t x86Frame::stack_adjustment(void) const {
+    if (frameless) {
+        // The red zone starts at %rsp, which is 8 bytes above where %rbp would be, so offsets from %rbp only get to use
+        // all but 8 bytes of it.
+        return std::max<int64_t>(0, -lowest_offset - (RED_ZONE_SIZE - 8));
+    }
+    return -lowest_offset;
+}
 
-                std::string incoming_block_label;
-                llvm::raw_string_ostream rsos(incoming_block_label);
-                incoming_block->printAsOperand(rsos, false);
-                incoming_block_label = rsos.str(); // This isn't necessary in llvm 13, but llvm 10 has a bug that requires this.
+x86FrameRegister::x86FrameRegister(x86Frame const &frame) : x86Register("rbp"), frame{frame} {
+}
 
-                incoming_block_label.replace(0, 1, "_block_");
-                incoming_block_label = std::string("__") + std::string(incoming_block->getParent()->getName()) + incoming_block_label;
+void x86FrameRegister::print_as_pointer(llvm::raw_ostream &os, int64_t offset) const {
+    if (frame.frameless) {
+        // %rsp never moves after the prologue in a leaf function, and %rbp would have been 8 bytes below it.
+        os << offset - 8 + frame.stack_adjustment() << "(%rsp)";
+    }
+    else {
+        x86Register::print_as_pointer(os, offset);
+    }
+}
 
-                phi_node_labels.insert(
-                    {{incoming_block, &block}, new x86Label(std::string("__PHI_FROM_") + incoming_block_label + std::string("_TO_") + block_label)});
-            }
+x86Prologue::x86Prologue(x86Frame const &frame) : frame{frame} {
+}
+
+// Every callee-saved register has its own spot in the frame, but only the ones the function uses get saved there.
+void x86Prologue::print(llvm::raw_ostream &os) const {
+    if (!frame.frameless) {
+        x86SrcInstruction("pushq", new x86Register("rbp")).print(os);
+        x86SrcDstInstruction("movq", new x86Register("rsp"), new x86Register("rbp")).print(os);
+    }
+    if (frame.stack_adjustment() > 0) {
+        x86SrcDstInstruction("subq", new x86Immediate(frame.stack_adjustment()), new x86Register("rsp")).print(os);
+    }
+    for (std::string const &register_name : frame.saved_registers()) {
+        x86SrcDstInstruction("movq", new x86Register(register_name), new x86Pointer(frame.base, frame.saved_register_offset(register_name))).print(os);
+    }
+}
+
+x86Epilogue::x86Epilogue(x86Frame const &frame) : frame{frame} {
+}
+
+void x86Epilogue::print(llvm::raw_ostream &os) const {
+    std::vector<std::string> saved = frame.saved_registers();
+    for (auto it = saved.rbegin(); it != saved.rend(); it++) {
+        x86SrcDstInstruction("movq", new x86Pointer(frame.base, frame.saved_register_offset(*it)), new x86Register(*it)).print(os);
+    }
+
+    if (frame.frameless) {
+        if (frame.stack_adjustment() > 0) {
+            x86SrcDstInstruction("addq", new x86Immediate(frame.stack_adjustment()), new x86Register("rsp")).print(os);
+        }
+    }
+    else {
+        x86NoArgInstruction("leaveq").print(os);
+    }
+}
+
+// Makes the labels for the blocks of @function and the phi edges into them, right before it gets generated.
+// They all go into the instructions, so they get deleted along with them once the function has been printed.
+void x86Program::make_labels(llvm::Function const &function) {
+    for (llvm::BasicBlock const &block : function) {
+        // The first block of a function should be labelled with the function's name.
+        if (is_entry_block(block)) {
+            labels.insert({&block, new x86Label(std::string(function.getName()))});
+        }
+        else {
+            // Otherwise, just give it a unique name.
+            std::string label;
+            llvm::raw_string_ostream rsos(label);
+            block.printAsOperand(rsos, false);
+            label = rsos.str(); // This isn't necessary in llvm 13, but llvm 10 has a bug that requires this.
+
+            label.replace(0, 1, "_block_");
+            label = std::string("__") + std::string(function.getName()) + label;
+            labels.insert({&block, new x86Label(label)});
+        }
+
+        // Grab this block's name
+        std::string block_label = labels[&block]->get_name();
+
+        for (llvm::BasicBlock const *incoming_block : phi_incoming_blocks(block)) {
+            // Make the incoming block's name
+            // It might already exist, but who cares? It doesn't take long to make a string.
+
+            std::string incoming_block_label;
+            llvm::raw_string_ostream rsos(incoming_block_label);
+            incoming_block->printAsOperand(rsos, false);
+            incoming_block_label = rsos.str(); // This isn't necessary in llvm 13, but llvm 10 has a bug that requires this.
+
+            incoming_block_label.replace(0, 1, "_block_");
+            incoming_block_label = std::string("__") + std::string(incoming_block->getParent()->getName()) + incoming_block_label;
+
+            phi_node_labels.insert(
+                {{incoming_block, &block}, new x86Label(std::string("__PHI_FROM_") + incoming_block_label + std::string("_TO_") + block_label)});
         }
     }
+}
+
+// Returns the label that calls to @function go to.
+x86Label *x86Program::function_label(llvm::Function const &function) {
+    auto it = function_labels.find(&function);
+    if (it == function_labels.end()) {
+        it = function_labels.insert({&function, new x86Label(std::string(function.getName()))}).first;
+    }
+    return it->second;
+}
+
+// Constructs the program.
+// Note: It's on you to put the labels in `instructions` in the appropriate places.
+x86Program::x86Program(llvm::Module const &module, x86Options const &options) : options{options} {
+    // Block labels get made one function at a time by make_labels, but calls can go to functions that haven't been
+    // generated yet, so those just use labels with the function's name.
+    llvm::Function const *main_function = module.getFunction("main");
+    x86Label *main_label = nullptr;
+    if (main_function != nullptr && !main_function->isDeclaration()) {
+        main_label = function_label(*main_function);
+    }
 
-    // Make the register slots
+    // Make the register slots. They get put into the queue by begin_function.
     for (auto const &[register_name, priority] : REGISTER_PRIORITIES) {
-        x86Destination *d = new x86Register(register_name);
-        available_slots.push({priority, d});
-        all_slots.insert(d);
+        x86Register *r = new x86Register(register_name);
+        register_slots.insert({register_name, r});
+        all_slots.insert(r);
     }
+    x86Register *frame_pointer = new x86Register(FRAME_POINTER_PRIORITY.first);
+    register_slots.insert({FRAME_POINTER_PRIORITY.first, frame_pointer});
+    all_slots.insert(frame_pointer);
 
     // Make sure there's a main
     if (main_label == nullptr) {
@@ -283,289 +584,714 @@ x86Program::x86Program(llvm::Module const &module) {
     insert_instruction(new x86LblInstruction("callq", main_label));
     insert_instruction(new x86Comment("taking main's return value and putting it in %rbx to act as program exit code"));
     insert_instruction(new x86SrcDstInstruction("movq", new x86Register("rax"), new x86Register("rbx")));
+    if (options.instrument) {
+        insert_profile_writer();
+    }
+    if (options.time_functions) {
+        insert_timing_report(module);
+    }
     insert_instruction(new x86Comment("1 is the linux interrupt code for exit"));
     insert_instruction(new x86SrcDstInstruction("movq", new x86Immediate(1), new x86Register("rax")));
     insert_instruction(new x86Comment("passing control to the kernel"));
     insert_instruction(new x86ImmInstruction("int", new x86Immediate(0x80)));
+
+    if (options.time_functions) {
+        insert_number_printer();
+    }
 }
 
 x86Program::~x86Program(void) {
-    for (x86Instruction *instruction : instructions) {
-        delete instruction;
+    release_function();
+
+    for (x86Instruction *data : zeroed_data) {
+        delete data;
     }
 
     for (x86Source const *destination : all_slots) {
         delete destination;
     }
+    // The next program this thread generates starts from scratch.
+    all_slots.clear();
 
-    // Will be a memory leak if this object doesn't have all of its labels in its instructions vector.
+    for (auto const &[function, label] : function_labels) {
+        delete label;
+    }
 }
 
-void x86Program::print(llvm::raw_ostream &os) const {
+// Prints everything that's been generated since the last flush, and then frees it all, so that memory use only ever
+// depends on the size of the biggest function. The constant data for each function goes right after it.
+void x86Program::flush(llvm::raw_ostream &os) {
     for (x86Instruction *instruction : instructions) {
         instruction->print(os);
     }
-}
 
-x86Destination *x86Program::acquire_slot(llvm::Value const &instruction) {
-    llvm::errs() << "Acquiring slot for ";
-    instruction.print(llvm::errs());
-    llvm::errs() << "\n";
-    if (available_slots.empty()) {
-        top_of_stack -= 8;
-        slot s{-top_of_stack, new x86Pointer(new x86Register("rbp"), top_of_stack)};
-        available_slots.push(s);
-        all_slots.insert(s.second);
-        insert_instruction(new x86SrcDstInstruction("sub", new x86Immediate(8), new x86Register("rsp")));
+    if (!read_only_data.empty()) {
+        x86Directive(".section .rodata").print(os);
+        for (x86Instruction *data : read_only_data) {
+            data->print(os);
+        }
+        x86Directive(".text").print(os);
     }
-    slot s = available_slots.top();
-    available_slots.pop();
-    used_slots.insert({&instruction, s});
-
-    return s.second;
-}
 
-x86Destination *x86Program::query_slot(llvm::Value const &instruction) {
-    return used_slots[&instruction].second;
+    release_function();
 }
 
-void x86Program::release_slot(llvm::Value const &instruction) {
-    slot s = used_slots[&instruction];
-    used_slots.erase(&instruction);
-    available_slots.push(s);
-}
+// Frees the instructions and constant data, and everything that belonged to the functions they came from: their
+// labels, frames and slots. Only the register slots are shared between functions, so they stay.
+void x86Program::release_function(void) {
+    for (x86Instruction *instruction : instructions) {
+        delete instruction;
+    }
+    instructions.clear();
 
-void x86Program::back_up_slots(x86Label *label) {
-    slot_backups.insert({label, {available_slots, used_slots}});
-}
+    for (x86Instruction *data : read_only_data) {
+        delete data;
+    }
+    read_only_data.clear();
 
-void x86Program::restore_slots(x86Label *label) {
-    auto &backup = slot_backups[label];
-    available_slots = backup.first; // These are deliberately making copies
-    used_slots = backup.second;     // These are deliberately making copies
-    slot_backups.erase(label);
-}
+    std::set<x86Source *> registers;
+    for (auto const &[register_name, r] : register_slots) {
+        registers.insert(r);
+    }
+    for (x86Source *slot : all_slots) {
+        if (registers.count(slot) == 0) {
+            delete slot;
+        }
+    }
+    all_slots = registers;
 
-void x86Program::insert_instruction(x86Instruction *instruction) {
-    instructions.push_back(instruction);
+    for (x86Frame *f : frames) {
+        delete f;
+    }
+    frames.clear();
+    frame = nullptr;
+
+    labels.clear();
+    phi_node_labels.clear();
+    cold_blocks.clear();
+    back_edges.clear();
+    used_slots.clear();
+    rematerialized.clear();
+    stack_allocations.clear();
+    loop_depths.clear();
 }
 
-void x86Program::handle_block_begin(llvm::BasicBlock const &block) {
-    // Insert the label for this block.
-    // Even if there are phi nodes, I'm still leaving this here because it's easier.
-    insert_instruction(labels[&block]);
+// Prints whatever hasn't been printed yet, followed by the zeroed data, which has to wait until the end since it's
+// shared by the whole program.
+void x86Program::print(llvm::raw_ostream &os) {
+    flush(os);
 
-    // If we have a slot backup for this block, restore from it.
-    if (contains(slot_backups, labels[&block])) {
-        llvm::errs() << "Restoring the slots.\n";
-        restore_slots(labels[&block]);
+    if (!zeroed_data.empty()) {
+        x86Directive(".section .bss").print(os);
+        for (x86Instruction *data : zeroed_data) {
+            data->print(os);
+        }
     }
+}
 
-    if (is_entry_block(block)) {
-        // Reset the stack.
-        top_of_stack = -40;
-
-        std::string function_name = labels[&block]->get_name();
-        insert_instruction(new x86Comment("function prologue for " + function_name));
-        insert_instruction(new x86SrcInstruction("pushq", new x86Register("rbp")));
-        insert_instruction(new x86SrcDstInstruction("movq", new x86Register("rsp"), new x86Register("rbp")));
+// Prints how many cycles each function took and how many times it got called to stderr, out of _start. Functions that
+// never got called are left out. The cycles are inclusive, so they count everything a function called too, but only
+// from the outermost call of a recursive function, so its recursive calls aren't counted again.
+void x86Program::insert_timing_report(llvm::Module const &module) {
+    timing_cycles = new x86Label("__TIMING_CYCLES");
+    timing_calls = new x86Label("__TIMING_CALLS");
+    timing_depths = new x86Label("__TIMING_DEPTHS");
+    timing_starts = new x86Label("__TIMING_STARTS");
+    number_printer = new x86Label("__TIMING_PRINT_NUMBER");
+    for (llvm::Function const &function : module) {
+        if (!function.isDeclaration()) {
+            timing_indices.insert({&function, timing_indices.size()});
+        }
+    }
 
-        insert_instruction(new x86Comment("pushing callee-saved registers for start of " + function_name));
-        for (std::string register_name : CALLEE_SAVED_REGISTERS) {
-            insert_instruction(new x86SrcInstruction("pushq", new x86Register(register_name)));
+    zeroed_data.push_back(new x86Directive(".p2align 3"));
+    zeroed_data.push_back(timing_cycles);
+    zeroed_data.push_back(new x86Directive(".zero " + std::to_string(8 * timing_indices.size())));
+    zeroed_data.push_back(timing_calls);
+    zeroed_data.push_back(new x86Directive(".zero " + std::to_string(8 * timing_indices.size())));
+    zeroed_data.push_back(timing_depths);
+    zeroed_data.push_back(new x86Directive(".zero " + std::to_string(8 * timing_indices.size())));
+    zeroed_data.push_back(timing_starts);
+    zeroed_data.push_back(new x86Directive(".zero " + std::to_string(8 * timing_indices.size())));
+
+    // Puts @text in .rodata under @name, and writes it to stderr.
+    auto write_text = [&](std::string const &name, std::string const &text) {
+        x86Label *label = new x86Label(name);
+        read_only_data.push_back(label);
+        std::string escaped;
+        for (char c : text) {
+            escaped += c == '\n' ? std::string("\\n") : std::string(1, c);
         }
+        read_only_data.push_back(new x86Directive(".ascii \"" + escaped + "\""));
 
-        // Remember that all functions have at most 1 argument
-        if (block.getParent()->arg_size() == 1) {
-            llvm::Value const &arg = *block.getParent()->arg_begin();
+        insert_instruction(new x86SrcDstInstruction("movq", new x86Immediate(1), new x86Register("rax")));
+        insert_instruction(new x86SrcDstInstruction("movq", new x86Immediate(2), new x86Register("rdi")));
+        insert_instruction(new x86SrcDstInstruction("leaq", new x86LabelPointer(label), new x86Register("rsi")));
+        insert_instruction(new x86SrcDstInstruction("movq", new x86Immediate(text.size()), new x86Register("rdx")));
+        insert_instruction(new x86NoArgInstruction("syscall"));
+    };
 
-            // Save the arg in a slot
-            if (!arg.use_empty()) {
-                insert_instruction(new x86Comment("saving the argument to " + function_name));
-                insert_instruction(new x86SrcDstInstruction("movq", new x86Register("rdi"), acquire_slot(arg)));
-            }
+    insert_instruction(new x86Comment("printing how long each function took to stderr"));
+    write_text("__TIMING_HEADER", "inclusive cycles per function:\n");
+    for (llvm::Function const &function : module) {
+        if (function.isDeclaration()) {
+            continue;
         }
+        size_t index = timing_indices[&function];
+        std::string name(function.getName());
+        x86Label *skip = new x86Label("__TIMING_SKIP_" + name);
+        insert_instruction(new x86SrcDstInstruction("cmpq", new x86Immediate(0), new x86LabelPointer(timing_calls, 8 * index)));
+        insert_instruction(new x86LblInstruction("je", skip));
+        write_text("__TIMING_NAME_" + name, "  " + name + ": ");
+        insert_instruction(new x86SrcDstInstruction("movq", new x86LabelPointer(timing_cycles, 8 * index), new x86Register("rax")));
+        insert_instruction(new x86LblInstruction("callq", number_printer));
+        write_text("__TIMING_CYCLES_TEXT_" + name, " cycles in ");
+        insert_instruction(new x86SrcDstInstruction("movq", new x86LabelPointer(timing_calls, 8 * index), new x86Register("rax")));
+        insert_instruction(new x86LblInstruction("callq", number_printer));
+        write_text("__TIMING_CALLS_TEXT_" + name, " calls\n");
+        insert_instruction(skip);
     }
+}
 
-    if (block_starts_with_phi(block)) {
-        // Make the set of incoming blocks and the set of phi nodes
-        // Also acquire a slot for each phi node that has uses.
-        std::set<llvm::BasicBlock const *> incoming_blocks_to_phi_batch; // set for deduplication
-        std::vector<llvm::PHINode const *> phi_nodes;
-        for (llvm::Instruction const &instruction : block) {
-            if (!llvm::isa<llvm::PHINode>(instruction)) {
-                break;
-            }
-            llvm::PHINode const &phi_instruction = llvm::cast<llvm::PHINode>(instruction);
-
-            phi_nodes.push_back(&phi_instruction);
+// Makes the routine that the timing report calls to write %rax to stderr in decimal. It builds the digits backwards
+// at the end of a buffer in .bss. Clobbers %rax, %rcx, %rdx, %rsi, %rdi and %r11.
+void x86Program::insert_number_printer(void) {
+    x86Label *buffer = new x86Label("__TIMING_DIGITS");
+    x86Label *digit = new x86Label("__TIMING_NEXT_DIGIT");
+    zeroed_data.push_back(buffer);
+    zeroed_data.push_back(new x86Directive(".zero 32"));
+
+    insert_instruction(number_printer);
+    insert_instruction(new x86SrcDstInstruction("leaq", new x86LabelPointer(buffer, 32), new x86Register("rsi")));
+    insert_instruction(new x86SrcDstInstruction("movq", new x86Immediate(10), new x86Register("rcx")));
+    insert_instruction(digit);
+    insert_instruction(new x86SrcDstInstruction("xorl", new x86Register("edx"), new x86Register("edx")));
+    insert_instruction(new x86SrcInstruction("divq", new x86Register("rcx")));
+    insert_instruction(new x86SrcDstInstruction("addb", new x86Immediate('0'), new x86Register("dl")));
+    insert_instruction(new x86DstInstruction("decq", new x86Register("rsi")));
+    insert_instruction(new x86SrcDstInstruction("movb", new x86Register("dl"), new x86Pointer(new x86Register("rsi"), 0)));
+    insert_instruction(new x86SrcDstInstruction("testq", new x86Register("rax"), new x86Register("rax")));
+    insert_instruction(new x86LblInstruction("jne", digit));
+    insert_instruction(new x86SrcDstInstruction("leaq", new x86LabelPointer(buffer, 32), new x86Register("rdx")));
+    insert_instruction(new x86SrcDstInstruction("subq", new x86Register("rsi"), new x86Register("rdx")));
+    insert_instruction(new x86SrcDstInstruction("movq", new x86Immediate(1), new x86Register("rax")));
+    insert_instruction(new x86SrcDstInstruction("movq", new x86Immediate(2), new x86Register("rdi")));
+    insert_instruction(new x86NoArgInstruction("syscall"));
+    insert_instruction(new x86NoArgInstruction("retq"));
+}
 
-            // Note that we drop the slot on the ground here, but we'll pick it up with query_slot when we loop over the set.
-            if (!phi_instruction.use_empty()) {
-                acquire_slot(phi_instruction);
-            }
+// Leaves the full 64-bit time stamp counter in %rax. Clobbers %rdx.
+void x86Program::insert_time_stamp(void) {
+    insert_instruction(new x86NoArgInstruction("rdtsc"));
+    insert_instruction(new x86SrcDstInstruction("shlq", new x86Immediate(32), new x86Register("rdx")));
+    insert_instruction(new x86SrcDstInstruction("orq", new x86Register("rdx"), new x86Register("rax")));
+}
 
-            for (llvm::BasicBlock const *incoming_block : phi_instruction.blocks()) {
-                incoming_blocks_to_phi_batch.insert(incoming_block);
-            }
+// Writes the profile out of _start, after main has returned and before the program exits. The file is a header of
+// "CGPROF01" and the number of counters, followed by the counters themselves, all as quadwords. Nothing here touches
+// %rbx, which is holding the exit code.
+void x86Program::insert_profile_writer(void) {
+    profile_counters = new x86Label("__PROFILE_COUNTERS");
+    x86Label *header = new x86Label("__PROFILE_HEADER");
+    x86Label *path = new x86Label("__PROFILE_PATH");
+    x86Label *done = new x86Label("__PROFILE_DONE");
+
+    std::string escaped_path;
+    for (char c : options.profile_path) {
+        if (c == '"' || c == '\\') {
+            escaped_path += '\\';
         }
+        escaped_path += c;
+    }
 
-        x86Label *phi_done = new x86Label(std::string("__PHI_DONE_") + labels[&block]->get_name());
-
-        // Actually generate the code for the phi instructions.
-        for (llvm::BasicBlock const *incoming_block : incoming_blocks_to_phi_batch) {
-            if (contains(phi_node_labels, {incoming_block, &block})) {
-                // The label for this phi edge:
-                insert_instruction(phi_node_labels[{incoming_block, &block}]);
+    read_only_data.push_back(header);
+    read_only_data.push_back(new x86Directive(".ascii \"CGPROF01\""));
+    read_only_data.push_back(new x86Directive(".quad " + std::to_string(options.counter_count)));
+    read_only_data.push_back(path);
+    read_only_data.push_back(new x86Directive(".asciz \"" + escaped_path + "\""));
+    zeroed_data.push_back(new x86Directive(".p2align 3"));
+    zeroed_data.push_back(profile_counters);
+    zeroed_data.push_back(new x86Directive(".zero " + std::to_string(8 * options.counter_count)));
+
+    insert_instruction(new x86Comment("writing the profile: open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)"));
+    insert_instruction(new x86SrcDstInstruction("movq", new x86Immediate(2), new x86Register("rax")));
+    insert_instruction(new x86SrcDstInstruction("leaq", new x86LabelPointer(path), new x86Register("rdi")));
+    insert_instruction(new x86SrcDstInstruction("movq", new x86Immediate(01 | 0100 | 01000), new x86Register("rsi")));
+    insert_instruction(new x86SrcDstInstruction("movq", new x86Immediate(0644), new x86Register("rdx")));
+    insert_instruction(new x86NoArgInstruction("syscall"));
+    insert_instruction(new x86Comment("if it didn't open, the program still gets to exit normally"));
+    insert_instruction(new x86SrcDstInstruction("testq", new x86Register("rax"), new x86Register("rax")));
+    insert_instruction(new x86LblInstruction("js", done));
+    insert_instruction(new x86SrcDstInstruction("movq", new x86Register("rax"), new x86Register("r12")));
+
+    // write(fd, header, 16), then write(fd, counters, 8 * count)
+    std::vector<std::pair<x86Label *, int64_t>> pieces{{header, 16}, {profile_counters, 8 * (int64_t)options.counter_count}};
+    for (auto const &[label, size] : pieces) {
+        insert_instruction(new x86SrcDstInstruction("movq", new x86Immediate(1), new x86Register("rax")));
+        insert_instruction(new x86SrcDstInstruction("movq", new x86Register("r12"), new x86Register("rdi")));
+        insert_instruction(new x86SrcDstInstruction("leaq", new x86LabelPointer(label), new x86Register("rsi")));
+        insert_instruction(new x86SrcDstInstruction("movq", new x86Immediate(size), new x86Register("rdx")));
+        insert_instruction(new x86NoArgInstruction("syscall"));
+    }
 
-                // For each phi node,
-                for (llvm::PHINode const *phi_node : phi_nodes) {
-                    // if this block is actually a predecessor of the phi node,
-                    if (phi_node->getBasicBlockIndex(incoming_block) != -1 && !phi_node->use_empty()) {
-                        // grab the correct value for the phi node given the incoming block
-                        llvm::Value const *incoming_value = phi_node->getIncomingValueForBlock(incoming_block);
+    insert_instruction(new x86SrcDstInstruction("movq", new x86Immediate(3), new x86Register("rax")));
+    insert_instruction(new x86SrcDstInstruction("movq", new x86Register("r12"), new x86Register("rdi")));
+    insert_instruction(new x86NoArgInstruction("syscall"));
+    insert_instruction(done);
+}
 
-                        x86Source *src = nullptr;
-                        if (llvm::isa<llvm::ConstantInt>(incoming_value)) {
-                            llvm::ConstantInt const &incoming_const_int = *llvm::cast<llvm::ConstantInt>(incoming_value);
-                            src = new x86Immediate(incoming_const_int);
-                        }
-                        else {
-                            src = query_slot(*incoming_value);
-                        }
+// Puts in @function's code, which has already been generated and printed, instead of generating it. @text is the
+// instructions and @data is whatever it had in .rodata.
+void x86Program::insert_generated_function(llvm::Function const &function, std::string const &text, std::string const &data,
+                                           x86RegisterSet function_clobbers) {
+    insert_instruction(new x86Comment("the code for " + std::string(function.getName()) + " came out of the cache"));
+    clobbers[&function] = function_clobbers;
+    insert_instruction(new x86Text(text));
+    if (!data.empty()) {
+        read_only_data.push_back(new x86Text(data));
+    }
+}
 
-                        insert_instruction(new x86SrcDstInstruction("movq", src, query_slot(*phi_node)));
-                    }
-                }
-                insert_instruction(new x86LblInstruction("jmp", phi_done));
-            }
-        }
+// Sets up the frame and the slots for a new function. Called at the start of its entry block.
+void x86Program::begin_function(llvm::Function const &function) {
+    // Leaf functions never move %rsp, so they can keep their slots in the red zone and skip setting up %rbp.
+    bool frameless = is_leaf_function(function);
 
-        // Put in the phi_done label.
-        insert_instruction(phi_done);
+    std::vector<std::string> callee_saved_registers = CALLEE_SAVED_REGISTERS;
+    if (frameless) {
+        callee_saved_registers.push_back(FRAME_POINTER_PRIORITY.first);
     }
-}
 
-// Helper method to x86Program::dust_out_slots
-// Returns whether @instruction uses @value
-bool instruction_makes_use_of(llvm::Instruction const &instruction, llvm::Value const *value) {
-    // for (llvm::User const *user : value->users()) {
-    //     if (&instruction == user) {
-    //         return true;
-    //     }
-    // }
+    frame = new x86Frame(frameless, callee_saved_registers);
+    frames.push_back(frame);
 
-    for (llvm::Value const *operand : instruction.operands()) {
-        if (operand == value) {
-            return true;
-        }
+    // Reset the stack.
+    top_of_stack = frame->lowest_offset;
+
+    // Every function starts out with all the registers free. Stack slots from other functions aren't any good here.
+    available_slots = decltype(available_slots)();
+    used_slots.clear();
+    rematerialized.clear();
+    stack_allocations.clear();
+    for (auto const &[register_name, priority] : frameless ? LEAF_REGISTER_PRIORITIES : REGISTER_PRIORITIES) {
+        available_slots.push({(int64_t)priority, register_slots[register_name]});
+    }
+    if (frameless) {
+        available_slots.push({FRAME_POINTER_PRIORITY.second, register_slots[FRAME_POINTER_PRIORITY.first]});
     }
 
-    return false;
+    // Decide where every value in the function is going to live before we generate any of it.
+    allocate_slots(function);
 }
 
-// Helper method to x86Program::dust_out_slots
-// Returns whether @value has any uses reachable from just after @it (i.e. not including @it)
-bool recursively_check_for_uses(llvm::BasicBlock const *block, llvm::Value const *value, std::set<llvm::BasicBlock const *> &seen) {
-    if (value->isUsedInBasicBlock(block)) {
-        return true;
+// Returns the slot that allocate_slots planned for @value, which is about to get its value.
+x86Destination *x86Program::acquire_slot(llvm::Value const &value) {
+    if (options.trace) {
+        llvm::errs() << "Acquiring slot for ";
+        value.print(llvm::errs());
+        llvm::errs() << "\n";
     }
-
-    llvm::Instruction const &terminator = *block->getTerminator();
-    for (int i = 0; i < terminator.getNumSuccessors(); i++) {
-        llvm::BasicBlock const *child_block = terminator.getSuccessor(i);
-        if (!contains(seen, child_block)) {
-            seen.insert(child_block);
-            if (recursively_check_for_uses(child_block, value, seen)) {
-                return true;
-            }
-        }
+    if (!contains(used_slots, &value)) {
+        // Somebody asked for a slot for something that the allocator didn't think needed one.
+        llvm::errs() << "ERROR: NO SLOT WAS PLANNED FOR THIS VALUE.\n";
+        used_slots.insert({&value, take_slot()});
     }
+    return used_slots[&value].second;
+}
 
-    return false;
+x86Destination *x86Program::query_slot(llvm::Value const &instruction) {
+    return used_slots[&instruction].second;
 }
 
-// Helper method to x86Program::dust_out_slots
-// Returns whether @value has any uses reachable from just after @it (i.e. not including @it)
-bool has_reachable_uses(llvm::BasicBlock::const_iterator it, llvm::Value const *value) {
-    while (!it->isTerminator()) {
-        it++;
-        if (instruction_makes_use_of(*it, value)) {
-            return true;
-        }
+// Returns the constant that @value is, if it's a constant or allocate_slots decided to rematerialize it, or else null.
+llvm::ConstantInt const *x86Program::constant_value(llvm::Value const &value) {
+    auto it = rematerialized.find(&value);
+    if (it != rematerialized.end()) {
+        return it->second;
     }
+    return llvm::dyn_cast<llvm::ConstantInt>(&value);
+}
 
-    // Note that `seen` starts out empty, so we may revisit the starting block if there's a loop.
-    // This is actually good because if we can revisit the starting block, then there's definitely a reachable use.
-    // (i.e. @it's instruction)
-    std::set<llvm::BasicBlock const *> seen;
-
-    // The terminator instruction of the block we started in
-    llvm::Instruction const &terminator = llvm::cast<llvm::Instruction>(*it);
-    for (int i = 0; i < terminator.getNumSuccessors(); i++) {
-        llvm::BasicBlock const *child_block = terminator.getSuccessor(i);
-        if (!contains(seen, child_block)) {
-            seen.insert(child_block);
-            if (recursively_check_for_uses(child_block, value, seen)) {
-                return true;
-            }
-        }
+// Returns a source operand for @value: an immediate if it's a constant, or else the slot it lives in.
+x86Source *x86Program::query_source(llvm::Value const &value) {
+    if (llvm::ConstantInt const *constant = constant_value(value)) {
+        return new x86Immediate(*constant);
     }
+    return query_slot(value);
+}
 
-    return false;
+void x86Program::insert_instruction(x86Instruction *instruction) {
+    instructions.push_back(instruction);
 }
 
-// Try to clear out any slots made unnecessary after generating assembly from @it.
-void x86Program::dust_out_slots(llvm::BasicBlock::const_iterator it) {
-    std::vector<llvm::Value const *> values_to_try;
-    for (auto const &[value, _] : used_slots) {
-        values_to_try.push_back(value);
+// Returns the name of the register that @source is, or "" if it isn't a register.
+static std::string register_name_of(x86Source const *source) {
+    if (source->type == x86Source::REG) {
+        return static_cast<x86Register const *>(source)->name;
     }
+    return "";
+}
 
-    for (llvm::Value const *value : values_to_try) {
-        // If this operand takes up a slot and has no reachable uses from here,
-        if (contains(used_slots, value) && !has_reachable_uses(it, value)) {
-            llvm::errs() << "Releasing the slot for ";
-            value->print(llvm::errs());
-            llvm::errs() << "\n";
-            release_slot(*value);
-        }
+// Returns whether @a and @b are the same register or the same piece of memory.
+static bool same_location(x86Source const *a, x86Source const *b) {
+    if (a->type == x86Source::REG && b->type == x86Source::REG) {
+        return register_name_of(a) == register_name_of(b);
+    }
+    if (a->type == x86Source::REG_PTR && b->type == x86Source::REG_PTR) {
+        x86Pointer const *pa = static_cast<x86Pointer const *>(a);
+        x86Pointer const *pb = static_cast<x86Pointer const *>(b);
+        return pa->offset == pb->offset && same_location(pa->address, pb->address);
     }
+    return false;
 }
 
-void x86Program::handle_ret(llvm::BasicBlock::const_iterator it) {
+// Moves @source into @destination, @bits wide, going through %rax if they're both in memory.
+// Zeroing a register is done with xor, which clobbers the flags, so pass @keep_flags if somebody still needs them.
+void x86Program::insert_move(x86Source *source, x86Destination *destination, unsigned bits, bool keep_flags) {
+    std::string opcode = "mov" + size_suffix(bits);
+
+    if (same_location(source, destination)) {
+        if (all_slots.count(source) == 0) {
+            delete source;
+        }
+        if (all_slots.count(destination) == 0) {
+            delete destination;
+        }
+        return;
+    }
+
+    if (source->type == x86Source::IMM) {
+        int64_t val = static_cast<x86Immediate *>(source)->val;
+        if (val == 0 && destination->type == x86Source::REG && !keep_flags) {
+            // Writing the 32-bit register clears the top half too, so this works for 64-bit zeros as well.
+            delete source;
+            x86Register *zeroed = static_cast<x86Register *>(sized(destination, 32));
+            insert_instruction(new x86SrcDstInstruction("xorl", zeroed, new x86Register(zeroed->name)));
+            return;
+        }
+        // Only a register can take a full 64-bit immediate (that's movabsq), so anything else goes through %rax.
+        if (bits > 32 && wide_immediate(source) && destination->type != x86Source::REG) {
+            insert_instruction(new x86SrcDstInstruction("movq", source, new x86Register("rax")));
+            source = new x86Register("rax");
+        }
+    }
+    else if (source->type != x86Source::REG && destination->type != x86Source::REG) {
+        insert_instruction(new x86SrcDstInstruction(opcode, source, sized(new x86Register("rax"), bits)));
+        source = new x86Register("rax");
+    }
+
+    insert_instruction(new x86SrcDstInstruction(opcode, sized(source, bits), sized(destination, bits)));
+}
+
+// Moves each source into its destination as if all the moves happened at once.
+// A move can go as soon as nobody else still needs to read its destination. If every remaining move is stuck, they
+// form a cycle, so we park one of the destinations somewhere else to break it. That's %rax if the cycle is all
+// registers. Otherwise it's the scratch slot, since moving memory to memory already needs %rax.
+// Constants might get zeroed with xor, so don't count on the flags surviving this.
+void x86Program::insert_parallel_move(std::vector<std::pair<x86Source *, x86Destination *>> moves) {
+    // Moves from somewhere to itself don't need to happen.
+    std::vector<std::pair<x86Source *, x86Destination *>> pending;
+    for (auto const &move : moves) {
+        if (same_location(move.first, move.second)) {
+            if (!contains(all_slots, (x86Source *)move.second)) {
+                delete move.second;
+            }
+        }
+        else {
+            pending.push_back(move);
+        }
+    }
+
+    while (!pending.empty()) {
+        bool progress = false;
+        for (size_t i = 0; i < pending.size(); i++) {
+            bool blocked = false;
+            for (size_t j = 0; j < pending.size(); j++) {
+                if (j != i && same_location(pending[j].first, pending[i].second)) {
+                    blocked = true;
+                    break;
+                }
+            }
+            if (!blocked) {
+                // Constants only need to be as wide as they are. Everything else gets copied whole.
+                x86Source *source = pending[i].first;
+                unsigned bits = source->type == x86Source::IMM ? static_cast<x86Immediate *>(source)->bits : 64;
+                insert_move(source, pending[i].second, bits > 32 ? 64 : 32);
+                pending.erase(pending.begin() + i);
+                progress = true;
+                break;
+            }
+        }
+
+        if (!progress) {
+            // Everything left is part of a cycle.
+            bool all_registers = true;
+            for (auto const &move : pending) {
+                all_registers = all_registers && move.second->type == x86Source::REG;
+            }
+
+            // Note that the destination itself still belongs to its own move, so the instructions here get a copy.
+            x86Destination *parked = pending.front().second;
+            x86Source *parked_copy = parked->type == x86Source::REG ? new x86Register(register_name_of(parked)) : (x86Source *)parked;
+            if (all_registers) {
+                insert_instruction(new x86SrcDstInstruction("movq", parked_copy, new x86Register("rax")));
+            }
+            else if (parked->type != x86Source::REG) {
+                insert_instruction(new x86SrcDstInstruction("movq", parked_copy, new x86Register("rax")));
+                insert_instruction(new x86SrcDstInstruction("movq", new x86Register("rax"), scratch_slot()));
+            }
+            else {
+                insert_instruction(new x86SrcDstInstruction("movq", parked_copy, scratch_slot()));
+            }
+            for (auto &move : pending) {
+                if (same_location(move.first, parked)) {
+                    move.first = all_registers ? (x86Source *)new x86Register("rax") : (x86Source *)scratch_slot();
+                }
+            }
+        }
+    }
+}
+
+// Returns the block that gets generated right after @block, or null if there isn't one or it's on the other side of
+// the split between hot and cold code, since control can't fall from one section into the other.
+llvm::BasicBlock const *x86Program::next_block(llvm::BasicBlock const &block) {
+    llvm::BasicBlock const *next = block.getNextNode();
+    if (next == nullptr || contains(cold_blocks, next) != contains(cold_blocks, &block)) {
+        return nullptr;
+    }
+    return next;
+}
+
+// Returns the block that gets generated right before @block, or null if there isn't one or it's on the other side of
+// the split between hot and cold code.
+llvm::BasicBlock const *x86Program::previous_block(llvm::BasicBlock const &block) {
+    llvm::BasicBlock const *previous = block.getPrevNode();
+    if (previous == nullptr || contains(cold_blocks, previous) != contains(cold_blocks, &block)) {
+        return nullptr;
+    }
+    return previous;
+}
+
+// Goes back to .text after a function whose cold blocks went in .text.unlikely, which is where the next function and
+// the constant data expect to be.
+void x86Program::end_function(void) {
+    if (!cold_blocks.empty()) {
+        insert_instruction(new x86Directive(".text"));
+    }
+}
+
+void x86Program::handle_block_begin(llvm::BasicBlock const &block) {
+    // Functions start on a 16-byte boundary, and so do the tops of hot loops, as long as that doesn't take more than
+    // 10 bytes of padding. Loops with phi nodes get aligned where the back edge lands instead, which is its phi moves.
+    // The cold blocks are all at the end, so the first one switches sections for the rest.
+    bool loop_header = false;
+    for (llvm::BasicBlock const *predecessor : llvm::predecessors(&block)) {
+        loop_header = loop_header || contains(back_edges, {predecessor, &block});
+    }
+    if (is_entry_block(block)) {
+        insert_instruction(new x86Directive(".p2align 4"));
+    }
+    else if (contains(cold_blocks, &block)) {
+        if (previous_block(block) == nullptr) {
+            insert_instruction(new x86Directive(".section .text.unlikely"));
+        }
+    }
+    else if (loop_header && !block_starts_with_phi(block)) {
+        insert_instruction(new x86Directive(".p2align 4,,10"));
+    }
+
+    // Insert the label for this block.
+    // Even if there are phi nodes, I'm still leaving this here because it's easier.
+    insert_instruction(labels[&block]);
+
+    // Control can come in here from anywhere, so nothing's known about the flags.
+    flags = nullptr;
+
+    if (is_entry_block(block)) {
+        begin_function(*block.getParent());
+
+        std::string function_name = labels[&block]->get_name();
+        if (frame->frameless) {
+            insert_instruction(new x86Comment("leaf function prologue for " + function_name + " (no frame pointer, slots in the red zone)"));
+        }
+        else {
+            insert_instruction(new x86Comment("function prologue for " + function_name));
+        }
+        insert_instruction(new x86Prologue(*frame));
+
+        if (options.time_functions) {
+            // Only the outermost call notes the time, so the cycles of recursive calls don't get counted again.
+            size_t index = timing_indices[block.getParent()];
+            x86Label *started = new x86Label("__TIMING_STARTED_" + function_name);
+            insert_instruction(new x86Comment("noting when " + function_name + " got called, unless it already was (%rdx might be an argument)"));
+            insert_instruction(new x86DstInstruction("incq", new x86LabelPointer(timing_depths, 8 * index)));
+            insert_instruction(new x86SrcDstInstruction("cmpq", new x86Immediate(1), new x86LabelPointer(timing_depths, 8 * index)));
+            insert_instruction(new x86LblInstruction("jne", started));
+            insert_instruction(new x86SrcDstInstruction("movq", new x86Register("rdx"), scratch_slot()));
+            insert_time_stamp();
+            insert_instruction(new x86SrcDstInstruction("movq", scratch_slot(), new x86Register("rdx")));
+            insert_instruction(new x86SrcDstInstruction("movq", new x86Register("rax"), new x86LabelPointer(timing_starts, 8 * index)));
+            insert_instruction(started);
+        }
+
+        // Note that there's nothing to do for the arguments. allocate_slots already made their slots the places they
+        // arrive in.
+    }
+
+    if (block_starts_with_phi(block)) {
+        // Make the list of phi nodes
+        // Also acquire a slot for each phi node that has uses.
+        std::vector<llvm::PHINode const *> phi_nodes;
+        for (llvm::Instruction const &instruction : block) {
+            if (!llvm::isa<llvm::PHINode>(instruction)) {
+                break;
+            }
+            llvm::PHINode const &phi_instruction = llvm::cast<llvm::PHINode>(instruction);
+
+            phi_nodes.push_back(&phi_instruction);
+
+            // Note that we drop the slot on the ground here, but we'll pick it up with query_slot when we loop over the set.
+            if (!phi_instruction.use_empty() && rematerialized.count(&phi_instruction) == 0) {
+                acquire_slot(phi_instruction);
+            }
+        }
+
+        x86Label *phi_done = new x86Label(std::string("__PHI_DONE_") + labels[&block]->get_name());
+
+        // The block generated just before this one gets its moves first, so that it can fall through into them instead
+        // of jumping.
+        std::vector<llvm::BasicBlock const *> incoming_blocks;
+        llvm::BasicBlock const *previous = previous_block(block);
+        std::vector<llvm::BasicBlock const *> incoming_blocks_to_phi_batch = phi_incoming_blocks(block);
+        if (std::find(incoming_blocks_to_phi_batch.begin(), incoming_blocks_to_phi_batch.end(), previous) != incoming_blocks_to_phi_batch.end()) {
+            incoming_blocks.push_back(previous);
+        }
+        for (llvm::BasicBlock const *incoming_block : incoming_blocks_to_phi_batch) {
+            if (incoming_block != previous) {
+                incoming_blocks.push_back(incoming_block);
+            }
+        }
+
+        // Actually generate the code for the phi instructions. An edge with nothing to move doesn't get a trampoline: its
+        // label goes right on phi_done, so a loop that carries nothing in its back edge takes one jump per trip instead of
+        // two. The edge from the previous block keeps its place even if it's empty, since that block falls into it.
+        std::vector<x86Label *> empty_edges;
+        bool align_empty_edges = false;
+        bool jump_to_done = false;
+        for (llvm::BasicBlock const *incoming_block : incoming_blocks) {
+            if (contains(phi_node_labels, {incoming_block, &block})) {
+                x86Label *edge = phi_node_labels[{incoming_block, &block}];
+                size_t edge_start = instructions.size();
+                // The edge before this one jumps over it to phi_done.
+                if (jump_to_done) {
+                    insert_instruction(new x86LblInstruction("jmp", phi_done));
+                }
+
+                // The label for this phi edge:
+                bool align = incoming_block != incoming_blocks.front() && !contains(cold_blocks, &block) && contains(back_edges, {incoming_block, &block});
+                if (align) {
+                    insert_instruction(new x86Directive(".p2align 4,,10"));
+                }
+                insert_instruction(edge);
+                size_t moves_start = instructions.size();
+
+                // The phi nodes all take their values at once, and one phi node's slot might hold another one's
+                // incoming value, so this is a parallel move.
+                std::vector<std::pair<x86Source *, x86Destination *>> moves;
+                for (llvm::PHINode const *phi_node : phi_nodes) {
+                    // if this block is actually a predecessor of the phi node,
+                    if (phi_node->getBasicBlockIndex(incoming_block) != -1 && !phi_node->use_empty() &&
+                        rematerialized.count(phi_node) == 0) {
+                        // grab the correct value for the phi node given the incoming block
+                        llvm::Value const *incoming_value = phi_node->getIncomingValueForBlock(incoming_block);
+                        moves.push_back({query_source(*incoming_value), query_slot(*phi_node)});
+                    }
+                }
+                insert_parallel_move(moves);
+                if (contains(vector_loops, &block) && vector_loops[&block].preheader == incoming_block) {
+                    insert_vector_loop(block);
+                }
+
+                if (instructions.size() == moves_start && incoming_block != previous) {
+                    for (size_t i = edge_start; i < moves_start; i++) {
+                        if (instructions[i] != edge) {
+                            delete instructions[i];
+                        }
+                    }
+                    instructions.resize(edge_start);
+                    empty_edges.push_back(edge);
+                    align_empty_edges |= align;
+                } else {
+                    jump_to_done = true;
+                }
+            }
+        }
+
+        // The last trampoline falls straight through the empty edges' labels to phi_done.
+        if (align_empty_edges) {
+            insert_instruction(new x86Directive(".p2align 4,,10"));
+        }
+        for (x86Label *edge : empty_edges) {
+            insert_instruction(edge);
+        }
+        insert_instruction(phi_done);
+    }
+
+    insert_counters(options.counters_at_start, block);
+}
+
+// Bumps the profile counters that @sites puts at @block. Note that this clobbers the flags, so it only happens where
+// they're dead: at the start of a block, or right before an unconditional branch.
+void x86Program::insert_counters(std::map<llvm::BasicBlock const *, std::vector<size_t>> const &sites, llvm::BasicBlock const &block) {
+    auto it = sites.find(&block);
+    if (it == sites.end()) {
+        return;
+    }
+
+    insert_instruction(new x86Comment("counting this for the profile"));
+    for (size_t counter : it->second) {
+        insert_instruction(new x86DstInstruction("incq", new x86LabelPointer(profile_counters, 8 * counter)));
+    }
+    flags = nullptr;
+}
+
+void x86Program::handle_ret(llvm::BasicBlock::const_iterator it) {
     llvm::ReturnInst const &ret_instruction = llvm::cast<llvm::ReturnInst>(*it);
     llvm::Value const *return_value = ret_instruction.getReturnValue();
     if (return_value != nullptr) {
         insert_instruction(new x86Comment("sticking return value into %rax"));
-        if (llvm::isa<llvm::ConstantInt>(*return_value)) {
-            llvm::ConstantInt const &constant_int_return_value = llvm::cast<llvm::ConstantInt>(*return_value);
-            insert_instruction(new x86SrcDstInstruction("movq", new x86Immediate(constant_int_return_value), new x86Register("rax")));
-        }
-        else {
-            llvm::Value const &instruction_return_value = llvm::cast<llvm::Value>(*return_value);
-            insert_instruction(new x86SrcDstInstruction("movq", query_slot(instruction_return_value), new x86Register("rax")));
-        }
+        insert_move(query_source(*return_value), new x86Register("rax"), operation_width(return_value->getType()));
     }
 
-    insert_instruction(new x86Comment("popping callee-saved registers"));
-    int offset = -(8 * CALLEE_SAVED_REGISTERS.size());
-    for (auto it = CALLEE_SAVED_REGISTERS.rbegin(); it != CALLEE_SAVED_REGISTERS.rend(); it++) {
-        insert_instruction(new x86SrcDstInstruction("movq", new x86Pointer(new x86Register("rbp"), offset), new x86Register(*it)));
-        offset += 8;
+    if (options.time_functions) {
+        // %rcx is caller-saved, so it's free to hold the return value while we're leaving.
+        size_t index = timing_indices[it->getFunction()];
+        x86Label *nested = new x86Label("__TIMING_NESTED_" + labels[it->getParent()]->get_name());
+        insert_instruction(new x86Comment("adding up how long this call took, if it's the outermost one"));
+        insert_instruction(new x86DstInstruction("incq", new x86LabelPointer(timing_calls, 8 * index)));
+        insert_instruction(new x86DstInstruction("decq", new x86LabelPointer(timing_depths, 8 * index)));
+        insert_instruction(new x86LblInstruction("jne", nested));
+        insert_instruction(new x86SrcDstInstruction("movq", new x86Register("rax"), new x86Register("rcx")));
+        insert_time_stamp();
+        insert_instruction(new x86SrcDstInstruction("subq", new x86LabelPointer(timing_starts, 8 * index), new x86Register("rax")));
+        insert_instruction(new x86SrcDstInstruction("addq", new x86Register("rax"), new x86LabelPointer(timing_cycles, 8 * index)));
+        insert_instruction(new x86SrcDstInstruction("movq", new x86Register("rcx"), new x86Register("rax")));
+        insert_instruction(nested);
     }
 
-    insert_instruction(new x86Comment("tearing down the stack and returning"));
-    insert_instruction(new x86NoArgInstruction("leaveq"));
+    insert_instruction(new x86Comment("restoring callee-saved registers, tearing down the stack and returning"));
+    insert_instruction(new x86Epilogue(*frame));
     insert_instruction(new x86NoArgInstruction("retq"));
 }
 
 void x86Program::handle_call(llvm::BasicBlock::const_iterator it) {
     llvm::CallInst const &call_instruction = llvm::cast<llvm::CallInst>(*it);
 
-    llvm::BasicBlock const &entry_block = llvm::cast<llvm::Function>(*call_instruction.getCalledFunction()).getEntryBlock();
+    x86Label *callee = function_label(*call_instruction.getCalledFunction());
+
+    std::string const &function_name = callee->get_name();
 
-    std::string const &function_name = labels[&entry_block]->get_name();
+    flags = nullptr;
 
     // Push the caller-saved registers
     insert_instruction(new x86Comment("pushing caller-saved registers before call to " + function_name));
@@ -573,24 +1299,46 @@ void x86Program::handle_call(llvm::BasicBlock::const_iterator it) {
         insert_instruction(new x86SrcInstruction("pushq", new x86Register(register_name)));
     }
 
-    // Pass the argument if there is one.
-    // Remember that we are disallowing functions with more than one argument
-    if (call_instruction.arg_size() != 0) {
-        insert_instruction(new x86Comment("passing argument to " + function_name + " in %rdi"));
-        llvm::Value const *arg = call_instruction.arg_begin()->get();
-        x86Source *src = nullptr;
-        if (llvm::isa<llvm::ConstantInt>(*arg)) {
-            src = new x86Immediate(llvm::cast<llvm::ConstantInt>(*arg));
-        }
-        else {
-            src = query_slot(*arg);
+    // Push the stack arguments, last one first, so the first of them ends up right above the return address.
+    // We do these before the register arguments, since those might overwrite registers that these come from.
+    size_t stack_arg_count = 0;
+    if (call_instruction.arg_size() > ARGUMENT_REGISTERS.size()) {
+        stack_arg_count = call_instruction.arg_size() - ARGUMENT_REGISTERS.size();
+        insert_instruction(new x86Comment("passing " + std::to_string(stack_arg_count) + " arguments to " + function_name + " on the stack"));
+        for (size_t i = call_instruction.arg_size(); i > ARGUMENT_REGISTERS.size(); i--) {
+            x86Source *argument = query_source(*call_instruction.getArgOperand(i - 1));
+            if (wide_immediate(argument)) {
+                // pushq only takes 32 bits of immediate too.
+                insert_move(argument, new x86Register("rax"), 64);
+                argument = new x86Register("rax");
+            }
+            insert_instruction(new x86SrcInstruction("pushq", argument));
         }
+    }
 
-        insert_instruction(new x86SrcDstInstruction("movq", src, new x86Register("rdi")));
+    // The register arguments might already be sitting in each other's registers, so they get moved all at once.
+    if (call_instruction.arg_size() != 0) {
+        insert_instruction(new x86Comment("passing arguments to " + function_name + " in registers"));
+        std::vector<std::pair<x86Source *, x86Destination *>> moves;
+        for (size_t i = 0; i < call_instruction.arg_size() && i < ARGUMENT_REGISTERS.size(); i++) {
+            moves.push_back({query_source(*call_instruction.getArgOperand(i)), new x86Register(ARGUMENT_REGISTERS[i])});
+        }
+        insert_parallel_move(moves);
     }
 
+    // If the function's already been generated, we know which registers it actually changes.
     insert_instruction(new x86Comment("calling " + function_name));
-    insert_instruction(new x86LblInstruction("callq", labels[&entry_block]));
+    x86LblInstruction *call = new x86LblInstruction("callq", callee);
+    call->register_arguments = std::min<size_t>(call_instruction.arg_size(), ARGUMENT_REGISTERS.size());
+    auto known = clobbers.find(call_instruction.getCalledFunction());
+    if (known != clobbers.end()) {
+        call->clobbers = known->second;
+    }
+    insert_instruction(call);
+
+    if (stack_arg_count != 0) {
+        insert_instruction(new x86SrcDstInstruction("addq", new x86Immediate(8 * stack_arg_count), new x86Register("rsp")));
+    }
 
     // Pop the caller-saved registers
     insert_instruction(new x86Comment("popping caller-saved registers after call to " + function_name));
@@ -601,10 +1349,47 @@ void x86Program::handle_call(llvm::BasicBlock::const_iterator it) {
     // At this point, the returned value (if there is one) is in %rax. If it needs to be saved, let's save it in a slot.
     if (!call_instruction.use_empty()) { // If the instruction has any uses
         insert_instruction(new x86Comment("saving the value returned from " + function_name));
-        insert_instruction(new x86SrcDstInstruction("movq", new x86Register("rax"), acquire_slot(call_instruction)));
+        insert_move(new x86Register("rax"), acquire_slot(call_instruction), operation_width(call_instruction.getType()));
+    }
+}
+
+// Returns the x86 condition code suffix (as in jCC, setCC and cmovCC) that's true when @predicate is.
+static std::string condition_code(llvm::CmpInst::Predicate predicate) {
+    switch (predicate) {
+    case llvm::CmpInst::Predicate::ICMP_EQ:
+        return "e";
+    case llvm::CmpInst::Predicate::ICMP_NE:
+        return "ne";
+    case llvm::CmpInst::Predicate::ICMP_SGT:
+        return "g";
+    case llvm::CmpInst::Predicate::ICMP_SGE:
+        return "ge";
+    case llvm::CmpInst::Predicate::ICMP_SLT:
+        return "l";
+    case llvm::CmpInst::Predicate::ICMP_SLE:
+        return "le";
+    case llvm::CmpInst::Predicate::ICMP_UGT:
+        return "a";
+    case llvm::CmpInst::Predicate::ICMP_UGE:
+        return "ae";
+    case llvm::CmpInst::Predicate::ICMP_ULT:
+        return "b";
+    case llvm::CmpInst::Predicate::ICMP_ULE:
+        return "be";
+    default:
+        llvm::errs() << "ERROR: INVALID COMPARISON PREDICATE.\n";
+        return "INVALID";
     }
 }
 
+// Returns the label to jump to to get from @from to @to. If @to has phi nodes, that's the phi edge's label.
+x86Label *x86Program::edge_label(llvm::BasicBlock const *from, llvm::BasicBlock const *to) {
+    if (block_starts_with_phi(*to)) {
+        return phi_node_labels[{from, to}];
+    }
+    return labels[to];
+}
+
 void x86Program::handle_br(llvm::BasicBlock::const_iterator it) {
     llvm::BranchInst const &br_instruction = llvm::cast<llvm::BranchInst>(*it);
 
@@ -615,136 +1400,352 @@ void x86Program::handle_br(llvm::BasicBlock::const_iterator it) {
     llvm::BasicBlock const *target_block_1 = br_instruction.getSuccessor(0);
 
     // Get the label for that block
-    x86Label *target_label_1 = nullptr;
-    if (block_starts_with_phi(*target_block_1)) {
-        target_label_1 = phi_node_labels[{this_block, target_block_1}];
-    }
-    else {
-        target_label_1 = labels[target_block_1];
-    }
+    x86Label *target_label_1 = edge_label(this_block, target_block_1);
+
+    insert_counters(options.counters_at_end, *this_block);
+
+    // There's no need to jump to the block that gets generated right after this one; control falls right into it.
+    // If it starts with phi nodes, handle_block_begin puts the moves for this edge first.
+    llvm::BasicBlock const *next = next_block(*this_block);
 
     // If the branch is unconditional, then we're done.
     if (br_instruction.isUnconditional()) {
-        insert_instruction(new x86LblInstruction("jmp", target_label_1));
+        if (target_block_1 != next) {
+            insert_instruction(new x86LblInstruction("jmp", target_label_1));
+        }
     }
     else if (br_instruction.isConditional()) {
         // The second block this br instruction goes to
         llvm::BasicBlock const *target_block_2 = br_instruction.getSuccessor(1);
 
         // Get the label for that block
-        x86Label *target_label_2 = nullptr;
-        if (block_starts_with_phi(*target_block_2)) {
-            target_label_2 = phi_node_labels[{this_block, target_block_2}];
+        x86Label *target_label_2 = edge_label(this_block, target_block_2);
+
+        // Figure out what types of jumps this br should create. (jl, jle, jg, jge, etc)
+        auto const [true_code, false_code] = condition_codes(*br_instruction.getCondition());
+
+        // We're implementing llvm br with 2 x86 jumps, because if a jump's condition fails in x86, no jump occurs,
+        // whereas in llvm a jump still occurs, but to the second branch. If either block comes next, its jump goes,
+        // and the other one gets jumped to on whichever condition leads there. With a profile, the blocks are laid
+        // out so that the one more likely to run comes next.
+        if (target_block_2 == next) {
+            insert_instruction(new x86LblInstruction("j" + true_code, target_label_1));
+        }
+        else if (target_block_1 == next) {
+            insert_instruction(new x86LblInstruction("j" + false_code, target_label_2));
         }
         else {
-            target_label_2 = labels[target_block_2];
+            insert_instruction(new x86LblInstruction("j" + true_code, target_label_1));
+            insert_instruction(new x86LblInstruction("j" + false_code, target_label_2));
         }
+    }
+}
 
-        // Figure out what types of jumps this br should create. (jl, jle, jg, jge, etc)
-        llvm::Value const *cond = br_instruction.getCondition();
-        if (llvm::isa<llvm::ICmpInst>(*cond)) {
-            llvm::ICmpInst const &icmp = llvm::cast<llvm::ICmpInst>(*cond);
-
-            // We're implementing llvm br with 2 x86 jumps, because if a jump's condition fails in x86, no jump occurs,
-            // whereas in llvm a jump still occurs, but to the second branch.
-            std::string opcode1("INVALID JUMP");
-            std::string opcode2("INVALID JUMP");
-            switch (icmp.getPredicate()) {
-            case llvm::CmpInst::Predicate::ICMP_EQ:
-                opcode1 = "je";
-                opcode2 = "jne";
-                break;
-            case llvm::CmpInst::Predicate::ICMP_NE:
-                opcode1 = "jne";
-                opcode2 = "je";
-                break;
-            case llvm::CmpInst::Predicate::ICMP_SGT:
-                opcode1 = "jg";
-                opcode2 = "jle";
-                break;
-            case llvm::CmpInst::Predicate::ICMP_SGE:
-                opcode1 = "jge";
-                opcode2 = "jl";
-                break;
-            case llvm::CmpInst::Predicate::ICMP_SLT:
-                opcode1 = "jl";
-                opcode2 = "jge";
-                break;
-            case llvm::CmpInst::Predicate::ICMP_SLE:
-                opcode1 = "jle";
-                opcode2 = "jg";
-                break;
-            default:
-                llvm::errs() << "ERROR: INVALID COMPARISON PREDICATE.\n";
-                break;
+// Makes sure the flags say whether the i1 @condition is true, and returns the condition codes for when it is and when
+// it isn't. A comparison whose flags are still there gets used as is. Anything else has to be in a slot, where it's
+// either 0 or 1.
+std::pair<std::string, std::string> x86Program::condition_codes(llvm::Value const &condition) {
+    if (llvm::isa<llvm::ICmpInst>(condition) && flags == &condition) {
+        llvm::ICmpInst const &icmp = llvm::cast<llvm::ICmpInst>(condition);
+        return {condition_code(icmp.getPredicate()), condition_code(icmp.getInversePredicate())};
+    }
+
+    if (!needs_slot(condition)) {
+        // Constant propagation and value numbering fold away everything that has a constant for a condition.
+        llvm::errs() << "ERROR: INVALID TYPE OF CONDITION.\n";
+        return {"INVALID", "INVALID"};
+    }
+
+    insert_instruction(new x86SrcDstInstruction("testb", new x86Immediate(1), sized(query_slot(condition), 8)));
+    flags = nullptr;
+    return {"ne", "e"};
+}
+
+// Handles switch instructions. There are three ways to do it, depending on what the cases look like:
+//  - If they all fit in a 64-bit mask and only go a few places, test the bit for the value in a mask for each place.
+//  - If they're dense enough, jump through a table with an entry for every value between the lowest and highest case.
+//  - Otherwise, binary search through the cases with a balanced tree of comparisons.
+void x86Program::handle_switch(llvm::BasicBlock::const_iterator it) {
+    llvm::SwitchInst const &switch_inst = llvm::cast<llvm::SwitchInst>(*it);
+    llvm::BasicBlock const *this_block = switch_inst.getParent();
+    std::string const &block_name = labels[this_block]->get_name();
+    x86Label *default_label = edge_label(this_block, switch_inst.getDefaultDest());
+    llvm::Value const *condition = switch_inst.getCondition();
+
+    insert_instruction(new x86Comment("Processing a switch"));
+    insert_counters(options.counters_at_end, *this_block);
+
+    if (llvm::ConstantInt const *constant = constant_value(*condition)) {
+        llvm::SwitchInst &mutable_switch = const_cast<llvm::SwitchInst &>(switch_inst);
+        llvm::BasicBlock const *target = mutable_switch.findCaseValue(constant)->getCaseSuccessor();
+        insert_instruction(new x86LblInstruction("jmp", edge_label(this_block, target)));
+        return;
+    }
+
+    std::vector<std::pair<int64_t, llvm::BasicBlock const *>> cases;
+    std::set<llvm::BasicBlock const *> destinations;
+    for (auto const &switch_case : switch_inst.cases()) {
+        cases.push_back({switch_case.getCaseValue()->getSExtValue(), switch_case.getCaseSuccessor()});
+        destinations.insert(switch_case.getCaseSuccessor());
+    }
+    std::sort(cases.begin(), cases.end(), [](auto const &a, auto const &b) { return a.first < b.first; });
+
+    if (cases.empty()) {
+        insert_instruction(new x86LblInstruction("jmp", default_label));
+        return;
+    }
+
+    // Note that this can wrap around to 0 for the biggest i64 range, which is far too big for a table anyway.
+    int64_t low = cases.front().first;
+    uint64_t range = (uint64_t)cases.back().first - (uint64_t)low + 1;
+    bool small_enough = range != 0 && range <= INT32_MAX;
+    bool use_bit_tests = small_enough && range <= 64 && cases.size() >= BIT_TEST_MIN_CASES && destinations.size() <= BIT_TEST_MAX_DESTINATIONS;
+    bool use_jump_table = small_enough && cases.size() >= JUMP_TABLE_MIN_CASES && range * JUMP_TABLE_MIN_DENSITY_PERCENT <= cases.size() * 100;
+
+    unsigned width = bit_width(condition->getType());
+    if (!use_bit_tests && !use_jump_table) {
+        insert_switch_tree(query_slot(*condition), std::max(width, 8u), cases, 0, cases.size(), this_block, default_label);
+        return;
+    }
+
+    // Both of the others need the value's distance from the lowest case in %rax. It's unsigned, so values below the
+    // lowest case wrap around and look too high, and one comparison sends both kinds to the default.
+    unsigned bits = width > 32 ? 64 : 32;
+    if (low < INT32_MIN || low > INT32_MAX) {
+        // Only an i64 can have a case that low or high, and sub can't take it as an immediate, so start from -low.
+        insert_move(new x86Immediate((int64_t)(0 - (uint64_t)low)), new x86Register("rax"), 64);
+        insert_instruction(new x86SrcDstInstruction("addq", query_slot(*condition), new x86Register("rax")));
+    }
+    else if (width == 16 || width == 8) {
+        insert_instruction(new x86SrcDstInstruction(std::string("movs") + size_suffix(width) + "l", sized(query_slot(*condition), width),
+                                                    new x86Register("eax")));
+    }
+    else {
+        insert_move(query_slot(*condition), new x86Register("rax"), bits);
+    }
+    if (low != 0 && low >= INT32_MIN && low <= INT32_MAX) {
+        insert_instruction(new x86SrcDstInstruction("sub" + size_suffix(bits), new x86Immediate(low), sized(new x86Register("rax"), bits)));
+    }
+    // The range is small enough for the top of it to fit in an immediate.
+    insert_instruction(new x86SrcDstInstruction("cmp" + size_suffix(bits), new x86Immediate(range - 1), sized(new x86Register("rax"), bits)));
+    insert_instruction(new x86LblInstruction("ja", default_label));
+
+    if (use_bit_tests) {
+        // One mask per destination, with a bit set for each case that goes there. Destinations go in order of their
+        // lowest case, so the output doesn't depend on where the blocks ended up in memory.
+        std::vector<llvm::BasicBlock const *> order;
+        std::map<llvm::BasicBlock const *, uint64_t> masks;
+        for (auto const &[value, destination] : cases) {
+            if (masks.count(destination) == 0) {
+                order.push_back(destination);
             }
+            masks[destination] |= uint64_t(1) << (value - low);
+        }
+        // bt with the bit number in a register is slow on memory, so each mask goes into %rcx. Whatever %rcx was
+        // holding waits in the scratch slot, and goes back before each jump, since moves leave the flags alone.
+        insert_instruction(new x86SrcDstInstruction("movq", new x86Register("rcx"), scratch_slot()));
+        for (llvm::BasicBlock const *destination : order) {
+            uint64_t mask = masks[destination];
+            insert_move(new x86Immediate((int64_t)mask), new x86Register("rcx"), mask <= UINT32_MAX ? 32 : 64);
+            insert_instruction(new x86SrcDstInstruction("btq", new x86Register("rax"), new x86Register("rcx")));
+            insert_instruction(new x86SrcDstInstruction("movq", scratch_slot(), new x86Register("rcx")));
+            insert_instruction(new x86LblInstruction("jc", edge_label(this_block, destination)));
+        }
+        insert_instruction(new x86LblInstruction("jmp", default_label));
+        return;
+    }
 
-            insert_instruction(new x86LblInstruction(opcode1, target_label_1));
-            insert_instruction(new x86LblInstruction(opcode2, target_label_2));
+    // Every value in the range gets an entry. The ones that aren't cases go to the default.
+    x86Label *table = new x86Label("__SWITCH_TABLE_" + block_name);
+    read_only_data.push_back(new x86Directive("    .p2align 3"));
+    read_only_data.push_back(table);
+    size_t next_case = 0;
+    for (uint64_t offset = 0; offset < range; offset++) {
+        x86Label *target = default_label;
+        if (cases[next_case].first - low == (int64_t)offset) {
+            target = edge_label(this_block, cases[next_case].second);
+            next_case++;
+        }
+        read_only_data.push_back(new x86Directive("    .quad " + target->get_name()));
+    }
+    insert_instruction(new x86TableJump(table, "rax"));
+}
 
-            llvm::errs() << "Backing up the slots.\n";
-            back_up_slots(labels[br_instruction.getSuccessor(0)]);
-            back_up_slots(labels[br_instruction.getSuccessor(1)]);
+// Binary searches for @condition among @cases[@first, @last), which are sorted, jumping to the default if it's not there.
+// Each level compares against the middle case: less goes left, equal goes to that case, and greater goes right.
+void x86Program::insert_switch_tree(x86Destination *condition, unsigned bits, std::vector<std::pair<int64_t, llvm::BasicBlock const *>> const &cases,
+                                    size_t first, size_t last, llvm::BasicBlock const *this_block, x86Label *default_label) {
+    std::string suffix = size_suffix(bits);
+
+    // cmp only takes 32 bits of immediate, so i64 cases outside that get loaded into %rax, which is free here.
+    auto case_value = [&](int64_t value) -> x86Source * {
+        x86Source *immediate = new x86Immediate(value);
+        if (!wide_immediate(immediate)) {
+            return immediate;
         }
-        else {
-            // If there's a constant in a branch condition, the dead code elimination pass should have taken care of it.
-            llvm::errs() << "ERROR: INVALID TYPE OF BRANCH CONDITION.\n";
+        insert_move(immediate, new x86Register("rax"), 64);
+        return new x86Register("rax");
+    };
+
+    // A few cases are quicker to just check one after another.
+    if (last - first <= 3) {
+        for (size_t i = first; i < last; i++) {
+            insert_instruction(new x86SrcDstInstruction("cmp" + suffix, case_value(cases[i].first), sized(condition, bits)));
+            insert_instruction(new x86LblInstruction("je", edge_label(this_block, cases[i].second)));
         }
+        insert_instruction(new x86LblInstruction("jmp", default_label));
+        return;
     }
+
+    size_t middle = first + (last - first) / 2;
+    x86Label *left = new x86Label("__SWITCH_" + std::to_string(middle) + "_" + labels[this_block]->get_name());
+    insert_instruction(new x86SrcDstInstruction("cmp" + suffix, case_value(cases[middle].first), sized(condition, bits)));
+    insert_instruction(new x86LblInstruction("jl", left));
+    insert_instruction(new x86LblInstruction("je", edge_label(this_block, cases[middle].second)));
+    insert_switch_tree(condition, bits, cases, middle + 1, last, this_block, default_label);
+    insert_instruction(left);
+    insert_switch_tree(condition, bits, cases, first, middle, this_block, default_label);
 }
 
-// Handles binary operators (add, sub, mul, div) in the LLVM pass, converting them to x86 assembly
+// Handles binary operators (add, sub, mul, div) in the LLVM pass, converting them to x86 assembly.
+// Anything 32 bits or narrower uses the 32-bit forms (addl, subl, imull), which wrap around where LLVM says they do.
 void x86Program::handle_binop(llvm::BasicBlock::const_iterator it, std::string op) {
     llvm::BinaryOperator const &bop_inst = llvm::cast<llvm::BinaryOperator>(*it);
 
-    llvm::Value *lhs = bop_inst.getOperand(0);          // get the left operand of the binary operation
-    llvm::Value *rhs = bop_inst.getOperand(1);          // get the right operand of the binary operation
+    llvm::Value *lhs = bop_inst.getOperand(0); // get the left operand of the binary operation
+    llvm::Value *rhs = bop_inst.getOperand(1); // get the right operand of the binary operation
 
     insert_instruction(new x86Comment("Processing a binary operation"));
-    
-    // The sources for the instructions; either set to an x86Immediate or an x86Register depending on the left/right operands
-    x86Source *l_src = nullptr;
-    x86Source *r_src = nullptr;
-    
-    if (llvm::isa<llvm::ConstantInt>(lhs)) {
-        // the left operand (lhs) is a constant. Thus, the left source is an x86Immediate with a value equal to the constant.
-        l_src = new x86Immediate(llvm::cast<llvm::ConstantInt>(*lhs));
-    } else {
-        // the left operand (lhs) is not constant. Thus, the left source is an x86Register from a previous instruction
-        l_src = query_slot(*lhs);
-    }
-    insert_instruction(new x86SrcDstInstruction("movq", l_src, new x86Register("rax")));        // move the left source into %rax
-
-    if (llvm::isa<llvm::ConstantInt>(rhs)) {
-        // rhs is constant, the right source is an x86Immediate with a value equal to rhs
-        r_src = new x86Immediate(llvm::cast<llvm::ConstantInt>(*rhs));
-    } else {
-        // rhs is not a constant, the right source is an x86Register saved from a previous instruction
-        r_src = query_slot(*rhs);
-    }
-
-    // if adding or subtracting, add an x86 'add' or 'sub' command with the right source as the source and %rax as the destination
-    if (op.compare("add") == 0 || op.compare("sub") == 0) {
-        insert_instruction(new x86SrcDstInstruction(op, r_src, new x86Register("rax")));
-        // if multiplying or dividing, add an x86 'mul' or 'div' command with the right source as the source. Note that
-        // 'mul' and 'div' implicitly apply their operations to %rax
-    } else if (op.compare("mul") == 0 || op.compare("div") == 0) {
-        insert_instruction(new x86SrcInstruction(op, r_src));
-    } else {
-      llvm::errs() << "ERROR: INVALID OPCODE.\n";
-    }
-
-    // Only save the result of the operation (currently stored in %rax) to a register if there are future uses of the instruction.
-    // Otherwise, we would be wasting memory
-    if (!bop_inst.use_empty()) {
-        insert_instruction(new x86SrcDstInstruction("movq", new x86Register("rax"), acquire_slot(bop_inst)));
+    flags = nullptr;
+
+    // Division has to happen in %rdx:%rax, so it gets its own function.
+    if (op == "div") {
+        insert_division(bop_inst);
+        insert_instruction(new x86Comment("Finished processing binary operation"));
+        return;
+    }
+
+    // Nothing else here has side effects, so if nobody uses the result, there's nothing to do.
+    if (bop_inst.use_empty()) {
+        insert_instruction(new x86Comment("Finished processing binary operation"));
+        return;
+    }
+
+    unsigned bits = operation_width(bop_inst.getType());
+    std::string opcode = (op == "mul" ? "imul" : op) + size_suffix(bits);
+    bool commutative = op != "sub";
+
+    // The sources are either x86Immediates or the slots of previous instructions.
+    x86Source *l_src = query_source(*lhs);
+    x86Source *r_src = query_source(*rhs);
+    x86Destination *destination = acquire_slot(bop_inst);
+
+    // Only movq can take a 64-bit immediate, so a constant that doesn't fit in 32 bits goes into %rax first.
+    if (wide_immediate(r_src) && destination->type != x86Source::REG) {
+        // %rax is where we'd work, so start with the constant there instead. x - c is -c + x.
+        insert_move(r_src, new x86Register("rax"), bits);
+        if (!commutative) {
+            insert_instruction(new x86DstInstruction("neg" + size_suffix(bits), new x86Register("rax")));
+            opcode = "add" + size_suffix(bits);
+        }
+        insert_instruction(new x86SrcDstInstruction(opcode, l_src, new x86Register("rax")));
+        insert_move(new x86Register("rax"), destination, bits);
+        insert_instruction(new x86Comment("Finished processing binary operation"));
+        return;
+    }
+    if (wide_immediate(r_src)) {
+        insert_move(r_src, new x86Register("rax"), bits);
+        r_src = new x86Register("rax");
+    }
+    else if (wide_immediate(l_src) && destination->type == x86Source::REG && same_location(r_src, destination) && commutative) {
+        insert_move(l_src, new x86Register("rax"), bits);
+        l_src = new x86Register("rax");
+    }
+
+    if (destination->type == x86Source::REG && !same_location(r_src, destination)) {
+        // If the result lives in a register, we can work right in it, as long as that doesn't trample the right
+        // operand before we get to read it.
+        insert_move(l_src, destination, bits);
+        insert_instruction(new x86SrcDstInstruction(opcode, sized(r_src, bits), sized(destination, bits)));
+    }
+    else if (destination->type == x86Source::REG && commutative) {
+        // The right operand is already sitting in the result's register, so do it the other way around.
+        insert_instruction(new x86SrcDstInstruction(opcode, sized(l_src, bits), sized(destination, bits)));
+    }
+    else {
+        // Otherwise, work in %rax and move the result over at the end. Note that imul can't write to memory.
+        insert_move(l_src, new x86Register("rax"), bits);
+        insert_instruction(new x86SrcDstInstruction(opcode, sized(r_src, bits), sized(new x86Register("rax"), bits)));
+        insert_move(new x86Register("rax"), destination, bits);
     }
     insert_instruction(new x86Comment("Finished processing binary operation"));
 }
 
-// Handles icmp instructions found during the LLVM pass, converting them to x86 assembly
+// Lowers a signed division. idiv divides %rdx:%rax by its operand, so the dividend gets sign-extended into %rdx, which
+// might be somebody's slot. We save %rdx in the scratch slot and put it back afterwards, unless the result goes there.
+void x86Program::insert_division(llvm::BinaryOperator const &bop_inst) {
+    // Dividing by zero is undefined anyway, so if nobody uses the result, we don't have to do anything.
+    if (bop_inst.use_empty()) {
+        return;
+    }
+
+    unsigned bits = operation_width(bop_inst.getType());
+    x86Source *l_src = query_source(*bop_inst.getOperand(0));
+    x86Source *r_src = query_source(*bop_inst.getOperand(1));
+    x86Destination *destination = acquire_slot(bop_inst);
+
+    bool result_in_rdx = register_name_of(destination) == "rdx";
+    bool divisor_in_rdx = register_name_of(r_src) == "rdx";
+    if (!result_in_rdx || divisor_in_rdx) {
+        insert_instruction(new x86SrcDstInstruction("movq", new x86Register("rdx"), scratch_slot()));
+    }
+
+    // i8s and i16s get divided as i32s, so their high bits have to match their sign bits first. Immediates already do.
+    unsigned value_bits = bit_width(bop_inst.getType());
+    bool narrow = value_bits < 32;
+    std::string extend = "movs" + size_suffix(value_bits) + "l";
+    if (narrow && l_src->type != x86Source::IMM) {
+        insert_instruction(new x86SrcDstInstruction(extend, sized(l_src, value_bits), new x86Register("eax")));
+    }
+    else {
+        insert_move(l_src, new x86Register("rax"), bits);
+    }
+
+    // idiv can't take an immediate, and it can't take %rdx either, since that's about to hold the dividend's sign.
+    // The result's slot is free to use now that the dividend is in %rax, unless it's %rdx. In that case the saved %rdx
+    // isn't needed anymore, so the scratch slot is free instead.
+    x86Destination *holder = result_in_rdx ? scratch_slot() : destination;
+    x86Source *divisor = r_src;
+    if (r_src->type == x86Source::IMM) {
+        insert_move(r_src, holder, bits, true);
+        divisor = holder;
+    }
+    else if (narrow) {
+        // movs can't write memory, but %rdx is free until the dividend gets sign-extended into it.
+        x86Destination *extended = holder->type == x86Source::REG ? sized(holder, 32) : new x86Register("edx");
+        insert_instruction(new x86SrcDstInstruction(extend, sized(r_src, value_bits), extended));
+        if (holder->type != x86Source::REG) {
+            insert_instruction(new x86SrcDstInstruction("movl", new x86Register("edx"), holder));
+        }
+        divisor = holder;
+    }
+    else if (divisor_in_rdx) {
+        divisor = scratch_slot();
+    }
+
+    insert_instruction(new x86NoArgInstruction(bits > 32 ? "cqto" : "cltd"));
+    insert_instruction(new x86SrcInstruction("idiv" + size_suffix(bits), sized(divisor, bits)));
+
+    insert_move(new x86Register("rax"), destination, bits);
+    if (!result_in_rdx) {
+        insert_instruction(new x86SrcDstInstruction("movq", scratch_slot(), new x86Register("rdx")));
+    }
+}
+
+// Handles icmp instructions found during the LLVM pass, converting them to x86 assembly.
+// The result only ever lives in the flags, so this has to come right before the branch or select that uses it.
 void x86Program::handle_icmp(llvm::BasicBlock::const_iterator it) {
-    llvm::CmpInst const &comp_inst = llvm::cast<llvm::CmpInst>(*it);    // cast the iterator to a CmpInst
+    llvm::CmpInst const &comp_inst = llvm::cast<llvm::CmpInst>(*it); // cast the iterator to a CmpInst
 
     // Aquire the left and right operands
     llvm::Value *lhs = comp_inst.getOperand(0);
@@ -752,29 +1753,362 @@ void x86Program::handle_icmp(llvm::BasicBlock::const_iterator it) {
 
     insert_instruction(new x86Comment("Processing a comparison instruction"));
 
-    // Set up the left and right source, which will ultimately either be an x86Immediate or an x86Register
-    x86Source *l_src = nullptr;
-    x86Source *r_src = nullptr;
+    // Unlike arithmetic, comparisons look at every bit, so they have to be exactly as wide as the operands.
+    unsigned bits = std::max(bit_width(lhs->getType()), 8u);
+    std::string suffix = size_suffix(bits);
+
+    // The sources are either x86Immediates or the slots of previous instructions.
+    x86Source *l_src = query_source(*lhs);
+    x86Source *r_src = query_source(*rhs);
 
-    if (llvm::isa<llvm::ConstantInt>(lhs)) {
-        // the left operand is a constant, so the left source is an x86Immediate with the value of the left operand.
-        l_src = new x86Immediate(llvm::cast<llvm::ConstantInt>(*lhs));
-    } else {
-        // the left operand comes from a previous instruction, so grab the x86Register where the result of that previous operation is stored.
-        l_src = query_slot(*lhs);
+    if (wide_immediate(r_src)) {
+        // cmp can only take 32 bits of immediate. Constant propagation folds comparisons of two constants.
+        insert_move(r_src, new x86Register("rax"), bits);
+        r_src = new x86Register("rax");
     }
-    // move the left source (either an x86Immediate or an x86Register) into %rax
-    insert_instruction(new x86SrcDstInstruction("movq", l_src, new x86Register("rax")));
 
-    if (llvm::isa<llvm::ConstantInt>(rhs)) {
-        // the right operand is a constant, so the right source is an x86Immediate with the value of the right operand.
-        r_src = new x86Immediate(llvm::cast<llvm::ConstantInt>(*rhs));
-    } else {
-        // the rigth operand comes from a previous instruction, so grab the x86Register where the resultof that previous operation is stored.
-        r_src = query_slot(*rhs);
+    if (l_src->type == x86Source::REG && r_src->type == x86Source::IMM && static_cast<x86Immediate *>(r_src)->val == 0) {
+        // Comparing against zero is just checking whether it's zero or negative.
+        delete r_src;
+        x86Destination *l_dst = static_cast<x86Destination *>(l_src);
+        insert_instruction(new x86SrcDstInstruction("test" + suffix, sized(l_dst, bits), sized(l_dst, bits)));
+    }
+    else if (l_src->type == x86Source::REG || (l_src->type != x86Source::IMM && r_src->type != x86Source::REG_PTR)) {
+        // cmp can take the left operand right where it is, unless both operands are in memory.
+        insert_instruction(new x86SrcDstInstruction("cmp" + suffix, sized(r_src, bits), sized(static_cast<x86Destination *>(l_src), bits)));
+    }
+    else {
+        insert_move(l_src, new x86Register("rax"), bits > 32 ? 64 : 32);
+        insert_instruction(new x86SrcDstInstruction("cmp" + suffix, sized(r_src, bits), sized(new x86Register("rax"), bits)));
     }
 
-    // apply the 'cmp' instruction from the right source to %rax, which will properly set the flags for any upcoming jumps.
-    insert_instruction(new x86SrcDstInstruction("cmp", r_src, new x86Register("rax")));
+    flags = &comp_inst;
+
+    // Comparisons that get used as values, rather than just for their flags, need their result in a slot too.
+    if (needs_slot(comp_inst)) {
+        insert_instruction(new x86DstInstruction("set" + condition_code(comp_inst.getPredicate()), new x86Register("al")));
+        insert_instruction(new x86SrcDstInstruction("movzbl", new x86Register("al"), new x86Register("eax")));
+        insert_move(new x86Register("rax"), acquire_slot(comp_inst), 32, true);
+    }
     insert_instruction(new x86Comment("Finished processing a comparison instruction"));
 }
+
+// Handles select instructions without branching, using setCC or cmovCC on the flags from the select's comparison.
+// If the condition isn't a comparison that's still in the flags, it gets tested out of its slot first.
+// Everything here is a mov, set, movzb or lea, none of which touch the flags, so a run of selects on the same
+// comparison can all share it. Note that cmov has no immediate form, so immediate arms have to be put somewhere first.
+void x86Program::handle_select(llvm::BasicBlock::const_iterator it) {
+    llvm::SelectInst const &select_inst = llvm::cast<llvm::SelectInst>(*it);
+
+    if (select_inst.use_empty()) {
+        return;
+    }
+
+    llvm::Value const *true_value = select_inst.getTrueValue();
+    llvm::Value const *false_value = select_inst.getFalseValue();
+
+    insert_instruction(new x86Comment("Processing a select instruction"));
+    auto const [true_code, false_code] = condition_codes(*select_inst.getCondition());
+    unsigned bits = operation_width(select_inst.getType());
+
+    if (constant_value(*true_value) != nullptr && constant_value(*false_value) != nullptr) {
+        int64_t true_constant = constant_value(*true_value)->getSExtValue();
+        int64_t false_constant = constant_value(*false_value)->getSExtValue();
+
+        if (true_constant == false_constant + 1 || false_constant == true_constant + 1) {
+            // The constants are one apart, so the answer is the smaller one plus whether the condition picks the bigger one.
+            bool true_is_bigger = true_constant == false_constant + 1;
+            int64_t smaller = true_is_bigger ? false_constant : true_constant;
+            insert_instruction(new x86DstInstruction("set" + (true_is_bigger ? true_code : false_code), new x86Register("al")));
+            insert_instruction(new x86SrcDstInstruction("movzbl", new x86Register("al"), new x86Register("eax")));
+            x86Destination *destination = acquire_slot(select_inst);
+            if (smaller < INT32_MIN || smaller > INT32_MAX) {
+                // A displacement only gets 32 bits, so add the constant out of the destination instead.
+                insert_move(new x86Register("rax"), destination, bits, true);
+                insert_move(new x86Immediate(smaller), new x86Register("rax"), bits, true);
+                insert_instruction(new x86SrcDstInstruction("addq", new x86Register("rax"), destination));
+            }
+            else {
+                if (smaller != 0) {
+                    insert_instruction(new x86SrcDstInstruction("lea" + size_suffix(bits), new x86Pointer(new x86Register("rax"), smaller),
+                                                                sized(new x86Register("rax"), bits)));
+                }
+                insert_move(new x86Register("rax"), destination, bits, true);
+            }
+        }
+        else {
+            // cmov can't take an immediate, so one of the constants has to be somewhere first.
+            x86Destination *destination = acquire_slot(select_inst);
+            if (destination->type == x86Source::REG) {
+                insert_move(new x86Immediate(false_constant), destination, bits, true);
+                insert_move(new x86Immediate(true_constant), new x86Register("rax"), bits, true);
+                insert_instruction(new x86SrcDstInstruction("cmov" + true_code, sized(new x86Register("rax"), bits), sized(destination, bits)));
+            }
+            else {
+                insert_move(new x86Immediate(true_constant), destination, bits, true);
+                insert_move(new x86Immediate(false_constant), new x86Register("rax"), bits, true);
+                insert_instruction(new x86SrcDstInstruction("cmov" + true_code, destination, sized(new x86Register("rax"), bits)));
+                insert_move(new x86Register("rax"), destination, bits, true);
+            }
+        }
+    }
+    else {
+        // Start with one arm in %rax and conditionally replace it with the other. cmov can't take an immediate, so if
+        // one of the arms is a constant, it has to be the one that starts in %rax.
+        bool swap = constant_value(*true_value) != nullptr;
+        llvm::Value const *initial = swap ? true_value : false_value;
+        llvm::Value const *replacement = swap ? false_value : true_value;
+        insert_move(query_source(*initial), new x86Register("rax"), bits, true);
+        insert_instruction(new x86SrcDstInstruction("cmov" + (swap ? false_code : true_code), sized(query_slot(*replacement), bits),
+                                                    sized(new x86Register("rax"), bits)));
+        insert_move(new x86Register("rax"), acquire_slot(select_inst), bits, true);
+    }
+
+    insert_instruction(new x86Comment("Finished processing a select instruction"));
+}
+
+// Handles sext, zext and trunc. Since only the low bits of a slot matter, truncating is just a copy, and extending
+// is the only time we actually have to fill in the high bits.
+void x86Program::handle_cast(llvm::BasicBlock::const_iterator it) {
+    llvm::CastInst const &cast_inst = llvm::cast<llvm::CastInst>(*it);
+    if (cast_inst.use_empty()) {
+        return;
+    }
+
+    llvm::Value const &operand = *cast_inst.getOperand(0);
+    unsigned from_bits = bit_width(operand.getType());
+    unsigned to_bits = bit_width(cast_inst.getType());
+    unsigned bits = operation_width(cast_inst.getType());
+    bool sign_extend = cast_inst.getOpcode() == llvm::Instruction::SExt;
+
+    insert_instruction(new x86Comment("Processing a cast"));
+
+    if (llvm::ConstantInt const *constant = constant_value(operand)) {
+        int64_t val = sign_extend ? constant->getSExtValue() : constant->getZExtValue();
+        insert_move(new x86Immediate(val), acquire_slot(cast_inst), bits, true);
+        return;
+    }
+
+    x86Source *source = nullptr;
+    if (llvm::isa<llvm::ICmpInst>(operand) && flags == &operand) {
+        // Comparisons usually only live in the flags, so get the bit out of them.
+        insert_instruction(new x86DstInstruction("set" + condition_code(llvm::cast<llvm::ICmpInst>(operand).getPredicate()), new x86Register("al")));
+        source = new x86Register("rax");
+    }
+    else if (needs_slot(operand)) {
+        source = query_slot(operand);
+    }
+    else {
+        llvm::errs() << "ERROR: THE CAST'S COMPARISON ISN'T IN THE FLAGS.\n";
+        return;
+    }
+
+    x86Destination *destination = acquire_slot(cast_inst);
+    if (cast_inst.getOpcode() == llvm::Instruction::Trunc) {
+        if (to_bits == 1) {
+            // i1s are always exactly 0 or 1, so the other bits have to go.
+            insert_move(source, new x86Register("rax"), 32);
+            insert_instruction(new x86SrcDstInstruction("andl", new x86Immediate(1), new x86Register("eax")));
+            flags = nullptr;
+            source = new x86Register("rax");
+        }
+        insert_move(source, destination, bits);
+        return;
+    }
+
+    // Extend into the destination if it's a register, or %rax if it isn't. Every operand gets its own %rax, since
+    // sized() takes over what it's given and instructions delete their operands.
+    bool in_place = destination->type == x86Source::REG;
+    auto work = [&]() -> x86Destination * { return in_place ? destination : new x86Register("rax"); };
+    std::string work_suffix = size_suffix(bits);
+    if (from_bits == 32 && sign_extend) {
+        insert_instruction(new x86SrcDstInstruction("movslq", sized(source, 32), work()));
+    }
+    else if (from_bits == 32) {
+        // Writing a 32-bit register clears the top half. insert_move would skip this when the operand is already in the
+        // destination, and then the top half would keep whatever was there.
+        insert_instruction(new x86SrcDstInstruction("movl", sized(source, 32), sized(work(), 32)));
+    }
+    else if (from_bits == 16 || from_bits == 8) {
+        std::string opcode = std::string(sign_extend ? "movs" : "movz") + size_suffix(from_bits) + work_suffix;
+        insert_instruction(new x86SrcDstInstruction(opcode, sized(source, from_bits), sized(work(), bits)));
+    }
+    else {
+        // An i1 is 0 or 1, so zero-extending it is just widening the byte, and sign-extending it is negating that.
+        insert_instruction(new x86SrcDstInstruction("movzbl", sized(source, 8), sized(work(), 32)));
+        if (sign_extend) {
+            insert_instruction(new x86DstInstruction("neg" + work_suffix, sized(work(), bits)));
+            flags = nullptr;
+        }
+    }
+
+    if (!in_place) {
+        insert_move(new x86Register("rax"), destination, bits);
+    }
+}
+
+// Makes room for @size bytes in the current function's frame and returns a pointer to the lowest of them.
+x86Destination *x86Program::allocate_stack(int64_t size) {
+    // Keep everything 8-byte aligned.
+    top_of_stack -= (size + 7) / 8 * 8;
+    frame->lowest_offset = top_of_stack;
+    x86Destination *address = new x86Pointer(frame->base, top_of_stack);
+    all_slots.insert(address);
+    return address;
+}
+
+// Returns this function's scratch slot, making it if it doesn't exist yet.
+x86Destination *x86Program::scratch_slot(void) {
+    if (frame->scratch == nullptr) {
+        frame->scratch = allocate_stack(8);
+    }
+    return frame->scratch;
+}
+
+// Returns a memory operand for the memory that @pointer points to. Might clobber %rax to get there.
+x86Destination *x86Program::query_address(llvm::Value const &pointer) {
+    // Allocas point into our own frame, so we know exactly where they are.
+    if (contains(stack_allocations, &pointer)) {
+        return stack_allocations[&pointer];
+    }
+
+    x86Destination *pointer_slot = query_slot(pointer);
+    if (pointer_slot->type == x86Source::REG) {
+        return new x86Pointer(pointer_slot);
+    }
+
+    // You can't go through a pointer that's sitting in memory, so load it first.
+    insert_instruction(new x86SrcDstInstruction("movq", pointer_slot, new x86Register("rax")));
+    return new x86Pointer(new x86Register("rax"));
+}
+
+// Handles alloca instructions by setting aside a piece of the frame.
+// Only static allocas work, ie. the ones in the entry block with a constant size.
+void x86Program::handle_alloca(llvm::BasicBlock::const_iterator it) {
+    llvm::AllocaInst const &alloca_inst = llvm::cast<llvm::AllocaInst>(*it);
+
+    if (!is_entry_block(*alloca_inst.getParent()) || !llvm::isa<llvm::ConstantInt>(alloca_inst.getArraySize())) {
+        llvm::errs() << "ERROR: CAN'T DEAL WITH DYNAMIC ALLOCAS.\n";
+        return;
+    }
+
+    llvm::DataLayout const &data_layout = alloca_inst.getModule()->getDataLayout();
+    int64_t size = data_layout.getTypeAllocSize(alloca_inst.getAllocatedType());
+    size *= llvm::cast<llvm::ConstantInt>(alloca_inst.getArraySize())->getSExtValue();
+
+    insert_instruction(new x86Comment("setting aside " + std::to_string(size) + " bytes of the frame"));
+    x86Destination *address = allocate_stack(size);
+    stack_allocations.insert({&alloca_inst, address});
+
+    // Loads and stores go straight to the frame, but anything else needs the address itself in a slot.
+    if (alloca_escapes(alloca_inst)) {
+        insert_instruction(new x86SrcDstInstruction("leaq", address, new x86Register("rax")));
+        insert_instruction(new x86SrcDstInstruction("movq", new x86Register("rax"), acquire_slot(alloca_inst)));
+    }
+}
+
+// Handles load instructions. Narrow values get zero-extended on the way in, so we never write part of a register.
+void x86Program::handle_load(llvm::BasicBlock::const_iterator it) {
+    llvm::LoadInst const &load_inst = llvm::cast<llvm::LoadInst>(*it);
+    if (load_inst.use_empty()) {
+        return;
+    }
+
+    unsigned bits = operation_width(load_inst.getType());
+    std::string opcode("INVALID LOAD");
+    switch (bit_width(load_inst.getType())) {
+    case 64:
+        opcode = "movq";
+        break;
+    case 32:
+        opcode = "movl";
+        break;
+    case 16:
+        opcode = "movzwl";
+        break;
+    case 8:
+    case 1:
+        opcode = "movzbl";
+        break;
+    default:
+        llvm::errs() << "ERROR: INVALID LOAD WIDTH.\n";
+        break;
+    }
+
+    insert_instruction(new x86Comment("Processing a load"));
+    x86Destination *address = query_address(*load_inst.getPointerOperand());
+    x86Destination *destination = acquire_slot(load_inst);
+    if (destination->type == x86Source::REG) {
+        insert_instruction(new x86SrcDstInstruction(opcode, address, sized(destination, bits)));
+    }
+    else {
+        insert_instruction(new x86SrcDstInstruction(opcode, address, sized(new x86Register("rax"), bits)));
+        insert_move(new x86Register("rax"), destination, bits);
+    }
+}
+
+// Handles store instructions. Only the low bits of the value get written, so we don't trample whatever's next to it.
+void x86Program::handle_store(llvm::BasicBlock::const_iterator it) {
+    llvm::StoreInst const &store_inst = llvm::cast<llvm::StoreInst>(*it);
+    llvm::Value const &value = *store_inst.getValueOperand();
+    llvm::Value const &pointer = *store_inst.getPointerOperand();
+
+    unsigned bits = bit_width(value.getType());
+    std::string opcode("INVALID STORE");
+    switch (bits) {
+    case 64:
+        opcode = "movq";
+        break;
+    case 32:
+        opcode = "movl";
+        break;
+    case 16:
+        opcode = "movw";
+        break;
+    case 8:
+    case 1:
+        opcode = "movb";
+        break;
+    default:
+        llvm::errs() << "ERROR: INVALID STORE WIDTH.\n";
+        break;
+    }
+
+    insert_instruction(new x86Comment("Processing a store"));
+
+    // The value has to be an immediate or a register, since x86 won't move memory to memory.
+    x86Source *source = nullptr;
+    bool value_in_rax = false;
+    if (llvm::ConstantInt const *constant = constant_value(value)) {
+        source = new x86Immediate(*constant);
+        if (wide_immediate(source)) {
+            // Storing an immediate only takes 32 bits of it.
+            insert_move(source, new x86Register("rax"), 64);
+            source = new x86Register("rax");
+            value_in_rax = true;
+        }
+    }
+    else {
+        x86Destination *value_slot = query_slot(value);
+        if (value_slot->type == x86Source::REG) {
+            source = new x86Register(sized_register_name(static_cast<x86Register *>(value_slot)->name, bits));
+        }
+        else {
+            insert_move(value_slot, new x86Register("rax"), operation_width(value.getType()));
+            source = new x86Register(sized_register_name("rax", bits));
+            value_in_rax = true;
+        }
+    }
+
+    // If the value and the pointer both have to come out of memory, we need a second register for the pointer.
+    // Borrow %rdx and put it back when we're done.
+    if (value_in_rax && !contains(stack_allocations, &pointer) && query_slot(pointer)->type != x86Source::REG) {
+        insert_instruction(new x86SrcDstInstruction("movq", new x86Register("rdx"), scratch_slot()));
+        insert_instruction(new x86SrcDstInstruction("movq", query_slot(pointer), new x86Register("rdx")));
+        insert_instruction(new x86SrcDstInstruction(opcode, source, new x86Pointer(new x86Register("rdx"))));
+        insert_instruction(new x86SrcDstInstruction("movq", scratch_slot(), new x86Register("rdx")));
+        return;
+    }
+
+    insert_instruction(new x86SrcDstInstruction(opcode, source, query_address(pointer)));
+}
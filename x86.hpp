@@ -2,8 +2,10 @@
 
 #include <llvm/IR/BasicBlock.h>       // for llvm::BasicBlock
 #include <llvm/IR/Constants.h>        // for llvm::ConstantInt
+#include <llvm/IR/Instructions.h>     // for llvm::AllocaInst
 #include <llvm/IR/Module.h>           // for llvm::Module
 #include <llvm/Support/raw_ostream.h> // for llvm::raw_ostream
+#include <cstdint>                    // for uint64_t
 #include <map>                        // for std::map
 #include <queue>                      // for std::priority_queue
 #include <set>                        // for std::set
@@ -21,6 +23,38 @@ bool is_entry_block(llvm::BasicBlock const &block);
 // Convenience function. Returns whether @block begins with a phi node.
 bool block_starts_with_phi(llvm::BasicBlock const &block);
 
+// Returns whether @function never calls anything.
+bool is_leaf_function(llvm::Function const &function);
+
+// Returns whether @user gets the comparison @comparison straight out of the flags, rather than out of a slot.
+bool reads_flags(llvm::User const &user, llvm::Value const &comparison);
+
+// Returns whether @value is going to need a slot to live in.
+bool needs_slot(llvm::Value const &value);
+
+// The values that need slots and are live at the top and at the bottom of every block in a function.
+struct liveness {
+    std::map<llvm::BasicBlock const *, std::set<llvm::Value const *>> live_in;
+    std::map<llvm::BasicBlock const *, std::set<llvm::Value const *>> live_out;
+};
+
+// Works out which values are live at the edges of every block in @function. Phi nodes count as defined at the top of
+// their block, and their incoming values count as used at the bottom of the block they come from.
+liveness compute_liveness(llvm::Function const &function);
+
+// Returns whether the address that @alloca makes gets used for anything other than loading from it or storing to it.
+bool alloca_escapes(llvm::AllocaInst const &alloca);
+
+// Returns the name of the @bits-bit piece of the 64-bit register @name, like "eax" for ("rax", 32).
+std::string sized_register_name(std::string const &name, unsigned bits);
+
+// Abstract base class for a source operand to an instruction.
+struct x86Source;
+
+// A set of all the slots. This exists so the destructors don't double-free slots used in more than one place.
+// Every thread gets its own, so that several programs can be generated at once.
+extern thread_local std::set<x86Source *> all_slots;
+
 // Abstract base class for a source operand to an instruction.
 // Note that destinations can be sources, but not all sources can be destinations (eg. immediates)
 // If I were doing this all over again, I would probably pass these around by value
@@ -39,6 +73,9 @@ struct x86Destination : public x86Source {};
 struct x86Immediate : public x86Source {
     int64_t val;
 
+    // How many bits of the value matter. Immediates that came from narrow constants can use the short forms.
+    unsigned bits = 64;
+
     x86Immediate(int64_t);
     x86Immediate(llvm::ConstantInt const &);
     void print(llvm::raw_ostream &) const;
@@ -70,9 +107,28 @@ struct x86Pointer : public x86Destination {
     void print_as_pointer(llvm::raw_ostream &, int64_t) const;
 };
 
+// A set of registers, one bit each, numbered the way register_number in machine.hpp numbers them. The flags get a bit
+// too.
+typedef uint32_t x86RegisterSet;
+
+// What an instruction does to the registers, for the machine-level passes. See machine.cpp.
+struct x86Effects {
+    // The registers it reads and the ones it writes. Writing only part of a register counts as reading the rest of it.
+    x86RegisterSet uses = 0;
+    x86RegisterSet defs = 0;
+
+    // Whether it can go away if nothing reads what it writes. Anything that writes memory, jumps or can trap can't.
+    bool removable = false;
+
+    // Whether it addresses memory off %rsp, which moves every time something gets pushed or popped.
+    bool addresses_stack = false;
+};
+
 // Abstract base class from which all instructions inherit
 struct x86Instruction {
     virtual void print(llvm::raw_ostream &) const = 0;
+    // Instructions that don't say what they do count as reading every register, so the passes leave them alone.
+    virtual x86Effects effects(void) const;
     virtual ~x86Instruction(void) = default;
 };
 
@@ -85,9 +141,29 @@ struct x86Label : public x86Instruction {
     x86Label(std::string);
     std::string get_name(void) const;
     void print(llvm::raw_ostream &) const;
+    x86Effects effects(void) const;
     void print_as_pointer(llvm::raw_ostream &) const;
 };
 
+// A memory operand at a label, like `table(%rip)`. Used for reading the program's constant data.
+struct x86LabelPointer : public x86Destination {
+    x86Label *label;
+    int64_t offset;
+
+    x86LabelPointer(x86Label *, int64_t offset = 0);
+    // Note that we don't need a destructor because all labels will be deleted by the x86Program destructor
+    void print(llvm::raw_ostream &) const;
+    void print_as_pointer(llvm::raw_ostream &, int64_t) const;
+};
+
+// Assembly that's already been generated and printed, like a function that came out of the cache. Gets printed as is.
+struct x86Text : public x86Instruction {
+    std::string text;
+
+    x86Text(std::string);
+    void print(llvm::raw_ostream &) const;
+};
+
 // Represents a directive to the assembler, like `.globl`.
 // Again, directives aren't actually instructions, but it's convenient.
 struct x86Directive : public x86Instruction {
@@ -95,6 +171,7 @@ struct x86Directive : public x86Instruction {
 
     x86Directive(std::string);
     void print(llvm::raw_ostream &) const;
+    x86Effects effects(void) const;
 };
 
 // Represents a comment in x86 assembly.
@@ -104,6 +181,7 @@ struct x86Comment : public x86Instruction {
 
     x86Comment(std::string);
     void print(llvm::raw_ostream &) const;
+    x86Effects effects(void) const;
 };
 
 // Represents an instruction with no arguments, like `leave` or `ret`.
@@ -112,6 +190,7 @@ struct x86NoArgInstruction : public x86Instruction {
 
     x86NoArgInstruction(std::string);
     void print(llvm::raw_ostream &) const;
+    x86Effects effects(void) const;
 };
 
 // Represents an instruction with one source argument, like `push`.
@@ -122,6 +201,7 @@ struct x86SrcInstruction : public x86Instruction {
     x86SrcInstruction(std::string, x86Source *);
     ~x86SrcInstruction(void);
     void print(llvm::raw_ostream &) const;
+    x86Effects effects(void) const;
 };
 
 // Represents an instruction with one destination argument, like `pop`.
@@ -132,6 +212,7 @@ struct x86DstInstruction : public x86Instruction {
     x86DstInstruction(std::string, x86Destination *);
     ~x86DstInstruction(void);
     void print(llvm::raw_ostream &) const;
+    x86Effects effects(void) const;
 };
 
 // Represents an instruction with one immediate argument, like `int`.
@@ -152,9 +233,28 @@ struct x86LblInstruction : public x86Instruction {
     std::string opcode;
     x86Label *label;
 
+    // For calls, the registers that the function being called might change. Only the ones the calling convention lets
+    // it change count, so by default it's all of those.
+    x86RegisterSet clobbers = ~x86RegisterSet(0);
+
+    // For calls, how many of the argument registers the function being called reads. Unless we know, it's all six.
+    size_t register_arguments = 6;
+
     x86LblInstruction(std::string, x86Label *);
     // Note that we don't need a destructor because all labels will be deleted by the x86Program destructor
     void print(llvm::raw_ostream &) const;
+    x86Effects effects(void) const;
+};
+
+// Represents a jump through a table of labels, like `jmp *table(,%rax,8)`.
+// The register named @index holds which entry of the table to jump to.
+struct x86TableJump : public x86Instruction {
+    x86Label *table;
+    std::string index;
+
+    x86TableJump(x86Label *, std::string);
+    void print(llvm::raw_ostream &) const;
+    x86Effects effects(void) const;
 };
 
 // Represents an instruction with one source argument and one destination argument, like add or sub.
@@ -166,37 +266,252 @@ struct x86SrcDstInstruction : public x86Instruction {
     x86SrcDstInstruction(std::string, x86Source *, x86Destination *);
     ~x86SrcDstInstruction(void);
     void print(llvm::raw_ostream &) const;
+    x86Effects effects(void) const;
 };
 
+// Represents a packed vector instruction, like `paddd %xmm1, %xmm0` or `vpaddd %ymm2, %ymm1, %ymm0`. The operands are
+// in AT&T order, so the destination comes last. See vectorize.cpp.
+struct x86VectorInstruction : public x86Instruction {
+    std::string opcode;
+    std::vector<x86Source *> operands;
+
+    x86VectorInstruction(std::string, std::vector<x86Source *>);
+    ~x86VectorInstruction(void);
+    void print(llvm::raw_ostream &) const;
+    x86Effects effects(void) const;
+};
+
+// The size of the System V red zone below %rsp, which leaf functions may use without moving %rsp.
+int64_t const RED_ZONE_SIZE = 128;
+
+// Bookkeeping for one function's stack frame.
+// The prologue and epilogue get printed from this once the whole function has been generated, so they can depend on
+// things we only find out while generating the body, like how many slots got spilled and which registers got used.
+struct x86Frame {
+    // Leaf functions don't set up %rbp. Their slots live in the red zone below %rsp instead.
+    bool frameless;
+
+    // The callee-saved registers this function might have to save, in the order they're saved.
+    std::vector<std::string> callee_saved_registers;
+
+    // The registers that have been handed out as slots in this function.
+    std::set<std::string> used_registers;
+
+    // The lowest offset from %rbp that's in use by a slot.
+    int64_t lowest_offset;
+
+    // The register that slots in this frame are addressed off of.
+    x86Register *base;
+
+    // A slot that code generation can borrow for a moment, eg. to stash a register it needs to clobber.
+    // Only gets made if somebody asks for it.
+    x86Destination *scratch = nullptr;
+
+    x86Frame(bool frameless, std::vector<std::string> const &callee_saved_registers);
+    ~x86Frame(void);
+    std::vector<std::string> saved_registers(void) const;
+    int64_t saved_register_offset(std::string const &) const;
+    int64_t stack_adjustment(void) const;
+};
+
+// The register that frame slots are addressed off of.
+// Offsets are always relative to where %rbp would point if we set it up. In a frameless function this prints as an
+// offset from %rsp instead, shifted so that it names the same slot.
+struct x86FrameRegister : public x86Register {
+    x86Frame const &frame;
+
+    x86FrameRegister(x86Frame const &);
+    void print_as_pointer(llvm::raw_ostream &, int64_t offset) const;
+};
+
+// Sets up a function's stack frame and saves its callee-saved registers.
+// Not a real instruction, but it stands in for a few of them.
+struct x86Prologue : public x86Instruction {
+    x86Frame const &frame;
+
+    x86Prologue(x86Frame const &);
+    void print(llvm::raw_ostream &) const;
+    x86Effects effects(void) const;
+};
+
+// Restores the callee-saved registers and tears down a function's stack frame. Doesn't include the `retq`.
+struct x86Epilogue : public x86Instruction {
+    x86Frame const &frame;
+
+    x86Epilogue(x86Frame const &);
+    void print(llvm::raw_ostream &) const;
+    x86Effects effects(void) const;
+};
+
+// Things the driver can ask for on the command line that change the code we generate.
+struct x86Options {
+    // Whether to narrate what's going on to stderr while generating code. Only for one program at a time, since
+    // several at once would get jumbled together.
+    bool trace = true;
+
+    // Edge profiling, for --instrument. Every counter is a quadword in .bss that gets bumped at the start or at the end
+    // of a block, and they all get written to profile_path when the program exits. See place_profile_counters.
+    bool instrument = false;
+    std::string profile_path = "codegen.profile";
+    size_t counter_count = 0;
+    std::map<llvm::BasicBlock const *, std::vector<size_t>> counters_at_start;
+    std::map<llvm::BasicBlock const *, std::vector<size_t>> counters_at_end;
+
+    // How many times each block ran, from the profile given with --profile. Empty if there isn't one.
+    std::map<llvm::BasicBlock const *, uint64_t> block_counts;
+
+    // Per-function timing, for --time. Every function adds up the cycles it takes and how many times it's called, and
+    // the totals get printed to stderr when the program exits.
+    bool time_functions = false;
+
+    // How wide the vector registers are on the target, for --target: 128 bits for SSE4.1, 256 for AVX2, or 0 to leave
+    // loops alone.
+    unsigned vector_bits = 0;
+
+    // How many iterations of a counted loop to do per trip around it, for --unroll. 1 leaves loops alone.
+    unsigned unroll_factor = 4;
+};
+
+// A loop that's a single block, counts up by one, and adds, subtracts or multiplies arithmetic on the count into
+// accumulators. With a vector target, it gets run several iterations at a time on the way in, and the loop itself
+// finishes off the rest. See vectorize.cpp.
+struct x86VectorLoop {
+    // The block that jumps into the loop.
+    llvm::BasicBlock const *preheader;
+
+    // The count, which goes around again while bumping it by one leaves it @predicate @bound.
+    llvm::PHINode const *induction;
+    llvm::Value const *bound;
+    llvm::CmpInst::Predicate predicate;
+
+    // The accumulators. What updates each one is its incoming value from the loop.
+    std::vector<llvm::PHINode const *> reductions;
+
+    // The arithmetic in the loop that the vectorized loop does too, in order: what computes what gets accumulated, and
+    // the accumulating.
+    std::vector<llvm::Instruction const *> computations;
+
+    // The vector register that everything lives in in the vectorized loop: the count, the accumulators (under their
+    // phi nodes), the computations, and everything from outside the loop that they use.
+    std::map<llvm::Value const *, unsigned> registers;
+    unsigned step_register;
+};
+
+// Returns whether @block is a loop that x86Program::find_vector_loops would vectorize.
+bool vectorizable_loop(llvm::BasicBlock const &block);
+
 // The program. This is the main thing you need to fill out.
 struct x86Program {
     // The sequence of instructions that makes up the program.
     std::vector<x86Instruction *> instructions;
 
-    // Maps IR basic blocks to x86 labels.
+    // Constant data, like jump tables. Gets printed in .rodata after all the instructions.
+    std::vector<x86Instruction *> read_only_data;
+
+    // Data that starts out zeroed, like profile counters. Gets printed in .bss after the constant data.
+    std::vector<x86Instruction *> zeroed_data;
+
+    // What the driver asked for.
+    x86Options const options;
+
+    // The start of the profile counters, if the program is instrumented.
+    x86Label *profile_counters = nullptr;
+
+    // The tables of cycles and calls for each function, how deep each function is in calls to itself and when its
+    // outermost call started, and which entry in them each function gets, for --time.
+    x86Label *timing_cycles = nullptr;
+    x86Label *timing_calls = nullptr;
+    x86Label *timing_depths = nullptr;
+    x86Label *timing_starts = nullptr;
+    std::map<llvm::Function const *, size_t> timing_indices;
+    x86Label *number_printer = nullptr;
+
+    // Maps the IR basic blocks of the function being generated to x86 labels.
     std::map<llvm::BasicBlock const *, x86Label *> labels;
 
-    // Maps IR phi nodes to x86 labels.
+    // The registers that each function generated so far might change for whoever calls it, out of the ones the calling
+    // convention lets it change. Calls to those functions only have to save what's in here. See run_machine_passes.
+    std::map<llvm::Function const *, x86RegisterSet> clobbers;
+
+    // Maps functions to the labels that calls to them go to. These last as long as the program does, since calls can
+    // come from anywhere.
+    std::map<llvm::Function const *, x86Label *> function_labels;
+
+    // Maps IR phi nodes in the function being generated to x86 labels.
     std::map<std::pair<llvm::BasicBlock const *, llvm::BasicBlock const *>, x86Label *> phi_node_labels;
 
-    x86Program(llvm::Module const &);
+    // The blocks of the function being generated that move_cold_blocks put at the end of it, which go in
+    // .text.unlikely, and the edges from the bottoms of its loops back up to their tops, whose targets get aligned.
+    std::set<llvm::BasicBlock const *> cold_blocks;
+    std::set<std::pair<llvm::BasicBlock const *, llvm::BasicBlock const *>> back_edges;
+
+    // The frames of the functions that have been generated since the last flush.
+    std::vector<x86Frame *> frames;
+
+    // The frame of the function we're currently generating.
+    x86Frame *frame = nullptr;
+
+    // The comparison whose result is in the flags right now, or null if we don't know what's in them.
+    llvm::Value const *flags = nullptr;
+
+    x86Program(llvm::Module const &, x86Options const & = x86Options());
     ~x86Program(void);
-    void print(llvm::raw_ostream &) const;
+    void flush(llvm::raw_ostream &);
+    void release_function(void);
+    void print(llvm::raw_ostream &);
+    void make_labels(llvm::Function const &);
+    x86Label *function_label(llvm::Function const &);
+    void insert_profile_writer(void);
+    void insert_timing_report(llvm::Module const &);
+    void insert_number_printer(void);
+    void insert_time_stamp(void);
+    void begin_function(llvm::Function const &);
+    void end_function(void);
+    llvm::BasicBlock const *next_block(llvm::BasicBlock const &);
+    llvm::BasicBlock const *previous_block(llvm::BasicBlock const &);
+    void allocate_slots(llvm::Function const &);
     x86Destination *acquire_slot(llvm::Value const &);
     x86Destination *query_slot(llvm::Value const &);
-    void release_slot(llvm::Value const &);
-    void back_up_slots(x86Label *);
-    void restore_slots(x86Label *);
+    x86Source *query_source(llvm::Value const &);
+    llvm::ConstantInt const *constant_value(llvm::Value const &);
     void insert_instruction(x86Instruction *);
+    void insert_generated_function(llvm::Function const &, std::string const &text, std::string const &data, x86RegisterSet clobbers);
+    void insert_move(x86Source *, x86Destination *, unsigned bits, bool keep_flags = false);
+    void insert_parallel_move(std::vector<std::pair<x86Source *, x86Destination *>>);
+    void insert_counters(std::map<llvm::BasicBlock const *, std::vector<size_t>> const &, llvm::BasicBlock const &);
     void handle_block_begin(llvm::BasicBlock const &);
-    void dust_out_slots(llvm::BasicBlock::const_iterator);
     void handle_call(llvm::BasicBlock::const_iterator);
     void handle_ret(llvm::BasicBlock::const_iterator);
     void handle_br(llvm::BasicBlock::const_iterator);
+    void handle_switch(llvm::BasicBlock::const_iterator);
+    void insert_switch_tree(x86Destination *, unsigned bits, std::vector<std::pair<int64_t, llvm::BasicBlock const *>> const &, size_t, size_t,
+                            llvm::BasicBlock const *, x86Label *);
+    x86Label *edge_label(llvm::BasicBlock const *, llvm::BasicBlock const *);
+    std::pair<std::string, std::string> condition_codes(llvm::Value const &);
 
     // Added as part of Project 3
     void handle_binop(llvm::BasicBlock::const_iterator, std::string op);
     void handle_icmp(llvm::BasicBlock::const_iterator);
+    void handle_select(llvm::BasicBlock::const_iterator);
+    void handle_cast(llvm::BasicBlock::const_iterator);
+    void insert_division(llvm::BinaryOperator const &);
+
+    // Loops that get vectorized, by loop block, and how to vectorize them. See vectorize.cpp.
+    std::map<llvm::BasicBlock const *, x86VectorLoop> vector_loops;
+    void find_vector_loops(llvm::Function const &);
+    void insert_vector_loop(llvm::BasicBlock const &);
+
+    // Cleans up the generated code for the function that was just generated, and works out what it clobbers. See
+    // machine.cpp.
+    void run_machine_passes(llvm::Function const &);
+
+    // Memory instructions
+    void handle_alloca(llvm::BasicBlock::const_iterator);
+    void handle_load(llvm::BasicBlock::const_iterator);
+    void handle_store(llvm::BasicBlock::const_iterator);
+    x86Destination *allocate_stack(int64_t size);
+    x86Destination *scratch_slot(void);
+    x86Destination *query_address(llvm::Value const &);
 
     // I recommend that you not directly access the following data structures.
     // They are best accessed through the methods.
@@ -204,23 +519,54 @@ struct x86Program {
     // Note that %rbp and %rsp are callee-saved as well, but those get handled by the function prologue, leave, and ret.
     std::vector<std::string> const CALLEE_SAVED_REGISTERS{"rbx", "r12", "r13", "r14", "r15"};
 
-    // Note that %rdi is caller-saved as well, but it's also used for argument passing so we won't deal with it here.
-    std::vector<std::string> const CALLER_SAVED_REGISTERS{"rcx", "rdx", "rsi", "r8", "r9", "r10", "r11"};
+    std::vector<std::string> const CALLER_SAVED_REGISTERS{"rcx", "rdx", "rsi", "rdi", "r8", "r9", "r10", "r11"};
+
+    // The System V argument registers, in order. Any arguments past these get passed on the stack.
+    std::vector<std::string> const ARGUMENT_REGISTERS{"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
 
     // This is the location of the top of the stack as an offset from %rbp.
     // Used for getting stack allocations
     int64_t top_of_stack = -8 * CALLEE_SAVED_REGISTERS.size();
 
+    // Incoming stack arguments can be reused as slots once the argument dies. They go after all the spill slots.
+    int64_t const STACK_ARGUMENT_PRIORITY = 1 << 30;
+
+    // Switches with at least this many cases get a jump table, as long as at least this many percent of the entries
+    // in the table would go somewhere other than the default.
+    size_t const JUMP_TABLE_MIN_CASES = 4;
+    size_t const JUMP_TABLE_MIN_DENSITY_PERCENT = 40;
+
+    // Switches whose cases all fit in one 64-bit mask and go to only a few places get a bit test per place.
+    size_t const BIT_TEST_MIN_CASES = 3;
+    size_t const BIT_TEST_MAX_DESTINATIONS = 3;
+
     // A slot is just a destination with a priority, for internal use in the priority queue.
     typedef std::pair<int64_t, x86Destination *> slot;
 
     // These are all the register slots.
     // The notable omissions here are %rax, because it's for return values,
-    //                                %rdi, because it's for arguments,
     //                                %rbp, because it's for the base pointer,
     //                                %rsp, because it's for the stack pointer
-    std::map<std::string, uint64_t> const REGISTER_PRIORITIES{{"rbx", -12}, {"rcx", -11}, {"rdx", -10}, {"rsi", -9}, {"r8", -8},  {"r9", -7},
-                                                              {"r10", -6},  {"r11", -5},  {"r12", -4},  {"r13", -3}, {"r14", -2}, {"r15", -1}};
+    std::map<std::string, uint64_t> const REGISTER_PRIORITIES{{"rbx", -13}, {"rcx", -12}, {"rdx", -11}, {"rsi", -10}, {"rdi", -9},
+                                                              {"r8", -8},   {"r9", -7},   {"r10", -6},  {"r11", -5},  {"r12", -4},
+                                                              {"r13", -3},  {"r14", -2},  {"r15", -1}};
+
+    // A leaf function doesn't call anything that could change the caller-saved registers under it, so it takes those
+    // first and only has to save a callee-saved one once it runs out. It starts from the ones that callers, going by
+    // the order above, are least likely to keep something in across the call.
+    std::map<std::string, uint64_t> const LEAF_REGISTER_PRIORITIES{{"r11", -13}, {"r10", -12}, {"r9", -11}, {"r8", -10}, {"rdi", -9},
+                                                                   {"rsi", -8},  {"rdx", -7},  {"rcx", -6}, {"rbx", -5}, {"r12", -4},
+                                                                   {"r13", -3},  {"r14", -2},  {"r15", -1}};
+
+    // Leaf functions don't need a frame pointer, so they get %rbp as an extra register. It's callee-saved, so it goes last.
+    std::pair<std::string, int64_t> const FRAME_POINTER_PRIORITY{"rbp", 0};
+
+    // Maps each alloca in the current function to the piece of its frame that it points to.
+    // Note that these aren't slots; the alloca's own value (the address) only gets a slot if it's used as a value.
+    std::map<llvm::Value const *, x86Destination *> stack_allocations;
+
+    // The register slots, by name. They get reused by every function.
+    std::map<std::string, x86Register *> register_slots;
 
     // This exists only for the priority queue.
     struct slot_comparator {
@@ -229,14 +575,23 @@ struct x86Program {
         }
     };
 
-    // The available slots.
+    // Helpers for allocate_slots. See allocator.cpp.
+    slot new_stack_slot(void);
+    slot take_slot(void);
+    slot take_register_slot(std::string const &);
+
+    // The available slots. Only meaningful while allocate_slots is walking through the function.
     std::priority_queue<slot, std::vector<slot>, slot_comparator> available_slots;
 
-    // Map from each LLVM instruction with a result that currently occupies a slot to that slot.
-    // The reason this can't just map to x86Destination * is that we need to reinsert slots from here into the queue.
+    // How many loops deep each block is. Filled in by the driver before any code gets generated.
+    std::map<llvm::BasicBlock const *, unsigned> loop_depths;
+
+    // Map from each value in the current function that needs a slot to the slot allocate_slots picked for it.
+    // The reason this can't just map to x86Destination * is that the allocator needs to reinsert slots from here into
+    // the queue.
     std::map<llvm::Value const *, slot> used_slots;
 
-    // Backup copies of the state of the slots at the entry points to conditional branches. Used to restore the slots to
-    // their previous states when entering the other side of a conditional branch.
-    std::map<x86Label *, std::pair<std::priority_queue<slot, std::vector<slot>, slot_comparator>, std::map<llvm::Value const *, slot>>> slot_backups;
+    // Values that are the same constant no matter what, which get rematerialized as an immediate everywhere they're
+    // used instead of taking up a slot. Filled in by allocate_slots.
+    std::map<llvm::Value const *, llvm::ConstantInt *> rematerialized;
 };